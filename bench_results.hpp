@@ -0,0 +1,624 @@
+/*
+ * Copyright 2022 Rive
+ */
+
+#pragma once
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <random>
+#include <string>
+#include <vector>
+
+// One benchmark run's frame timings. --results appends them to a file as JSON, one object per
+// line, so repeated runs (and every run of a --matrix) accumulate in the same file.
+struct BenchResult
+{
+    std::string backend;    // "vk", "d3d", "llvmpipe", ...
+    std::string config;     // Everything else that identifies what was measured.
+    std::string glRenderer; // What the backend turned out to run on.
+    int bubbles = 0;
+    int width = 0;
+    int height = 0;
+    uint64_t seed = 0;
+    std::vector<double> frameMs; // From one presented frame to the next, after the warmup.
+
+    // Runs with the same key measure the same thing.
+    std::string key() const
+    {
+        return backend + " " + config + ", " + std::to_string(bubbles) + " bubbles, " +
+               std::to_string(width) + "x" + std::to_string(height) + ", seed " +
+               std::to_string(seed);
+    }
+};
+
+static inline void write_json_string(FILE* file, const std::string& str)
+{
+    fputc('"', file);
+    for (unsigned char c : str)
+    {
+        if (c == '"' || c == '\\')
+        {
+            fprintf(file, "\\%c", c);
+        }
+        else if (c < 0x20)
+        {
+            fprintf(file, "\\u%04x", c);
+        }
+        else
+        {
+            fputc(c, file);
+        }
+    }
+    fputc('"', file);
+}
+
+// Appends 'result' to 'path', as one line of JSON. Returns false, after printing why, if it can't.
+static inline bool append_bench_result(const char* path, const BenchResult& result)
+{
+    FILE* file = fopen(path, "a");
+    if (!file)
+    {
+        fprintf(stderr, "Failed to open %s for appending.\n", path);
+        return false;
+    }
+    fprintf(file, "{\"backend\":");
+    write_json_string(file, result.backend);
+    fprintf(file, ",\"config\":");
+    write_json_string(file, result.config);
+    fprintf(file, ",\"gl_renderer\":");
+    write_json_string(file, result.glRenderer);
+    fprintf(file,
+            ",\"bubbles\":%i,\"width\":%i,\"height\":%i,\"seed\":%llu,\"frame_ms\":[",
+            result.bubbles,
+            result.width,
+            result.height,
+            static_cast<unsigned long long>(result.seed));
+    for (size_t i = 0; i < result.frameMs.size(); ++i)
+    {
+        fprintf(file, i ? ",%.4f" : "%.4f", result.frameMs[i]);
+    }
+    fprintf(file, "]}\n");
+    if (fclose(file) != 0)
+    {
+        fprintf(stderr, "Failed to write %s.\n", path);
+        return false;
+    }
+    return true;
+}
+
+// Just enough JSON for what append_bench_result() writes: one flat object per line, whose values
+// are strings, numbers, or arrays of numbers. Unknown keys are skipped.
+class BenchResultParser
+{
+public:
+    explicit BenchResultParser(const char* text) : m_p(text) {}
+
+    bool parse(BenchResult* result)
+    {
+        if (!consume('{'))
+        {
+            return false;
+        }
+        if (consume('}'))
+        {
+            return true;
+        }
+        do
+        {
+            std::string key, str;
+            double number;
+            if (!parseString(&key) || !consume(':'))
+            {
+                return false;
+            }
+            skipSpace();
+            if (*m_p == '"')
+            {
+                if (!parseString(&str))
+                {
+                    return false;
+                }
+                if (std::string* field = stringField(result, key))
+                {
+                    *field = std::move(str);
+                }
+            }
+            else if (*m_p == '[')
+            {
+                ++m_p;
+                bool frameMs = key == "frame_ms";
+                if (frameMs)
+                {
+                    result->frameMs.clear();
+                }
+                if (!consume(']'))
+                {
+                    do
+                    {
+                        if (!parseNumber(&number))
+                        {
+                            return false;
+                        }
+                        if (frameMs)
+                        {
+                            result->frameMs.push_back(number);
+                        }
+                    } while (consume(','));
+                    if (!consume(']'))
+                    {
+                        return false;
+                    }
+                }
+            }
+            else if (parseNumber(&number))
+            {
+                if (int* field = intField(result, key))
+                {
+                    *field = static_cast<int>(number);
+                }
+                else if (key == "seed")
+                {
+                    result->seed = static_cast<uint64_t>(number);
+                }
+            }
+            else
+            {
+                return false;
+            }
+        } while (consume(','));
+        return consume('}');
+    }
+
+private:
+    static std::string* stringField(BenchResult* result, const std::string& key)
+    {
+        return key == "backend"       ? &result->backend
+               : key == "config"      ? &result->config
+               : key == "gl_renderer" ? &result->glRenderer
+                                      : nullptr;
+    }
+
+    static int* intField(BenchResult* result, const std::string& key)
+    {
+        return key == "bubbles"  ? &result->bubbles
+               : key == "width"  ? &result->width
+               : key == "height" ? &result->height
+                                 : nullptr;
+    }
+
+    void skipSpace()
+    {
+        while (*m_p == ' ' || *m_p == '\t' || *m_p == '\r' || *m_p == '\n')
+        {
+            ++m_p;
+        }
+    }
+
+    bool consume(char c)
+    {
+        skipSpace();
+        if (*m_p != c)
+        {
+            return false;
+        }
+        ++m_p;
+        return true;
+    }
+
+    bool parseString(std::string* str)
+    {
+        if (!consume('"'))
+        {
+            return false;
+        }
+        str->clear();
+        while (*m_p != '"')
+        {
+            if (*m_p == '\0')
+            {
+                return false;
+            }
+            if (*m_p == '\\')
+            {
+                ++m_p;
+                if (*m_p == 'u')
+                {
+                    // Only the control characters that write_json_string() escapes.
+                    char hex[5] = {};
+                    for (int i = 0; i < 4 && m_p[i + 1]; ++i)
+                    {
+                        hex[i] = m_p[i + 1];
+                    }
+                    str->push_back(static_cast<char>(strtol(hex, nullptr, 16)));
+                    m_p += strlen(hex) + 1;
+                    continue;
+                }
+                if (*m_p == '\0')
+                {
+                    return false;
+                }
+            }
+            str->push_back(*m_p++);
+        }
+        ++m_p;
+        return true;
+    }
+
+    bool parseNumber(double* number)
+    {
+        skipSpace();
+        char* end;
+        *number = strtod(m_p, &end);
+        if (end == m_p)
+        {
+            return false;
+        }
+        m_p = end;
+        return true;
+    }
+
+    const char* m_p;
+};
+
+// Reads every result in a file that --results wrote. Returns false, after printing why, if the
+// file can't be read or a line isn't a result.
+static inline bool read_bench_results(const char* path, std::vector<BenchResult>* results)
+{
+    FILE* file = fopen(path, "rb");
+    if (!file)
+    {
+        fprintf(stderr, "Failed to open %s.\n", path);
+        return false;
+    }
+    std::string line;
+    int lineNumber = 1;
+    auto parseLine = [&]() {
+        if (line.find_first_not_of(" \t\r") == std::string::npos)
+        {
+            return true;
+        }
+        BenchResult result;
+        if (!BenchResultParser(line.c_str()).parse(&result))
+        {
+            fprintf(stderr, "%s:%i: not a benchmark result.\n", path, lineNumber);
+            return false;
+        }
+        results->push_back(std::move(result));
+        return true;
+    };
+    bool valid = true;
+    for (int c; valid && (c = fgetc(file)) != EOF;)
+    {
+        if (c != '\n')
+        {
+            line.push_back(static_cast<char>(c));
+            continue;
+        }
+        valid = parseLine();
+        line.clear();
+        ++lineNumber;
+    }
+    // The last line may have no newline, if the file was cut short or edited by hand.
+    valid = valid && parseLine();
+    fclose(file);
+    return valid;
+}
+
+// Frame times within a run are correlated (a slow frame tends to be followed by another), so the
+// statistics below work on batches of consecutive frames: each run is cut into this many, and
+// each batch contributes its mean.
+constexpr static int kBenchBatchesPerRun = 20;
+constexpr static int kBootstrapIterations = 2000;
+
+static inline std::vector<double> batch_means(const std::vector<double>& frameMs)
+{
+    std::vector<double> means;
+    size_t batches = std::min(frameMs.size(), static_cast<size_t>(kBenchBatchesPerRun));
+    for (size_t i = 0; i < batches; ++i)
+    {
+        size_t begin = frameMs.size() * i / batches, end = frameMs.size() * (i + 1) / batches;
+        double sum = 0;
+        for (size_t j = begin; j < end; ++j)
+        {
+            sum += frameMs[j];
+        }
+        means.push_back(sum / (end - begin));
+    }
+    return means;
+}
+
+// Linearly interpolated quantile, q in [0, 1].
+static inline double quantile(std::vector<double> values, double q)
+{
+    if (values.empty())
+    {
+        return 0;
+    }
+    std::sort(values.begin(), values.end());
+    double position = q * (values.size() - 1);
+    size_t below = static_cast<size_t>(position);
+    size_t above = std::min(below + 1, values.size() - 1);
+    return values[below] + (values[above] - values[below]) * (position - below);
+}
+
+// A value with a 95% confidence interval.
+struct BenchEstimate
+{
+    double value = 0;
+    double low = 0;
+    double high = 0;
+};
+
+// The batch means of each of several runs of one configuration.
+using BenchRuns = std::vector<std::vector<double>>;
+
+static inline BenchRuns bench_runs(const std::vector<const BenchResult*>& results)
+{
+    BenchRuns runs;
+    for (const BenchResult* result : results)
+    {
+        if (!result->frameMs.empty())
+        {
+            runs.push_back(batch_means(result->frameMs));
+        }
+    }
+    return runs;
+}
+
+// Frames per second, from the mean of the runs' mean frame times.
+static inline double bench_fps(const BenchRuns& runs)
+{
+    double ms = 0;
+    for (const std::vector<double>& batches : runs)
+    {
+        double sum = 0;
+        for (double batch : batches)
+        {
+            sum += batch;
+        }
+        ms += sum / batches.size() / runs.size();
+    }
+    return 1e3 / ms;
+}
+
+// A bootstrap replicate of 'runs' that keeps their structure: the runs are resampled, then the
+// batches within each drawn run. Run-to-run variation (clocks, thermals, what else the machine is
+// doing) is usually the larger part, and resampling batches alone would hide it.
+static inline BenchRuns resample_runs(const BenchRuns& runs, std::mt19937& rng)
+{
+    BenchRuns replicate(runs.size());
+    for (std::vector<double>& batches : replicate)
+    {
+        const std::vector<double>& run = runs[rng() % runs.size()];
+        batches.resize(run.size());
+        for (double& batch : batches)
+        {
+            batch = run[rng() % run.size()];
+        }
+    }
+    return replicate;
+}
+
+// fps(runs) / fps(baseline), or just fps(runs) without a baseline, with a percentile bootstrap
+// interval. The seed is fixed, so the same results always print the same intervals.
+static inline BenchEstimate bootstrap_fps(const BenchRuns& runs, const BenchRuns* baseline)
+{
+    auto statistic = [&](const BenchRuns& a, const BenchRuns* b) {
+        return b ? bench_fps(a) / bench_fps(*b) : bench_fps(a);
+    };
+    std::mt19937 rng(1);
+    std::vector<double> replicates(kBootstrapIterations);
+    for (double& replicate : replicates)
+    {
+        BenchRuns resampledBaseline;
+        if (baseline)
+        {
+            resampledBaseline = resample_runs(*baseline, rng);
+        }
+        replicate = statistic(resample_runs(runs, rng), baseline ? &resampledBaseline : nullptr);
+    }
+    BenchEstimate estimate;
+    estimate.value = statistic(runs, baseline);
+    estimate.low = quantile(replicates, .025);
+    estimate.high = quantile(replicates, .975);
+    return estimate;
+}
+
+// The 97.5th percentile of Student's t distribution with 'df' degrees of freedom, for two-sided
+// 95% intervals. Fractional degrees of freedom round down, which only widens the interval.
+static inline double student_t_975(double df)
+{
+    constexpr static double kTable[] = {12.706, 4.303, 3.182, 2.776, 2.571, 2.447, 2.365, 2.306,
+                                        2.262,  2.228, 2.201, 2.179, 2.160, 2.145, 2.131, 2.120,
+                                        2.110,  2.101, 2.093, 2.086, 2.080, 2.074, 2.069, 2.064,
+                                        2.060,  2.056, 2.052, 2.048, 2.045, 2.042};
+    constexpr static int kTableSize = sizeof(kTable) / sizeof(kTable[0]);
+    if (!(df >= 1))
+    {
+        return kTable[0];
+    }
+    if (df < kTableSize + 1)
+    {
+        return kTable[static_cast<int>(df) - 1];
+    }
+    // Beyond the table, the Cornish-Fisher expansion around the normal quantile is within 0.001.
+    double z = 1.959964;
+    return z + (z * z * z + z) / (4 * df) +
+           (5 * z * z * z * z * z + 16 * z * z * z + 3 * z) / (96 * df * df);
+}
+
+// fps(runs) / fps(baseline), with a Welch t interval on the runs' mean frame times (in log space,
+// so the interval is on the ratio). It treats each run as one sample, which is what run-to-run
+// noise calls for; with the few runs a comparison usually has, a bootstrap over them gives
+// intervals that are much too narrow. Both sides need at least two runs.
+static inline BenchEstimate welch_fps_ratio(const BenchRuns& runs, const BenchRuns& baseline)
+{
+    auto logMeans = [](const BenchRuns& side, double* mean, double* variance) {
+        std::vector<double> logs;
+        for (const std::vector<double>& batches : side)
+        {
+            double sum = 0;
+            for (double batch : batches)
+            {
+                sum += batch;
+            }
+            logs.push_back(log(sum / batches.size()));
+        }
+        *mean = 0;
+        for (double x : logs)
+        {
+            *mean += x / logs.size();
+        }
+        *variance = 0;
+        for (double x : logs)
+        {
+            *variance += (x - *mean) * (x - *mean) / (logs.size() - 1);
+        }
+    };
+    double mean, variance, baseMean, baseVariance;
+    logMeans(runs, &mean, &variance);
+    logMeans(baseline, &baseMean, &baseVariance);
+    double a = variance / runs.size(), b = baseVariance / baseline.size();
+    double se = sqrt(a + b);
+    double df = a + b > 0 ? (a + b) * (a + b) /
+                                (a * a / (runs.size() - 1) + b * b / (baseline.size() - 1))
+                          : 1;
+    double margin = student_t_975(df) * se;
+    BenchEstimate estimate;
+    estimate.value = bench_fps(runs) / bench_fps(baseline);
+    estimate.low = estimate.value * exp(-margin);
+    estimate.high = estimate.value * exp(margin);
+    return estimate;
+}
+
+// The outcome of compare_bench_results().
+enum class CompareResult
+{
+    Passed,
+    Regressed,
+    Invalid, // The files couldn't be read, or had no configuration in common.
+};
+
+// Compares the runs in 'candidatePath' against those in 'baselinePath', configuration by
+// configuration (see BenchResult::key()), and prints a table. A configuration regressed if the
+// candidate is slower beyond 'threshold' (0.03 for 3%), and the 95% interval of the fps ratio
+// lies entirely below 1, so the slowdown is unlikely to be noise. The interval comes from
+// welch_fps_ratio(). With a single run on either side there is no run-to-run variance to go on,
+// so it comes from bootstrap_fps() instead; that only covers the noise within the run, which is
+// the smaller part, so there the whole interval has to clear the threshold.
+static inline CompareResult compare_bench_results(const char* baselinePath,
+                                                  const char* candidatePath,
+                                                  double threshold)
+{
+    std::vector<BenchResult> baseline, candidate;
+    if (!read_bench_results(baselinePath, &baseline) ||
+        !read_bench_results(candidatePath, &candidate))
+    {
+        return CompareResult::Invalid;
+    }
+    std::vector<std::string> keys;
+    for (const std::vector<BenchResult>* results : {&baseline, &candidate})
+    {
+        for (const BenchResult& result : *results)
+        {
+            if (std::find(keys.begin(), keys.end(), result.key()) == keys.end())
+            {
+                keys.push_back(result.key());
+            }
+        }
+    }
+    auto runsOf = [](const std::vector<BenchResult>& results, const std::string& key) {
+        std::vector<const BenchResult*> matching;
+        for (const BenchResult& result : results)
+        {
+            if (result.key() == key)
+            {
+                matching.push_back(&result);
+            }
+        }
+        return bench_runs(matching);
+    };
+
+    printf("%10s %10s %8s  %-19s %-5s %-10s %s\n",
+           "base fps",
+           "cand fps",
+           "change",
+           "95% CI",
+           "runs",
+           "verdict",
+           "configuration");
+    int compared = 0, regressions = 0;
+    bool singleRuns = false;
+    for (const std::string& key : keys)
+    {
+        BenchRuns baseRuns = runsOf(baseline, key), candRuns = runsOf(candidate, key);
+        if (baseRuns.empty() || candRuns.empty())
+        {
+            printf("%10s %10s %8s  %-19s %-5s %-10s %s\n",
+                   baseRuns.empty() ? "-" : "",
+                   candRuns.empty() ? "-" : "",
+                   "",
+                   "",
+                   "",
+                   "missing",
+                   key.c_str());
+            continue;
+        }
+        ++compared;
+        bool singleRun = baseRuns.size() < 2 || candRuns.size() < 2;
+        BenchEstimate ratio = singleRun ? bootstrap_fps(candRuns, &baseRuns)
+                                        : welch_fps_ratio(candRuns, baseRuns);
+        singleRuns |= singleRun;
+        double margin = singleRun ? threshold : 0;
+        const char* verdict = "ok";
+        if (ratio.high < 1 - margin && ratio.value < 1 - threshold)
+        {
+            verdict = "REGRESSED";
+            ++regressions;
+        }
+        else if (ratio.low > 1 + margin && ratio.value > 1 + threshold)
+        {
+            verdict = "improved";
+        }
+        char interval[32];
+        snprintf(interval,
+                 sizeof(interval),
+                 "[%+.1f%%, %+.1f%%]%s",
+                 (ratio.low - 1) * 100,
+                 (ratio.high - 1) * 100,
+                 singleRun ? "*" : "");
+        char runCounts[24];
+        snprintf(runCounts, sizeof(runCounts), "%zu/%zu", baseRuns.size(), candRuns.size());
+        printf("%10.1f %10.1f %+7.1f%%  %-19s %-5s %-10s %s\n",
+               bench_fps(baseRuns),
+               bench_fps(candRuns),
+               (ratio.value - 1) * 100,
+               interval,
+               runCounts,
+               verdict,
+               key.c_str());
+    }
+    if (singleRuns)
+    {
+        printf("* a single run on one side: the interval leaves out run-to-run noise, so all of it "
+               "has to clear the threshold.\n");
+    }
+    if (compared == 0)
+    {
+        fprintf(stderr,
+                "No configuration appears in both %s and %s.\n",
+                baselinePath,
+                candidatePath);
+        return CompareResult::Invalid;
+    }
+    printf("%i of %i configurations regressed by more than %.1f%%.\n",
+           regressions,
+           compared,
+           threshold * 100);
+    return regressions ? CompareResult::Regressed : CompareResult::Passed;
+}
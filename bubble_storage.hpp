@@ -0,0 +1,433 @@
+/*
+ * Copyright 2022 Rive
+ */
+
+#pragma once
+
+#include <algorithm>
+#include <array>
+#include <cmath>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <type_traits>
+#include <vector>
+
+// Per-instance data exactly as the instanced vertex attributes in "vs" consume it.
+struct Bubble
+{
+    float x, y, r;
+    float dx, dy;
+    std::array<float, 4> color;
+};
+
+// Memory layouts for the CPU-side copy of the bubbles. The GPU always receives AoS (Bubble).
+enum class BubbleLayout
+{
+    AoS,    // Bubble[]: exporting for glBufferData is a memcpy.
+    SoA,    // One array per field: best for long streaming passes over a few fields.
+    AoSoA8, // Blocks of 8 bubbles with each field contiguous inside the block.
+};
+
+// Pointer with a byte stride, so AoS fields index the same as the SIMD-friendly layouts.
+template <typename T> class StridedPtr
+{
+public:
+    StridedPtr(T* ptr, size_t stride) :
+        m_ptr(reinterpret_cast<char*>(const_cast<std::remove_const_t<T>*>(ptr))), m_stride(stride)
+    {}
+    T& operator[](size_t i) const { return *reinterpret_cast<T*>(m_ptr + i * m_stride); }
+
+private:
+    char* m_ptr;
+    size_t m_stride;
+};
+
+// View of a run of bubbles handed to forEachBlock(). Fields are indexed [0, count).
+template <typename P> struct BubbleBlock
+{
+    P x, y, r;
+    P dx, dy;
+    P red, green, blue, alpha;
+};
+
+template <BubbleLayout> class BubbleStore;
+
+template <> class BubbleStore<BubbleLayout::AoS>
+{
+public:
+    constexpr static BubbleLayout kLayout = BubbleLayout::AoS;
+
+    size_t size() const { return m_bubbles.size(); }
+    void resize(size_t n) { m_bubbles.resize(n); }
+
+    float& x(size_t i) { return m_bubbles[i].x; }
+    float& y(size_t i) { return m_bubbles[i].y; }
+    float& r(size_t i) { return m_bubbles[i].r; }
+    float& dx(size_t i) { return m_bubbles[i].dx; }
+    float& dy(size_t i) { return m_bubbles[i].dy; }
+    float& color(size_t i, int c) { return m_bubbles[i].color[c]; }
+    float x(size_t i) const { return m_bubbles[i].x; }
+    float y(size_t i) const { return m_bubbles[i].y; }
+    float r(size_t i) const { return m_bubbles[i].r; }
+    float dx(size_t i) const { return m_bubbles[i].dx; }
+    float dy(size_t i) const { return m_bubbles[i].dy; }
+    float color(size_t i, int c) const { return m_bubbles[i].color[c]; }
+
+    void set(size_t i, const Bubble& bubble) { m_bubbles[i] = bubble; }
+    Bubble get(size_t i) const { return m_bubbles[i]; }
+
+    void exportInterleaved(Bubble* dst, size_t first, size_t count) const
+    {
+        memcpy(dst, m_bubbles.data() + first, count * sizeof(Bubble));
+    }
+
+    // Calls fn(block, baseIdx, count) once over the entire array.
+    template <typename Fn> void forEachBlock(Fn&& fn) const
+    {
+        if (m_bubbles.empty())
+        {
+            return;
+        }
+        Bubble* b = const_cast<Bubble*>(m_bubbles.data());
+        auto field = [b](float* f) { return StridedPtr<const float>(f, sizeof(Bubble)); };
+        BubbleBlock<StridedPtr<const float>> block{field(&b->x),
+                                                   field(&b->y),
+                                                   field(&b->r),
+                                                   field(&b->dx),
+                                                   field(&b->dy),
+                                                   field(&b->color[0]),
+                                                   field(&b->color[1]),
+                                                   field(&b->color[2]),
+                                                   field(&b->color[3])};
+        fn(block, 0, m_bubbles.size());
+    }
+
+private:
+    std::vector<Bubble> m_bubbles;
+};
+
+template <> class BubbleStore<BubbleLayout::SoA>
+{
+public:
+    constexpr static BubbleLayout kLayout = BubbleLayout::SoA;
+
+    size_t size() const { return m_x.size(); }
+    void resize(size_t n)
+    {
+        for (std::vector<float>* field : {&m_x, &m_y, &m_r, &m_dx, &m_dy})
+        {
+            field->resize(n);
+        }
+        for (std::vector<float>& channel : m_color)
+        {
+            channel.resize(n);
+        }
+    }
+
+    float& x(size_t i) { return m_x[i]; }
+    float& y(size_t i) { return m_y[i]; }
+    float& r(size_t i) { return m_r[i]; }
+    float& dx(size_t i) { return m_dx[i]; }
+    float& dy(size_t i) { return m_dy[i]; }
+    float& color(size_t i, int c) { return m_color[c][i]; }
+    float x(size_t i) const { return m_x[i]; }
+    float y(size_t i) const { return m_y[i]; }
+    float r(size_t i) const { return m_r[i]; }
+    float dx(size_t i) const { return m_dx[i]; }
+    float dy(size_t i) const { return m_dy[i]; }
+    float color(size_t i, int c) const { return m_color[c][i]; }
+
+    void set(size_t i, const Bubble& bubble)
+    {
+        m_x[i] = bubble.x;
+        m_y[i] = bubble.y;
+        m_r[i] = bubble.r;
+        m_dx[i] = bubble.dx;
+        m_dy[i] = bubble.dy;
+        for (int c = 0; c < 4; ++c)
+        {
+            m_color[c][i] = bubble.color[c];
+        }
+    }
+    Bubble get(size_t i) const
+    {
+        return {m_x[i],
+                m_y[i],
+                m_r[i],
+                m_dx[i],
+                m_dy[i],
+                {m_color[0][i], m_color[1][i], m_color[2][i], m_color[3][i]}};
+    }
+
+    void exportInterleaved(Bubble* dst, size_t first, size_t count) const
+    {
+        for (size_t i = 0; i < count; ++i)
+        {
+            dst[i] = get(first + i);
+        }
+    }
+
+    // Calls fn(block, baseIdx, count) once over the entire array, every field unit-stride.
+    template <typename Fn> void forEachBlock(Fn&& fn) const
+    {
+        BubbleBlock<const float*> block{m_x.data(),
+                                        m_y.data(),
+                                        m_r.data(),
+                                        m_dx.data(),
+                                        m_dy.data(),
+                                        m_color[0].data(),
+                                        m_color[1].data(),
+                                        m_color[2].data(),
+                                        m_color[3].data()};
+        fn(block, 0, size());
+    }
+
+private:
+    std::vector<float> m_x, m_y, m_r;
+    std::vector<float> m_dx, m_dy;
+    std::array<std::vector<float>, 4> m_color;
+};
+
+template <> class BubbleStore<BubbleLayout::AoSoA8>
+{
+public:
+    constexpr static BubbleLayout kLayout = BubbleLayout::AoSoA8;
+    constexpr static size_t kLanes = 8;
+
+    size_t size() const { return m_size; }
+    void resize(size_t n)
+    {
+        // Padding lanes are zeroed (r=0), so passes may always process full blocks. Shrinking
+        // within the last block leaves old bubbles there, so clear those lanes too.
+        m_blocks.resize((n + kLanes - 1) / kLanes, Block{});
+        for (size_t i = n; i < m_blocks.size() * kLanes; ++i)
+        {
+            set(i, Bubble{});
+        }
+        m_size = n;
+    }
+
+    float& x(size_t i) { return lane(&Block::x, i); }
+    float& y(size_t i) { return lane(&Block::y, i); }
+    float& r(size_t i) { return lane(&Block::r, i); }
+    float& dx(size_t i) { return lane(&Block::dx, i); }
+    float& dy(size_t i) { return lane(&Block::dy, i); }
+    float& color(size_t i, int c) { return m_blocks[i / kLanes].color[c][i % kLanes]; }
+    float x(size_t i) const { return m_blocks[i / kLanes].x[i % kLanes]; }
+    float y(size_t i) const { return m_blocks[i / kLanes].y[i % kLanes]; }
+    float r(size_t i) const { return m_blocks[i / kLanes].r[i % kLanes]; }
+    float dx(size_t i) const { return m_blocks[i / kLanes].dx[i % kLanes]; }
+    float dy(size_t i) const { return m_blocks[i / kLanes].dy[i % kLanes]; }
+    float color(size_t i, int c) const { return m_blocks[i / kLanes].color[c][i % kLanes]; }
+
+    void set(size_t i, const Bubble& bubble)
+    {
+        x(i) = bubble.x;
+        y(i) = bubble.y;
+        r(i) = bubble.r;
+        dx(i) = bubble.dx;
+        dy(i) = bubble.dy;
+        for (int c = 0; c < 4; ++c)
+        {
+            color(i, c) = bubble.color[c];
+        }
+    }
+    Bubble get(size_t i) const
+    {
+        const Block& b = m_blocks[i / kLanes];
+        size_t k = i % kLanes;
+        return {b.x[k],
+                b.y[k],
+                b.r[k],
+                b.dx[k],
+                b.dy[k],
+                {b.color[0][k], b.color[1][k], b.color[2][k], b.color[3][k]}};
+    }
+
+    void exportInterleaved(Bubble* dst, size_t first, size_t count) const
+    {
+        for (size_t i = 0; i < count; ++i)
+        {
+            dst[i] = get(first + i);
+        }
+    }
+
+    // Calls fn(block, baseIdx, kLanes) once per block. The final block may contain padding.
+    template <typename Fn> void forEachBlock(Fn&& fn) const
+    {
+        for (size_t blockIdx = 0; blockIdx < m_blocks.size(); ++blockIdx)
+        {
+            const Block& b = m_blocks[blockIdx];
+            BubbleBlock<const float*> block{b.x,
+                                            b.y,
+                                            b.r,
+                                            b.dx,
+                                            b.dy,
+                                            b.color[0],
+                                            b.color[1],
+                                            b.color[2],
+                                            b.color[3]};
+            fn(block, blockIdx * kLanes, kLanes);
+        }
+    }
+
+    // Number of elements a per-bubble output array needs to absorb the padding lanes.
+    size_t paddedSize() const { return m_blocks.size() * kLanes; }
+
+private:
+    struct alignas(32) Block
+    {
+        float x[kLanes], y[kLanes], r[kLanes];
+        float dx[kLanes], dy[kLanes];
+        float color[4][kLanes];
+    };
+
+    float& lane(float (Block::*field)[kLanes], size_t i)
+    {
+        return (m_blocks[i / kLanes].*field)[i % kLanes];
+    }
+
+    std::vector<Block> m_blocks;
+    size_t m_size = 0;
+};
+
+template <BubbleLayout L> size_t padded_size(const BubbleStore<L>& store)
+{
+    if constexpr (L == BubbleLayout::AoSoA8)
+    {
+        return store.paddedSize();
+    }
+    else
+    {
+        return store.size();
+    }
+}
+
+// GLSL mod(): result has the sign of b.
+static inline float glsl_mod(float a, float b) { return a - b * floorf(a / b); }
+
+// CPU equivalent of the motion in "vs": advances each bubble by speed * T and bounces it off the
+// window edges. Writes centers to cx[] and cy[], which must hold padded_size(store) elements.
+template <BubbleLayout L>
+void animate_bubbles(const BubbleStore<L>& store, float T, float w, float h, float* cx, float* cy)
+{
+    store.forEachBlock([=](const auto& b, size_t base, size_t count) {
+        float* __restrict outX = cx + base;
+        float* __restrict outY = cy + base;
+        for (size_t k = 0; k < count; ++k)
+        {
+            float r = b.r[k];
+            float spanX = w - 2 * r;
+            float spanY = h - 2 * r;
+            float mx = glsl_mod(b.x[k] + b.dx[k] * T - r, spanX * 2);
+            float my = glsl_mod(b.y[k] + b.dy[k] * T - r, spanY * 2);
+            outX[k] = spanX - fabsf(spanX - mx) + r;
+            outY[k] = spanY - fabsf(spanY - my) + r;
+        }
+    });
+}
+
+// Moves each bubble's base position dT frames forward along the closed-form motion, folded
+// back into [r, r + 2 * span) so "vs" and animate_bubbles() reach the same centers from the new
+// base. Evaluated in double precision, so callers can keep the T they pass to the float motion
+// math small.
+template <BubbleLayout L> void rebase_bubbles(BubbleStore<L>& store, double dT, float w, float h)
+{
+    auto fold = [dT](float& x, float dx, float r, float extent) {
+        double period = 2.0 * (extent - 2 * r);
+        if (period > 0)
+        {
+            double p = static_cast<double>(x) - r + dx * dT;
+            x = static_cast<float>(p - period * floor(p / period) + r);
+        }
+    };
+    for (size_t i = 0; i < store.size(); ++i)
+    {
+        fold(store.x(i), store.dx(i), store.r(i), w);
+        fold(store.y(i), store.dy(i), store.r(i), h);
+    }
+}
+
+// Writes the indices of bubbles that touch [l, r) x [t, b) to visible[] and returns the count.
+// visible[] must hold padded_size(store) elements.
+template <BubbleLayout L>
+size_t cull_bubbles(const BubbleStore<L>& store,
+                    const float* cx,
+                    const float* cy,
+                    float l,
+                    float t,
+                    float r,
+                    float b,
+                    uint32_t* visible)
+{
+    size_t n = store.size();
+    size_t count = 0;
+    store.forEachBlock([&](const auto& blk, size_t base, size_t laneCount) {
+        for (size_t k = 0; k < laneCount; ++k)
+        {
+            float rad = blk.r[k];
+            size_t i = base + k;
+            bool hit = (cx[i] + rad > l) & (cx[i] - rad < r) & (cy[i] + rad > t) &
+                       (cy[i] - rad < b) & (i < n);
+            visible[count] = static_cast<uint32_t>(i);
+            count += hit;
+        }
+    });
+    return count;
+}
+
+// Bins bubbles into horizontal bands of 'bandHeight' rows, counting-sort style. bandStart[] gets
+// numBands + 1 offsets into the binned list, which is filled with bubble indices grouped by band
+// (a bubble that straddles bands is listed in each of them). Storage for the list comes from
+// allocBinned(count), so the caller decides where frame data lives. Returns the binned list.
+template <BubbleLayout L, typename AllocFn>
+uint32_t* bin_bubbles(const BubbleStore<L>& store,
+                      const float* cy,
+                      int bandHeight,
+                      int numBands,
+                      uint32_t* bandStart,
+                      AllocFn&& allocBinned)
+{
+    size_t n = store.size();
+    std::fill(bandStart, bandStart + numBands + 1, 0);
+    // Pad the radius by a pixel so the antialiased fringe lands in the same bands as the bubble.
+    auto bandRange = [=](float y, float r, int* first, int* last) {
+        *first = std::max(static_cast<int>(floorf((y - r - 1) / bandHeight)), 0);
+        *last = std::min(static_cast<int>(floorf((y + r + 1) / bandHeight)), numBands - 1);
+    };
+    store.forEachBlock([&](const auto& blk, size_t base, size_t laneCount) {
+        for (size_t k = 0; k < laneCount && base + k < n; ++k)
+        {
+            int first, last;
+            bandRange(cy[base + k], blk.r[k], &first, &last);
+            for (int band = first; band <= last; ++band)
+            {
+                ++bandStart[band + 1];
+            }
+        }
+    });
+    for (int band = 0; band < numBands; ++band)
+    {
+        bandStart[band + 1] += bandStart[band];
+    }
+    uint32_t* binned = allocBinned(static_cast<size_t>(bandStart[numBands]));
+    // Use bandStart[band] as the write cursor, then shift the array back into place afterwards.
+    store.forEachBlock([&](const auto& blk, size_t base, size_t laneCount) {
+        for (size_t k = 0; k < laneCount && base + k < n; ++k)
+        {
+            int first, last;
+            bandRange(cy[base + k], blk.r[k], &first, &last);
+            for (int band = first; band <= last; ++band)
+            {
+                binned[bandStart[band]++] = static_cast<uint32_t>(base + k);
+            }
+        }
+    });
+    for (int band = numBands; band > 0; --band)
+    {
+        bandStart[band] = bandStart[band - 1];
+    }
+    bandStart[0] = 0;
+    return binned;
+}
@@ -4,148 +4,1641 @@
 
 #include "glad/glad.h"
 #include "GLFW/glfw3.h"
+#include "bench_results.hpp"
+#include "bubble_storage.hpp"
+#include "control_socket.hpp"
+#include "cpu_raster.hpp"
+#include "frame_arena.hpp"
+#include "frame_capture.hpp"
+#include "frame_pipeline.hpp"
+#include "gl_program.hpp"
+#include "gl_worker.hpp"
+#include "golden_test.hpp"
+#include "gpu_lifecycle.hpp"
+#include "gpu_physics.hpp"
+#include "instance_fetch.hpp"
+#include "instance_uploader.hpp"
+#include "lifecycle.hpp"
+#include "morton_sort.hpp"
+#include "physics.hpp"
+#include "scene.hpp"
+#include "shader_variants.hpp"
+#include "sim_clock.hpp"
+#include "video_output.hpp"
+#include <algorithm>
 #include <array>
+#include <atomic>
 #include <chrono>
+#include <climits>
 #include <cmath>
-#include <sstream>
+#include <cstring>
+#include <filesystem>
+#include <memory>
+#include <new>
 #include <string>
+#include <thread>
 #include <vector>
+#ifdef _WIN32
+#include <process.h>
+#else
+#include <spawn.h>
+#include <sys/wait.h>
+#include <unistd.h>
+extern char** environ;
+#endif
 
-constexpr static char vs[] = R"(#version 310 es
-precision highp float;
-uniform vec2 window;
-uniform float T;
-layout(location=0) in vec3 bubble;
-layout(location=1) in vec2 speed;
-layout(location=2) in vec4 incolor;
-out vec2 coord;
-out vec4 color;
-void main() {
-    vec2 offset = vec2((gl_VertexID & 1) == 0 ? -1.0 : 1.0, (gl_VertexID & 2) == 0 ? -1.0 : 1.0);
-    coord = offset;
-    color = incolor;
-    float r = bubble.z;
-    vec2 center = bubble.xy + speed * T;
-    vec2 span = window - 2.0 * r;
-    center = span - abs(span - mod(center - r, span * 2.0)) + r;
-    gl_Position.xy = (center + offset * r) * 2.0 / window - 1.0;
-    gl_Position.zw = vec2(0, 1);
-})";
-
-constexpr static char fs[] = R"(#version 310 es
-precision mediump float;
-
-in vec2 coord;
-in vec4 color;
-
-layout(binding=0, r32ui) uniform highp coherent writeonly uimage2D framebuffer;
-
-void main() {
-    ivec2 pixelCoord = ivec2(floor(gl_FragCoord.xy));
-    float f = coord.x * coord.x + coord.y * coord.y - 1.0;
-    float coverage = clamp(.5 - f/fwidth(f), 0.0, 1.0);
-    vec4 s = vec4(color.rgb, 1) * (color.a * mix(.25, 1.0, dot(coord, coord)) * coverage);
-    imageStore(framebuffer, pixelCoord, uvec4(packUnorm4x8(s)));
-})";
-
-static bool compile_and_attach_shader(GLuint program, GLuint type, const char* source)
+// Counts every allocation made through operator new, so we can verify that the CPU pipeline's
+// steady state never touches the heap.
+static std::atomic<uint64_t> g_heapAllocations{0};
+
+#if defined(__GNUC__) && !defined(__clang__)
+// GCC flags free() on memory from operator new once these replacements get inlined.
+#pragma GCC diagnostic ignored "-Wmismatched-new-delete"
+#endif
+
+void* operator new(size_t size)
+{
+    g_heapAllocations.fetch_add(1, std::memory_order_relaxed);
+    if (void* ptr = malloc(size ? size : 1))
+    {
+        return ptr;
+    }
+    throw std::bad_alloc();
+}
+
+void* operator new(size_t size, std::align_val_t align)
+{
+    g_heapAllocations.fetch_add(1, std::memory_order_relaxed);
+    size_t alignment = std::max(static_cast<size_t>(align), sizeof(void*));
+#ifdef _MSC_VER
+    void* ptr = _aligned_malloc(size ? size : 1, alignment);
+#else
+    void* ptr = nullptr;
+    if (posix_memalign(&ptr, alignment, size ? size : 1) != 0)
+    {
+        ptr = nullptr;
+    }
+#endif
+    if (ptr)
+    {
+        return ptr;
+    }
+    throw std::bad_alloc();
+}
+
+void operator delete(void* ptr) noexcept { free(ptr); }
+
+void operator delete(void* ptr, size_t) noexcept { free(ptr); }
+
+void operator delete(void* ptr, std::align_val_t) noexcept
 {
-    GLuint shader = glCreateShader(type);
-    glShaderSource(shader, 1, &source, nullptr);
-    glCompileShader(shader);
-    GLint isCompiled = 0;
-    glGetShaderiv(shader, GL_COMPILE_STATUS, &isCompiled);
-    if (isCompiled == GL_FALSE)
-    {
-        GLint maxLength = 0;
-        glGetShaderiv(shader, GL_INFO_LOG_LENGTH, &maxLength);
-        std::vector<GLchar> infoLog(maxLength);
-        glGetShaderInfoLog(shader, maxLength, &maxLength, &infoLog[0]);
-        fprintf(stderr, "Failed to compile shader\n");
-        int l = 1;
-        std::stringstream stream(source);
-        std::string lineStr;
-        while (std::getline(stream, lineStr, '\n'))
-        {
-            fprintf(stderr, "%4i| %s\n", l++, lineStr.c_str());
-        }
-        fprintf(stderr, "%s\n", &infoLog[0]);
-        fflush(stderr);
-        glDeleteShader(shader);
+#ifdef _MSC_VER
+    _aligned_free(ptr);
+#else
+    free(ptr);
+#endif
+}
+
+void operator delete(void* ptr, size_t, std::align_val_t align) noexcept
+{
+    operator delete(ptr, align);
+}
+
+static int W = 2048;
+static int H = 2048;
+
+// Layout of the CPU-side bubble storage. Override with -DBUBBLES_LAYOUT=AoS|SoA|AoSoA8.
+#ifndef BUBBLES_LAYOUT
+#define BUBBLES_LAYOUT AoSoA8
+#endif
+using Bubbles = BubbleStore<BubbleLayout::BUBBLES_LAYOUT>;
+
+double now()
+{
+    auto now = std::chrono::high_resolution_clock::now();
+    return std::chrono::time_point_cast<std::chrono::nanoseconds>(now).time_since_epoch().count() *
+           1e-9;
+}
+
+// Factor that shrinks the bubbles until they cover about 35% of the default canvas. A collision
+// simulation needs room to move; the closed-form scene overlaps heavily.
+template <BubbleLayout L> static float simulation_radius_scale(const BubbleStore<L>& bubbles)
+{
+    // M_PI isn't standard, and MSVC only defines it with _USE_MATH_DEFINES.
+    constexpr double kPi = 3.14159265358979323846;
+    double area = 0;
+    for (size_t i = 0; i < bubbles.size(); ++i)
+    {
+        area += kPi * bubbles.r(i) * bubbles.r(i);
+    }
+    return static_cast<float>(std::min(sqrt(.35 * W * H / area), 1.0));
+}
+
+// Applies simulation_radius_scale() to the radii, and to the speeds with them.
+template <BubbleLayout L> static void fit_bubbles_for_simulation(BubbleStore<L>& bubbles)
+{
+    float scale = simulation_radius_scale(bubbles);
+    for (size_t i = 0; i < bubbles.size(); ++i)
+    {
+        bubbles.r(i) *= scale;
+        bubbles.dx(i) *= scale;
+        bubbles.dy(i) *= scale;
+    }
+}
+
+// Returns the fastest of several runs of fn(), in nanoseconds per bubble.
+template <typename Fn> static double time_pass(size_t n, Fn&& fn)
+{
+    int reps = std::max(3, static_cast<int>(2e7 / n));
+    double best = 1e30;
+    for (int i = 0; i < reps; ++i)
+    {
+        double t0 = now();
+        fn();
+        best = std::min(best, now() - t0);
+    }
+    return best * 1e9 / n;
+}
+
+template <BubbleLayout L> static void bench_layout(const char* name, size_t n)
+{
+    BubbleStore<L> bubbles;
+    generate_scene(bubbles, n, SceneParams());
+    size_t padded = padded_size(bubbles);
+    std::vector<float> cx(padded), cy(padded);
+    std::vector<uint32_t> visible(padded);
+    constexpr int bandHeight = 64;
+    int numBands = H / bandHeight;
+    std::vector<uint32_t> bandStart(numBands + 1);
+    std::vector<uint32_t> binned;
+    std::vector<Bubble> exported(n);
+    float T = 1000;
+    float w = static_cast<float>(W), h = static_cast<float>(H);
+
+    double animate =
+        time_pass(n, [&]() { animate_bubbles(bubbles, T, w, h, cx.data(), cy.data()); });
+    size_t numVisible = 0;
+    double cull = time_pass(n, [&]() {
+        numVisible =
+            cull_bubbles(bubbles, cx.data(), cy.data(), 0, 0, W * .5f, H * .5f, visible.data());
+    });
+    double bin = time_pass(n, [&]() {
+        bin_bubbles(bubbles, cy.data(), bandHeight, numBands, bandStart.data(), [&](size_t count) {
+            binned.resize(count);
+            return binned.data();
+        });
+    });
+    double exportTime = time_pass(n, [&]() { bubbles.exportInterleaved(exported.data(), 0, n); });
+    printf("%-7s %8zu %10.3f %10.3f %10.3f %10.3f   (%zu visible)\n",
+           name,
+           n,
+           animate,
+           cull,
+           bin,
+           exportTime,
+           numVisible);
+    fflush(stdout);
+}
+
+// Microbenchmarks the CPU passes (ns per bubble) under each storage layout.
+static void bench_layouts()
+{
+    printf("layout   bubbles    animate       cull        bin     export\n");
+    for (size_t n : {1000, 100000, 1000000})
+    {
+        bench_layout<BubbleLayout::AoS>("AoS", n);
+        bench_layout<BubbleLayout::SoA>("SoA", n);
+        bench_layout<BubbleLayout::AoSoA8>("AoSoA8", n);
+    }
+}
+
+// Frames the CPU pipeline gets to size its arenas and buffers before --check-allocations starts
+// counting.
+constexpr static int kAllocationCheckWarmup = 60;
+
+// Runs the CPU render pipeline, without presenting, at every depth, with and without the CPU
+// simulation, and checks that past the warmup it renders 'frames' more frames without a single
+// heap allocation. Returns false, after printing which configuration allocated, if any did.
+static bool check_cpu_allocations(int frames, int numThreads)
+{
+    constexpr int kSize = 256;
+    constexpr size_t kBubbles = 32;
+    bool passed = true;
+    Bubbles bubbles;
+    for (int depth = 1; depth <= 3; ++depth)
+    {
+        for (bool simulate : {false, true})
+        {
+            generate_scene(bubbles, kBubbles, SceneParams());
+            std::unique_ptr<BubblePhysics> physics;
+            std::unique_ptr<WorkerPool> physicsWorkers;
+            CPUFramePipeline<Bubbles>::SimulateFn simulateFn;
+            if (simulate)
+            {
+                fit_bubbles_for_simulation(bubbles);
+                physics = std::make_unique<BubblePhysics>();
+                physics->reset(bubbles);
+                physicsWorkers = std::make_unique<WorkerPool>(numThreads - 1);
+                simulateFn = [&](FrameSlot& slot) {
+                    for (int i = 0; i < slot.steps; ++i)
+                    {
+                        physics->step(1,
+                                      static_cast<float>(slot.width),
+                                      static_cast<float>(slot.height),
+                                      *physicsWorkers);
+                    }
+                    physics->exportCenters(slot.cx.data(), slot.cy.data());
+                };
+            }
+            CPUFramePipeline<Bubbles> pipeline(
+                bubbles,
+                select_raster_kernel<Bubbles>(BlendMode::SrcOver, true),
+                pack_unorm4x8(.1f, .1f, .1f, .1f),
+                depth,
+                numThreads - 1,
+                SimClock(true),
+                std::move(simulateFn));
+            pipeline.setFramebufferSize(kSize, kSize);
+            uint64_t before = 0;
+            for (int i = 0; i < kAllocationCheckWarmup + frames; ++i)
+            {
+                if (i == kAllocationCheckWarmup)
+                {
+                    before = g_heapAllocations.load();
+                }
+                pipeline.releaseFrame(pipeline.acquireFrame());
+            }
+            uint64_t allocations = g_heapAllocations.load() - before;
+            printf("%s depth %i%s: %llu heap allocations in %i frames\n",
+                   allocations ? "FAIL" : "PASS",
+                   depth,
+                   simulate ? ", cpu sim" : "",
+                   static_cast<unsigned long long>(allocations),
+                   frames);
+            passed &= allocations == 0;
+        }
+    }
+    return passed;
+}
+
+static bool parse_blend_mode(const char* str, BlendMode* mode)
+{
+    if (!blend_mode_from_name(str, mode))
+    {
+        fprintf(stderr, "Unknown blend mode: %s\n", str);
+        return false;
+    }
+    return true;
+}
+
+// Compares how the CPU grid simulation and the GPU compute simulation scale with bubble count,
+// in milliseconds per step. The GPU is timed with glFinish() around a batch of steps.
+static bool bench_sim(int numThreads)
+{
+    GPUPhysics gpuPhysics;
+    gpuPhysics.init();
+    if (!gpuPhysics.finishInit())
+    {
+        return false;
+    }
+    WorkerPool workers(numThreads - 1);
+    float w = static_cast<float>(W), h = static_cast<float>(H);
+    printf("bubbles   cpu (%i threads)        gpu    speedup\n", numThreads);
+    for (size_t n : {10000, 100000, 1000000})
+    {
+        Bubbles bubbles;
+        generate_scene(bubbles, n, SceneParams());
+        fit_bubbles_for_simulation(bubbles);
+        int steps = std::max(3, static_cast<int>(2e6 / n));
+
+        BubblePhysics cpuPhysics;
+        cpuPhysics.reset(bubbles);
+        cpuPhysics.step(1, w, h, workers);
+        double t0 = now();
+        for (int i = 0; i < steps; ++i)
+        {
+            cpuPhysics.step(1, w, h, workers);
+        }
+        double cpuMs = (now() - t0) * 1e3 / steps;
+
+        gpuPhysics.reset(bubbles);
+        gpuPhysics.step(1, w, h);
+        glFinish();
+        t0 = now();
+        for (int i = 0; i < steps; ++i)
+        {
+            gpuPhysics.step(1, w, h);
+        }
+        glFinish();
+        double gpuMs = (now() - t0) * 1e3 / steps;
+
+        printf("%7zu %17.3f ms %7.3f ms %9.2fx\n", n, cpuMs, gpuMs, cpuMs / gpuMs);
+        fflush(stdout);
+    }
+    return true;
+}
+
+static bool parse_upload_mode(const char* str, UploadMode* mode)
+{
+    if (!strcmp(str, "subdata"))
+    {
+        *mode = UploadMode::SubData;
+    }
+    else if (!strcmp(str, "orphan"))
+    {
+        *mode = UploadMode::Orphan;
+    }
+    else if (!strcmp(str, "ring"))
+    {
+        *mode = UploadMode::Ring;
+    }
+    else
+    {
+        fprintf(stderr, "Unknown upload mode: %s\n", str);
         return false;
     }
-    glAttachShader(program, shader);
-    glDeleteShader(shader);
-    return true;
-}
+    return true;
+}
+
+// Points 'renderFBO' at 'tex' for draws with the given variant: as an image for the variants that
+// imageStore, or as a blended color attachment for the others.
+static void bind_render_target(GLuint renderFBO,
+                               GLuint tex,
+                               int width,
+                               int height,
+                               uint32_t variant)
+{
+    glBindFramebuffer(GL_FRAMEBUFFER, renderFBO);
+    BlendMode blendMode = shader_variant_blend_mode(variant);
+    if (blendMode == BlendMode::Overwrite)
+    {
+        glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_TEXTURE_2D, 0, 0);
+        glDrawBuffers(0, nullptr);
+        glFramebufferParameteri(GL_DRAW_FRAMEBUFFER, GL_FRAMEBUFFER_DEFAULT_WIDTH, width);
+        glFramebufferParameteri(GL_DRAW_FRAMEBUFFER, GL_FRAMEBUFFER_DEFAULT_HEIGHT, height);
+        glBindImageTexture(0, tex, 0, 0, 0, GL_WRITE_ONLY, GL_R32UI);
+        glDisable(GL_BLEND);
+    }
+    else
+    {
+        glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_TEXTURE_2D, tex, 0);
+        GLenum drawBuffer = GL_COLOR_ATTACHMENT0;
+        glDrawBuffers(1, &drawBuffer);
+        glEnable(GL_BLEND);
+        // "fs" outputs premultiplied color.
+        glBlendFunc(GL_ONE, blendMode == BlendMode::SrcOver ? GL_ONE_MINUS_SRC_ALPHA : GL_ONE);
+    }
+}
+
+// Streams 1M instances per frame with each UploadMode and reports the bandwidth. The draws run
+// with the rasterizer discarded, so the GPU consumes every upload without paying for fragments.
+static void bench_upload(InstanceFetcher& fetcher, int numFrames)
+{
+    constexpr size_t n = 1000000;
+    Bubbles bubbles;
+    generate_scene(bubbles, n, SceneParams());
+    std::vector<Bubble> instances(n);
+    bubbles.exportInterleaved(instances.data(), 0, n);
+    std::vector<PackedBubble> packedInstances;
+    const void* data = instances.data();
+    if (fetcher.packed())
+    {
+        packedInstances.resize(n);
+        pack_bubbles(instances.data(), sizeof(Bubble), n, packedInstances.data());
+        data = packedInstances.data();
+    }
+    size_t stride = fetcher.instanceSize();
+    GLuint vao;
+    glGenVertexArrays(1, &vao);
+    glBindVertexArray(vao);
+    glEnable(GL_RASTERIZER_DISCARD);
+    printf("mode     upload GB/s  end-to-end GB/s  stall ms/frame\n");
+    const char* names[] = {"subdata", "orphan", "ring"};
+    for (UploadMode mode : {UploadMode::SubData, UploadMode::Orphan, UploadMode::Ring})
+    {
+        InstanceUploader uploader(mode, n * stride);
+        double t0 = now();
+        for (int i = 0; i < numFrames; ++i)
+        {
+            size_t offset = uploader.upload(data, n * stride);
+            fetcher.bind(uploader.buffer(), static_cast<GLsizei>(stride), offset);
+            fetcher.setGlobals(static_cast<float>(W), static_cast<float>(H), 0);
+            glDrawArraysInstanced(GL_TRIANGLE_STRIP, 0, 4, n);
+            uploader.endFrame();
+        }
+        glFinish();
+        double seconds = now() - t0;
+        uint64_t bytes;
+        double uploadSeconds, stallSeconds;
+        uploader.takeStats(&bytes, &uploadSeconds, &stallSeconds);
+        printf("%-8s %11.2f %16.2f %15.3f\n",
+               names[static_cast<int>(mode)],
+               bytes / uploadSeconds * 1e-9,
+               bytes / seconds * 1e-9,
+               stallSeconds * 1e3 / numFrames);
+        fflush(stdout);
+    }
+    glDisable(GL_RASTERIZER_DISCARD);
+    glDeleteVertexArrays(1, &vao);
+}
+
+static bool parse_instance_fetch(const char* str, InstanceFetch* fetch)
+{
+    if (!strcmp(str, "attribs"))
+    {
+        *fetch = InstanceFetch::Attribs;
+    }
+    else if (!strcmp(str, "ssbo"))
+    {
+        *fetch = InstanceFetch::SSBO;
+    }
+    else if (!strcmp(str, "tbo"))
+    {
+        *fetch = InstanceFetch::TBO;
+    }
+    else
+    {
+        fprintf(stderr, "Unknown instance fetch path: %s\n", str);
+        return false;
+    }
+    return true;
+}
+
+// The golden test's scene: a fixed seed, a fixed number of bubbles, a small fixed canvas (so the
+// goldens stay small), and the steps of closed-form motion it renders them at. The goldens in
+// goldens/ come from llvmpipe; see goldens/README.md.
+constexpr static unsigned kGoldenSeed = 1;
+constexpr static int kGoldenBubbles = 200;
+constexpr static int kGoldenSize = 256;
+constexpr static float kGoldenTimes[] = {0, 60, 600, 6000};
+
+// Renders the golden scene offscreen at each of kGoldenTimes, with every blend mode with and
+// without antialiasing, and checks each image against the goldens in 'dir' (or rewrites them).
+// The fetch path, packing and fragment precision come from 'fetch' and 'flags'. Overwrite
+// variants imageStore with no ordering between overlapping bubbles, so they draw one bubble per
+// draw with a barrier in between; blended variants are already blended in instance order.
+static bool run_golden_test(ShaderVariantCache& shaders,
+                            InstanceFetch fetch,
+                            uint32_t flags,
+                            const char* dir,
+                            const GoldenTolerance& tolerance,
+                            bool update)
+{
+    const BlendMode blendModes[] = {BlendMode::Overwrite, BlendMode::SrcOver, BlendMode::Additive};
+    flags = (flags & ~kVariantAntialias) | kVariantClosedForm;
+    for (BlendMode blendMode : blendModes)
+    {
+        shaders.request(shader_variant(blendMode, fetch, flags));
+        shaders.request(shader_variant(blendMode, fetch, flags | kVariantAntialias));
+    }
+
+    // Scenes are generated for a 2048 x 2048 canvas.
+    SceneParams params;
+    params.seed = kGoldenSeed;
+    Bubbles bubbles;
+    generate_scene(bubbles, kGoldenBubbles, params);
+    float scale = kGoldenSize / 2048.f;
+    for (size_t i = 0; i < bubbles.size(); ++i)
+    {
+        bubbles.x(i) *= scale;
+        bubbles.y(i) *= scale;
+        bubbles.r(i) *= scale;
+        bubbles.dx(i) *= scale;
+        bubbles.dy(i) *= scale;
+    }
+    std::vector<Bubble> instances(kGoldenBubbles);
+    bubbles.exportInterleaved(instances.data(), 0, kGoldenBubbles);
+    bool packed = flags & kVariantPacked;
+    std::vector<PackedBubble> packedInstances(packed ? kGoldenBubbles : 0);
+    if (packed)
+    {
+        pack_bubbles(instances.data(), sizeof(Bubble), kGoldenBubbles, packedInstances.data());
+    }
+
+    InstanceFetcher fetcher(fetch, packed);
+    GLsizei stride = static_cast<GLsizei>(fetcher.instanceSize());
+    if (!fetcher.init((GLADloadproc)glfwGetProcAddress, kGoldenBubbles * stride))
+    {
+        return false;
+    }
+    GLuint vao, buffer, tex, readFBO, renderFBO;
+    glGenVertexArrays(1, &vao);
+    glBindVertexArray(vao);
+    glGenBuffers(1, &buffer);
+    glBindBuffer(GL_ARRAY_BUFFER, buffer);
+    glBufferData(GL_ARRAY_BUFFER,
+                 kGoldenBubbles * stride,
+                 packed ? static_cast<const void*>(packedInstances.data()) : instances.data(),
+                 GL_STATIC_DRAW);
+    glGenTextures(1, &tex);
+    glBindTexture(GL_TEXTURE_2D, tex);
+    glTexStorage2D(GL_TEXTURE_2D, 1, GL_RGBA8, kGoldenSize, kGoldenSize);
+    // Overwrite variants detach 'tex' from the render target, so clears and readbacks go
+    // through a framebuffer of their own.
+    glGenFramebuffers(1, &readFBO);
+    glBindFramebuffer(GL_FRAMEBUFFER, readFBO);
+    glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_TEXTURE_2D, tex, 0);
+    glGenFramebuffers(1, &renderFBO);
+    glViewport(0, 0, kGoldenSize, kGoldenSize);
+    glClearColor(.1f, .1f, .1f, .1f);
+    glDisable(GL_DITHER);
+
+    size_t rowBytes = kGoldenSize * 4;
+    std::vector<uint8_t> readback(rowBytes * kGoldenSize), pixels(readback.size());
+    int numFailed = 0, numChecked = 0;
+    for (BlendMode blendMode : blendModes)
+    {
+        for (uint32_t aa : {0u, static_cast<uint32_t>(kVariantAntialias)})
+        {
+            uint32_t variant = shader_variant(blendMode, fetch, flags | aa);
+            GLuint program = shaders.get(variant);
+            if (!program)
+            {
+                return false;
+            }
+            glUseProgram(program);
+            bind_render_target(renderFBO, tex, kGoldenSize, kGoldenSize, variant);
+            for (float T : kGoldenTimes)
+            {
+                glBindFramebuffer(GL_FRAMEBUFFER, readFBO);
+                glClear(GL_COLOR_BUFFER_BIT);
+                glBindFramebuffer(GL_FRAMEBUFFER, renderFBO);
+                if (blendMode == BlendMode::Overwrite)
+                {
+                    for (int i = 0; i < kGoldenBubbles; ++i)
+                    {
+                        fetcher.bind(buffer, stride, static_cast<size_t>(i) * stride);
+                        fetcher.setGlobals(kGoldenSize, kGoldenSize, T);
+                        glDrawArraysInstanced(GL_TRIANGLE_STRIP, 0, 4, 1);
+                        glMemoryBarrier(GL_SHADER_IMAGE_ACCESS_BARRIER_BIT);
+                    }
+                }
+                else
+                {
+                    fetcher.bind(buffer, stride);
+                    fetcher.setGlobals(kGoldenSize, kGoldenSize, T);
+                    glDrawArraysInstanced(GL_TRIANGLE_STRIP, 0, 4, kGoldenBubbles);
+                }
+                glMemoryBarrier(GL_ALL_BARRIER_BITS);
+                glBindFramebuffer(GL_READ_FRAMEBUFFER, readFBO);
+                glReadPixels(0,
+                             0,
+                             kGoldenSize,
+                             kGoldenSize,
+                             GL_RGBA,
+                             GL_UNSIGNED_BYTE,
+                             readback.data());
+                // Goldens are stored top row first.
+                for (int y = 0; y < kGoldenSize; ++y)
+                {
+                    memcpy(pixels.data() + y * rowBytes,
+                           readback.data() + (kGoldenSize - 1 - y) * rowBytes,
+                           rowBytes);
+                }
+                std::string name = shader_variant_name(variant) + " T" +
+                                   std::to_string(static_cast<int>(T));
+                std::replace(name.begin(), name.end(), ' ', '-');
+                ++numChecked;
+                if (!check_golden(dir,
+                                  name,
+                                  pixels.data(),
+                                  kGoldenSize,
+                                  kGoldenSize,
+                                  tolerance,
+                                  update))
+                {
+                    ++numFailed;
+                }
+            }
+        }
+    }
+    printf("golden test: %i of %i images %s\n",
+           numChecked - numFailed,
+           numChecked,
+           update ? "updated" : "passed");
+    fflush(stdout);
+
+    glDeleteFramebuffers(1, &renderFBO);
+    glDeleteFramebuffers(1, &readFBO);
+    glDeleteTextures(1, &tex);
+    glDeleteBuffers(1, &buffer);
+    glDeleteVertexArrays(1, &vao);
+    return numFailed == 0;
+}
+
+static bool parse_size_distribution(const char* str, SizeDistribution* sizes)
+{
+    if (!strcmp(str, "skewed"))
+    {
+        *sizes = SizeDistribution::Skewed;
+    }
+    else if (!strcmp(str, "uniform"))
+    {
+        *sizes = SizeDistribution::Uniform;
+    }
+    else if (!strcmp(str, "fixed"))
+    {
+        *sizes = SizeDistribution::Fixed;
+    }
+    else
+    {
+        fprintf(stderr, "Unknown size distribution: %s\n", str);
+        return false;
+    }
+    return true;
+}
+
+static bool parse_speed_distribution(const char* str, SpeedDistribution* speeds)
+{
+    if (!strcmp(str, "default"))
+    {
+        *speeds = SpeedDistribution::Default;
+    }
+    else if (!strcmp(str, "still"))
+    {
+        *speeds = SpeedDistribution::Still;
+    }
+    else if (!strcmp(str, "fast"))
+    {
+        *speeds = SpeedDistribution::Fast;
+    }
+    else
+    {
+        fprintf(stderr, "Unknown speed distribution: %s\n", str);
+        return false;
+    }
+    return true;
+}
+
+static bool parse_color_distribution(const char* str, ColorDistribution* colors)
+{
+    if (!strcmp(str, "pastel"))
+    {
+        *colors = ColorDistribution::Pastel;
+    }
+    else if (!strcmp(str, "full"))
+    {
+        *colors = ColorDistribution::Full;
+    }
+    else if (!strcmp(str, "gray"))
+    {
+        *colors = ColorDistribution::Gray;
+    }
+    else
+    {
+        fprintf(stderr, "Unknown color distribution: %s\n", str);
+        return false;
+    }
+    return true;
+}
+
+#ifndef _WIN32
+// Reads the frames that another process publishes with --capture shm:NAME, in place, as a
+// consumer would, and reports how many it got, how many the writer published past it, and how
+// many it caught mid-write. Stops once no new frame has come for two seconds, and then writes the
+// last frame it read to 'pamPath', if given.
+static bool dump_shared_frames(const char* name, const char* pamPath)
+{
+    std::unique_ptr<ShmFrameReader> reader;
+    double deadline = now() + 10;
+    while (!(reader = ShmFrameReader::Open(name)))
+    {
+        if (now() > deadline)
+        {
+            fprintf(stderr, "No frame ring named %s.\n", name);
+            return false;
+        }
+        std::this_thread::sleep_for(std::chrono::milliseconds(10));
+    }
+    std::vector<uint8_t> lastFrame;
+    uint32_t lastWidth = 0, lastHeight = 0;
+    uint64_t lastIndex = 0, read = 0, missed = 0, torn = 0, checksum = 0;
+    double lastFrameTime = now(), start = lastFrameTime;
+    uint64_t readSinceReport = 0;
+    while (now() - lastFrameTime < 2)
+    {
+        bool fresh = false;
+        uint64_t index = 0, sum = 0;
+        bool valid = reader->readLatest(
+            [&](const uint8_t* pixels, uint32_t width, uint32_t height, uint64_t frameIndex) {
+                if (read > 0 && frameIndex == lastIndex)
+                {
+                    return;
+                }
+                fresh = true;
+                index = frameIndex;
+                size_t bytes = static_cast<size_t>(width) * height * 4;
+                for (size_t i = 0; i < bytes; i += 4)
+                {
+                    sum += pixels[i] + pixels[i + 1] + pixels[i + 2] + pixels[i + 3];
+                }
+                if (pamPath)
+                {
+                    lastFrame.assign(pixels, pixels + bytes);
+                    lastWidth = width;
+                    lastHeight = height;
+                }
+            });
+        if (!fresh)
+        {
+            std::this_thread::sleep_for(std::chrono::milliseconds(1));
+            continue;
+        }
+        if (!valid)
+        {
+            ++torn;
+            continue;
+        }
+        missed += read > 0 && index > lastIndex ? index - lastIndex - 1 : 0;
+        lastIndex = index;
+        checksum += sum;
+        ++read;
+        ++readSinceReport;
+        lastFrameTime = now();
+        if (lastFrameTime - start >= 2)
+        {
+            printf("%.1f fps read (frame %llu)\n",
+                   readSinceReport / (lastFrameTime - start),
+                   static_cast<unsigned long long>(lastIndex));
+            fflush(stdout);
+            readSinceReport = 0;
+            start = lastFrameTime;
+        }
+    }
+    printf("read %llu frames: %llu missed, %llu torn, checksum %016llx\n",
+           static_cast<unsigned long long>(read),
+           static_cast<unsigned long long>(missed),
+           static_cast<unsigned long long>(torn),
+           static_cast<unsigned long long>(checksum));
+    if (pamPath && read > 0 && !write_pam(pamPath, lastFrame.data(), lastWidth, lastHeight))
+    {
+        return false;
+    }
+    return read > 0;
+}
+
+// Races a writer process, publishing 'frames' frames into a two-slot ring as fast as it can,
+// against a reader in this one, reading the newest frame as fast as it can. Every pixel of a frame
+// holds the frame's index, so a torn read shows up as a mix. Returns false, after printing the
+// counts, if readLatest() ever accepted a frame that wasn't consistent, or never accepted one.
+static bool check_shm_ring(int frames)
+{
+    constexpr uint32_t kSize = 128;
+    std::string name = "bubbles-check-" + std::to_string(getpid());
+    std::unique_ptr<ShmFrameWriter> writer =
+        ShmFrameWriter::Create(name.c_str(), kSize * kSize * 4, 2);
+    std::unique_ptr<ShmFrameReader> reader;
+    if (!writer || !(reader = ShmFrameReader::Open(name.c_str())))
+    {
+        fprintf(stderr, "Failed to open frame ring %s.\n", name.c_str());
+        return false;
+    }
+    fflush(stdout);
+    pid_t pid = fork();
+    if (pid < 0)
+    {
+        fprintf(stderr, "Failed to start the writer: %s\n", strerror(errno));
+        return false;
+    }
+    if (pid == 0)
+    {
+        std::vector<uint32_t> pixels(kSize * kSize);
+        for (int i = 1; i <= frames; ++i)
+        {
+            std::fill(pixels.begin(), pixels.end(), static_cast<uint32_t>(i));
+            writer->publish(reinterpret_cast<const uint8_t*>(pixels.data()),
+                            kSize * 4,
+                            kSize,
+                            kSize,
+                            static_cast<uint64_t>(i));
+        }
+        // Skip the destructors; the parent owns the ring, and unlinks it.
+        _exit(0);
+    }
+    uint64_t accepted = 0, rejected = 0, inconsistent = 0;
+    int status = 0;
+    while (waitpid(pid, &status, WNOHANG) == 0)
+    {
+        bool consistent = true;
+        bool valid = reader->readLatest(
+            [&](const uint8_t* pixels, uint32_t width, uint32_t height, uint64_t frameIndex) {
+                consistent = width == kSize && height == kSize;
+                for (uint32_t i = 0; consistent && i < width * height; ++i)
+                {
+                    uint32_t pixel;
+                    memcpy(&pixel, pixels + i * 4, sizeof(pixel));
+                    consistent = pixel == static_cast<uint32_t>(frameIndex);
+                }
+            });
+        accepted += valid;
+        rejected += !valid;
+        inconsistent += valid && !consistent;
+    }
+    bool writerDone = WIFEXITED(status) && WEXITSTATUS(status) == 0;
+    bool passed = writerDone && accepted > 0 && inconsistent == 0;
+    printf("%s: %llu reads accepted, %llu rejected, %llu accepted but inconsistent%s\n",
+           passed ? "PASS" : "FAIL",
+           static_cast<unsigned long long>(accepted),
+           static_cast<unsigned long long>(rejected),
+           static_cast<unsigned long long>(inconsistent),
+           writerDone ? "" : " (the writer failed)");
+    return passed;
+}
+#endif
+
+// Static scenes are uploaded this many bytes at a time.
+constexpr static size_t kSceneUploadChunk = 64 << 20;
+
+// The most bubbles a "bubbles N" command over the control socket may ask for (over a gigabyte of
+// instances).
+constexpr static long kMaxControlBubbles = 1 << 25;
+
+// Bubbles that spawn, grow, pop and get removed, instead of a fixed set.
+enum class LifecycleMode
+{
+    None,
+    CPU, // CPULifecycle, with the live bubbles uploaded every frame.
+    GPU, // GPULifecycle, drawn indirectly from its state buffer.
+};
+
+static bool parse_lifecycle_mode(const char* str, LifecycleMode* mode)
+{
+    if (!strcmp(str, "none"))
+    {
+        *mode = LifecycleMode::None;
+    }
+    else if (!strcmp(str, "cpu"))
+    {
+        *mode = LifecycleMode::CPU;
+    }
+    else if (!strcmp(str, "gpu"))
+    {
+        *mode = LifecycleMode::GPU;
+    }
+    else
+    {
+        fprintf(stderr, "Unknown lifecycle mode: %s\n", str);
+        return false;
+    }
+    return true;
+}
+
+// How bubbles move.
+enum class SimMode
+{
+    ClosedForm, // Straight lines reflected off the walls, evaluated in the vertex shader.
+    CPU,        // BubblePhysics, with the results streamed through an InstanceUploader.
+    GPU,        // GPUPhysics, drawn straight from its state buffer.
+};
+
+static bool parse_sim_mode(const char* str, SimMode* mode)
+{
+    if (!strcmp(str, "none"))
+    {
+        *mode = SimMode::ClosedForm;
+    }
+    else if (!strcmp(str, "cpu"))
+    {
+        *mode = SimMode::CPU;
+    }
+    else if (!strcmp(str, "gpu"))
+    {
+        *mode = SimMode::GPU;
+    }
+    else
+    {
+        fprintf(stderr, "Unknown simulation mode: %s\n", str);
+        return false;
+    }
+    return true;
+}
+
+// Sets an environment variable for the drivers that glfwInit() is about to load, unless it was
+// set already: anything set by hand wins.
+static void set_driver_env(const char* name, const char* value)
+{
+#ifdef _WIN32
+    if (!getenv(name))
+    {
+        _putenv_s(name, value);
+    }
+#else
+    setenv(name, value, 0);
+#endif
+}
+
+// SwiftShader's Vulkan driver, which ANGLE's Vulkan backend loads in place of a GPU's. It ships
+// next to the ANGLE libraries.
+constexpr static char kSwiftShaderICD[] = "vk_swiftshader_icd.json";
+
+// Where glvnd finds Mesa's EGL on most distributions.
+constexpr static char kMesaEGLVendor[] = "/usr/share/glvnd/egl_vendor.d/50_mesa.json";
+
+// Each backend is selected with "--<name>".
+constexpr static const char* kBackends[] = {
+    "gl", "gles", "d3d", "vk", "mtl", "egl", "llvmpipe", "swiftshader"};
+
+// What "--matrix all" runs: every backend that might work on this platform.
+#if defined(_WIN32)
+constexpr static char kMatrixAllBackends[] = "d3d,vk,gl,gles,swiftshader";
+#elif defined(__APPLE__)
+constexpr static char kMatrixAllBackends[] = "mtl,gl,vk";
+#else
+constexpr static char kMatrixAllBackends[] = "vk,gl,gles,egl,llvmpipe,swiftshader";
+#endif
+
+// Frames a run measures with --results, after its warmup, unless --frames says otherwise.
+constexpr static int kMatrixFrames = 600;
+constexpr static int kDefaultWarmupFrames = 60;
+
+// Runs this executable again with 'args' (args[0] included), and returns its exit code, or -1 if
+// it couldn't be started or didn't exit normally.
+static int run_child(const std::vector<std::string>& args)
+{
+    std::vector<const char*> argv;
+#ifdef _WIN32
+    // _spawnvp() joins the arguments with spaces, so the ones that have any need quotes.
+    std::vector<std::string> quoted;
+    for (const std::string& arg : args)
+    {
+        quoted.push_back(arg.find(' ') == std::string::npos ? arg : '"' + arg + '"');
+    }
+    for (const std::string& arg : quoted)
+    {
+        argv.push_back(arg.c_str());
+    }
+    argv.push_back(nullptr);
+    fflush(stdout);
+    return static_cast<int>(_spawnvp(_P_WAIT, argv[0], argv.data()));
+#else
+    for (const std::string& arg : args)
+    {
+        argv.push_back(arg.c_str());
+    }
+    argv.push_back(nullptr);
+    fflush(stdout);
+    pid_t pid;
+    if (posix_spawnp(&pid,
+                     argv[0],
+                     nullptr,
+                     nullptr,
+                     const_cast<char* const*>(argv.data()),
+                     environ) != 0)
+    {
+        return -1;
+    }
+    int status;
+    while (waitpid(pid, &status, 0) < 0)
+    {
+        if (errno != EINTR)
+        {
+            return -1;
+        }
+    }
+    return WIFEXITED(status) ? WEXITSTATUS(status) : -1;
+#endif
+}
+
+// Benchmarks each of a comma-separated list of backends (or "all") in a child process of its own,
+// since the ANGLE platform is fixed once glfwInit() has run. Every child gets this process's
+// arguments, minus the backend and matrix flags, plus --deterministic and a frame count, so they
+// all render the same seeded scene through the same sequence of frames. The runs go round-robin,
+// so slow drift in the machine (thermals, background load) spreads over every backend alike.
+// Prints a table relative to the first backend that works, and appends every run to
+// 'resultsPath', if given.
+static bool run_backend_matrix(int argc,
+                               const char* argv[],
+                               const char* backendList,
+                               int runs,
+                               int frames,
+                               int warmup,
+                               const char* resultsPath)
+{
+    std::vector<std::string> backends;
+    std::string list = strcmp(backendList, "all") ? backendList : kMatrixAllBackends;
+    for (size_t begin = 0; begin <= list.size();)
+    {
+        size_t end = std::min(list.find(',', begin), list.size());
+        std::string name = list.substr(begin, end - begin);
+        if (std::find_if(std::begin(kBackends), std::end(kBackends), [&](const char* backend) {
+                return name == backend;
+            }) == std::end(kBackends))
+        {
+            fprintf(stderr, "Unknown backend: %s\n", name.c_str());
+            return false;
+        }
+        backends.push_back(name);
+        begin = end + 1;
+    }
+
+    std::vector<std::string> childArgs = {argv[0], ""};
+    for (int i = 1; i < argc; ++i)
+    {
+        const char* arg = argv[i];
+        bool backendFlag = !strncmp(arg, "--", 2) &&
+                           std::find_if(std::begin(kBackends),
+                                        std::end(kBackends),
+                                        [&](const char* backend) {
+                                            return !strcmp(arg + 2, backend);
+                                        }) != std::end(kBackends);
+        const char* const ownFlags[] = {
+            "--matrix", "--matrix-runs", "--results", "--frames", "--warmup", "--control"};
+        bool ownFlag = std::find_if(std::begin(ownFlags), std::end(ownFlags), [&](const char* f) {
+                           return !strcmp(arg, f);
+                       }) != std::end(ownFlags);
+        if (ownFlag)
+        {
+            ++i;
+        }
+        else if (!backendFlag && strcmp(arg, "--deterministic"))
+        {
+            childArgs.push_back(arg);
+        }
+    }
+#ifdef _WIN32
+    int pid = _getpid();
+#else
+    int pid = static_cast<int>(getpid());
+#endif
+    std::string childResults =
+        (std::filesystem::temp_directory_path() /
+         ("bubbles-matrix-" + std::to_string(pid) + ".jsonl"))
+            .string();
+    remove(childResults.c_str());
+    for (const char* arg : {"--deterministic", "--frames"})
+    {
+        childArgs.push_back(arg);
+    }
+    childArgs.push_back(std::to_string(frames));
+    childArgs.push_back("--warmup");
+    childArgs.push_back(std::to_string(warmup));
+    childArgs.push_back("--results");
+    childArgs.push_back(childResults);
+
+    std::vector<int> exitCodes(backends.size(), 0);
+    for (int run = 0; run < runs; ++run)
+    {
+        for (size_t i = 0; i < backends.size(); ++i)
+        {
+            if (exitCodes[i] != 0)
+            {
+                continue;
+            }
+            printf("== %s (run %i of %i) ==\n", backends[i].c_str(), run + 1, runs);
+            childArgs[1] = "--" + backends[i];
+            exitCodes[i] = run_child(childArgs);
+        }
+    }
+
+    std::vector<BenchResult> results;
+    FILE* file = fopen(childResults.c_str(), "rb");
+    if (file)
+    {
+        fclose(file);
+        if (!read_bench_results(childResults.c_str(), &results))
+        {
+            return false;
+        }
+    }
+    remove(childResults.c_str());
+    if (resultsPath)
+    {
+        for (const BenchResult& result : results)
+        {
+            if (!append_bench_result(resultsPath, result))
+            {
+                return false;
+            }
+        }
+    }
+
+    printf("\n%-12s %4s %10s  %-21s %7s %7s %8s  %-17s %s\n",
+           "backend",
+           "runs",
+           "fps",
+           "95% CI",
+           "p50 ms",
+           "p99 ms",
+           "speedup",
+           "95% CI",
+           "renderer");
+    BenchRuns baseline;
+    bool anyAvailable = false;
+    for (size_t i = 0; i < backends.size(); ++i)
+    {
+        std::vector<const BenchResult*> backendResults;
+        std::vector<double> frameMs;
+        for (const BenchResult& result : results)
+        {
+            if (result.backend == backends[i])
+            {
+                backendResults.push_back(&result);
+                frameMs.insert(frameMs.end(), result.frameMs.begin(), result.frameMs.end());
+            }
+        }
+        BenchRuns backendRuns = bench_runs(backendResults);
+        if (exitCodes[i] != 0 || backendRuns.empty())
+        {
+            printf("%-12s unavailable (exit code %i)\n", backends[i].c_str(), exitCodes[i]);
+            continue;
+        }
+        bool isBaseline = baseline.empty();
+        if (isBaseline)
+        {
+            baseline = backendRuns;
+        }
+        anyAvailable = true;
+        BenchEstimate fps = bootstrap_fps(backendRuns, nullptr);
+        BenchEstimate speedup = bootstrap_fps(backendRuns, &baseline);
+        char fpsCI[32], speedupCI[32];
+        snprintf(fpsCI, sizeof(fpsCI), "[%.1f, %.1f]", fps.low, fps.high);
+        snprintf(speedupCI, sizeof(speedupCI), "[%.3f, %.3f]", speedup.low, speedup.high);
+        printf("%-12s %4zu %10.1f  %-21s %7.3f %7.3f %7.3fx  %-17s %.60s\n",
+               backends[i].c_str(),
+               backendRuns.size(),
+               fps.value,
+               fpsCI,
+               quantile(frameMs, .5),
+               quantile(frameMs, .99),
+               speedup.value,
+               isBaseline ? "(baseline)" : speedupCI,
+               backendResults[0]->glRenderer.c_str());
+    }
+    return anyAvailable;
+}
+
+int main(int argc, const char* argv[])
+{
+    double launchTime = now();
+    // Select the ANGLE backend.
+    glfwInitHint(GLFW_ANGLE_PLATFORM_TYPE, GLFW_ANGLE_PLATFORM_TYPE_VULKAN);
+    const char* backend = "vk";
+    bool benchLayouts = false;
+    bool benchSim = false;
+    int checkAllocationFrames = 0;
+    int checkShmFrames = 0;
+    bool deterministic = false;
+    bool benchUpload = false;
+    // Set by --upload: re-upload every instance every frame, even when they haven't changed.
+    bool streamInstances = false;
+    UploadMode uploadMode = UploadMode::SubData;
+    bool cpuRender = false;
+    BlendMode blendMode = BlendMode::Overwrite;
+    bool aa = true;
+    bool highp = false;
+    InstanceFetch fetch = InstanceFetch::Attribs;
+    bool packed = false;
+    bool sortInstances = false;
+    const char* captureSpec = nullptr;
+    int captureDepth = 3;
+    double captureFPS = 60;
+    const char* outputPath = nullptr;
+    const char* outputFormat = nullptr;
+    QueuePolicy outputPolicy = QueuePolicy::Drop;
+    const char* goldenDir = nullptr;
+    bool goldenUpdate = false;
+    GoldenTolerance goldenTolerance;
+    SceneParams sceneParams;
+    const char* saveScenePath = nullptr;
+    const char* loadScenePath = nullptr;
+    const char* shmDumpName = nullptr;
+    const char* shmDumpPath = nullptr;
+    const char* controlPath = nullptr;
+    const char* resultsPath = nullptr;
+    const char* matrixBackends = nullptr;
+    int matrixRuns = 3;
+    const char* compareBaseline = nullptr;
+    const char* compareCandidate = nullptr;
+    double compareThreshold = .03;
+    int maxFrames = 0;
+    int warmupFrames = kDefaultWarmupFrames;
+    int pipelineDepth = 3;
+    int numThreads = std::max(static_cast<int>(std::thread::hardware_concurrency()), 1);
+    int n = 800;
+    SimMode simMode = SimMode::ClosedForm;
+    LifecycleMode lifecycleMode = LifecycleMode::None;
+    for (int i = 1; i < argc; i++)
+    {
+        if (!strcmp(argv[i], "--gl"))
+        {
+            backend = argv[i] + 2;
+            glfwInitHint(GLFW_ANGLE_PLATFORM_TYPE, GLFW_ANGLE_PLATFORM_TYPE_OPENGL);
+        }
+        else if (!strcmp(argv[i], "--gles"))
+        {
+            backend = argv[i] + 2;
+            glfwInitHint(GLFW_ANGLE_PLATFORM_TYPE, GLFW_ANGLE_PLATFORM_TYPE_OPENGLES);
+        }
+        else if (!strcmp(argv[i], "--d3d"))
+        {
+            backend = argv[i] + 2;
+            glfwInitHint(GLFW_ANGLE_PLATFORM_TYPE, GLFW_ANGLE_PLATFORM_TYPE_D3D11);
+        }
+        else if (!strcmp(argv[i], "--vk"))
+        {
+            backend = argv[i] + 2;
+            glfwInitHint(GLFW_ANGLE_PLATFORM_TYPE, GLFW_ANGLE_PLATFORM_TYPE_VULKAN);
+        }
+        else if (!strcmp(argv[i], "--mtl"))
+        {
+            backend = argv[i] + 2;
+            glfwInitHint(GLFW_ANGLE_PLATFORM_TYPE, GLFW_ANGLE_PLATFORM_TYPE_METAL);
+        }
+        else if (!strcmp(argv[i], "--egl"))
+        {
+            backend = argv[i] + 2;
+            // The system's own EGL and GLES driver, with no ANGLE in between.
+            glfwInitHint(GLFW_ANGLE_PLATFORM_TYPE, GLFW_ANGLE_PLATFORM_TYPE_NONE);
+        }
+        else if (!strcmp(argv[i], "--llvmpipe"))
+        {
+            backend = argv[i] + 2;
+            // Mesa's EGL, rasterizing on the CPU, even where a GPU driver is installed too.
+            glfwInitHint(GLFW_ANGLE_PLATFORM_TYPE, GLFW_ANGLE_PLATFORM_TYPE_NONE);
+            set_driver_env("LIBGL_ALWAYS_SOFTWARE", "1");
+            set_driver_env("GALLIUM_DRIVER", "llvmpipe");
+            if (FILE* vendor = fopen(kMesaEGLVendor, "r"))
+            {
+                fclose(vendor);
+                set_driver_env("__EGL_VENDOR_LIBRARY_FILENAMES", kMesaEGLVendor);
+            }
+        }
+        else if (!strcmp(argv[i], "--swiftshader"))
+        {
+            backend = argv[i] + 2;
+            // ANGLE's Vulkan backend on SwiftShader. On Linux, ANGLE's libEGL.so.1 has to come
+            // first on the library path, since GLFW otherwise loads the system's.
+            glfwInitHint(GLFW_ANGLE_PLATFORM_TYPE, GLFW_ANGLE_PLATFORM_TYPE_VULKAN);
+            set_driver_env("VK_ICD_FILENAMES", kSwiftShaderICD);
+            set_driver_env("VK_DRIVER_FILES", kSwiftShaderICD);
+        }
+        else if (!strcmp(argv[i], "--bench-layouts"))
+        {
+            benchLayouts = true;
+        }
+        else if (!strcmp(argv[i], "--bench-sim"))
+        {
+            benchSim = true;
+        }
+        else if (!strcmp(argv[i], "--check-allocations") && i + 1 < argc)
+        {
+            checkAllocationFrames = std::max(atoi(argv[++i]), 1);
+        }
+        else if (!strcmp(argv[i], "--bench-upload"))
+        {
+            benchUpload = true;
+        }
+        else if (!strcmp(argv[i], "--upload") && i + 1 < argc)
+        {
+            if (!parse_upload_mode(argv[++i], &uploadMode))
+            {
+                return 1;
+            }
+            streamInstances = true;
+        }
+        else if (!strcmp(argv[i], "--deterministic"))
+        {
+            deterministic = true;
+        }
+        else if (!strcmp(argv[i], "--cpu"))
+        {
+            cpuRender = true;
+        }
+        else if (!strcmp(argv[i], "--blend") && i + 1 < argc)
+        {
+            if (!parse_blend_mode(argv[++i], &blendMode))
+            {
+                return 1;
+            }
+        }
+        else if (!strcmp(argv[i], "--no-aa"))
+        {
+            aa = false;
+        }
+        else if (!strcmp(argv[i], "--highp"))
+        {
+            highp = true;
+        }
+        else if (!strcmp(argv[i], "--fetch") && i + 1 < argc)
+        {
+            if (!parse_instance_fetch(argv[++i], &fetch))
+            {
+                return 1;
+            }
+        }
+        else if (!strcmp(argv[i], "--packed"))
+        {
+            packed = true;
+        }
+        else if (!strcmp(argv[i], "--sort"))
+        {
+            sortInstances = true;
+        }
+        else if (!strcmp(argv[i], "--capture") && i + 1 < argc)
+        {
+            captureSpec = argv[++i];
+        }
+        else if (!strcmp(argv[i], "--capture-depth") && i + 1 < argc)
+        {
+            captureDepth = std::max(atoi(argv[++i]), 1);
+        }
+        else if (!strcmp(argv[i], "--capture-fps") && i + 1 < argc)
+        {
+            captureFPS = std::max(atof(argv[++i]), 0.0);
+        }
+        else if (!strcmp(argv[i], "--output") && i + 1 < argc)
+        {
+            outputPath = argv[++i];
+        }
+        else if (!strcmp(argv[i], "--output-format") && i + 1 < argc)
+        {
+            outputFormat = argv[++i];
+        }
+        else if (!strcmp(argv[i], "--output-policy") && i + 1 < argc)
+        {
+            ++i;
+            if (!strcmp(argv[i], "drop"))
+            {
+                outputPolicy = QueuePolicy::Drop;
+            }
+            else if (!strcmp(argv[i], "block"))
+            {
+                outputPolicy = QueuePolicy::Block;
+            }
+            else
+            {
+                fprintf(stderr, "Unknown output policy: %s (expected drop or block)\n", argv[i]);
+                return 1;
+            }
+        }
+        else if (!strcmp(argv[i], "--golden-test") && i + 1 < argc)
+        {
+            goldenDir = argv[++i];
+        }
+        else if (!strcmp(argv[i], "--golden-update"))
+        {
+            goldenUpdate = true;
+        }
+        else if (!strcmp(argv[i], "--golden-tolerance") && i + 1 < argc)
+        {
+            goldenTolerance.channel = std::max(atoi(argv[++i]), 0);
+        }
+        else if (!strcmp(argv[i], "--golden-max-pixels") && i + 1 < argc)
+        {
+            goldenTolerance.maxPixels = strtoull(argv[++i], nullptr, 10);
+        }
+        else if (!strcmp(argv[i], "--seed") && i + 1 < argc)
+        {
+            sceneParams.seed = strtoull(argv[++i], nullptr, 10);
+        }
+        else if (!strcmp(argv[i], "--sizes") && i + 1 < argc)
+        {
+            if (!parse_size_distribution(argv[++i], &sceneParams.sizes))
+            {
+                return 1;
+            }
+        }
+        else if (!strcmp(argv[i], "--speeds") && i + 1 < argc)
+        {
+            if (!parse_speed_distribution(argv[++i], &sceneParams.speeds))
+            {
+                return 1;
+            }
+        }
+        else if (!strcmp(argv[i], "--colors") && i + 1 < argc)
+        {
+            if (!parse_color_distribution(argv[++i], &sceneParams.colors))
+            {
+                return 1;
+            }
+        }
+        else if (!strcmp(argv[i], "--save-scene") && i + 1 < argc)
+        {
+            saveScenePath = argv[++i];
+        }
+        else if (!strcmp(argv[i], "--load-scene") && i + 1 < argc)
+        {
+            loadScenePath = argv[++i];
+        }
+        else if (!strcmp(argv[i], "--shm-dump") && i + 1 < argc)
+        {
+            shmDumpName = argv[++i];
+        }
+        else if (!strcmp(argv[i], "--shm-dump-pam") && i + 1 < argc)
+        {
+            shmDumpPath = argv[++i];
+        }
+        else if (!strcmp(argv[i], "--check-shm-ring") && i + 1 < argc)
+        {
+            checkShmFrames = std::max(atoi(argv[++i]), 1);
+        }
+        else if (!strcmp(argv[i], "--control") && i + 1 < argc)
+        {
+            controlPath = argv[++i];
+        }
+        else if (!strcmp(argv[i], "--results") && i + 1 < argc)
+        {
+            resultsPath = argv[++i];
+        }
+        else if (!strcmp(argv[i], "--matrix") && i + 1 < argc)
+        {
+            matrixBackends = argv[++i];
+        }
+        else if (!strcmp(argv[i], "--matrix-runs") && i + 1 < argc)
+        {
+            matrixRuns = std::max(atoi(argv[++i]), 1);
+        }
+        else if (!strcmp(argv[i], "--compare") && i + 2 < argc)
+        {
+            compareBaseline = argv[++i];
+            compareCandidate = argv[++i];
+        }
+        else if (!strcmp(argv[i], "--compare-threshold") && i + 1 < argc)
+        {
+            // In percent.
+            compareThreshold = std::max(atof(argv[++i]), 0.0) / 100;
+        }
+        else if (!strcmp(argv[i], "--frames") && i + 1 < argc)
+        {
+            maxFrames = std::max(atoi(argv[++i]), 1);
+        }
+        else if (!strcmp(argv[i], "--warmup") && i + 1 < argc)
+        {
+            warmupFrames = std::max(atoi(argv[++i]), 0);
+        }
+        else if (!strcmp(argv[i], "--pipeline-depth") && i + 1 < argc)
+        {
+            pipelineDepth = std::max(atoi(argv[++i]), 1);
+        }
+        else if (!strcmp(argv[i], "--threads") && i + 1 < argc)
+        {
+            numThreads = std::max(atoi(argv[++i]), 1);
+        }
+        else if (!strcmp(argv[i], "--bubbles") && i + 1 < argc)
+        {
+            n = std::max(atoi(argv[++i]), 1);
+        }
+        else if (!strcmp(argv[i], "--lifecycle") && i + 1 < argc)
+        {
+            if (!parse_lifecycle_mode(argv[++i], &lifecycleMode))
+            {
+                return 1;
+            }
+        }
+        else if (!strcmp(argv[i], "--sim") && i + 1 < argc)
+        {
+            if (!parse_sim_mode(argv[++i], &simMode))
+            {
+                return 1;
+            }
+        }
+    }
 
-static bool link_program(GLuint program)
-{
-    glLinkProgram(program);
-    GLint isLinked = 0;
-    glGetProgramiv(program, GL_LINK_STATUS, &isLinked);
-    if (isLinked == GL_FALSE)
-    {
-        GLint maxLength = 0;
-        glGetProgramiv(program, GL_INFO_LOG_LENGTH, &maxLength);
-        std::vector<GLchar> infoLog(maxLength);
-        glGetProgramInfoLog(program, maxLength, &maxLength, &infoLog[0]);
-        fprintf(stderr, "Failed to link program %s\n", &infoLog[0]);
-        fflush(stderr);
-        return false;
+    if (benchLayouts)
+    {
+        bench_layouts();
+        return 0;
     }
-    return true;
-}
 
-static int W = 2048;
-static int H = 2048;
+    if (checkAllocationFrames)
+    {
+        return check_cpu_allocations(checkAllocationFrames, numThreads) ? 0 : 1;
+    }
 
-struct Bubble
-{
-    float x, y, r;
-    float dx, dy;
-    std::array<float, 4> color;
-};
+    if (shmDumpName)
+    {
+#ifdef _WIN32
+        fprintf(stderr, "--shm-dump needs POSIX shared memory.\n");
+        return 1;
+#else
+        return dump_shared_frames(shmDumpName, shmDumpPath) ? 0 : 1;
+#endif
+    }
 
-static float lerp(float a, float b, float t) { return a + (b - a) * t; }
-static float frand() { return (float)rand() / RAND_MAX; }
-static float frand(float lo, float hi) { return lerp(lo, hi, frand()); }
+    if (checkShmFrames)
+    {
+#ifdef _WIN32
+        fprintf(stderr, "--check-shm-ring needs POSIX shared memory.\n");
+        return 1;
+#else
+        return check_shm_ring(checkShmFrames) ? 0 : 1;
+#endif
+    }
 
-double now()
-{
-    auto now = std::chrono::high_resolution_clock::now();
-    return std::chrono::time_point_cast<std::chrono::nanoseconds>(now).time_since_epoch().count() *
-           1e-9;
-}
+    if (compareBaseline)
+    {
+        // 0 if nothing regressed, 1 if something did, 2 if the results couldn't be compared.
+        switch (compare_bench_results(compareBaseline, compareCandidate, compareThreshold))
+        {
+            case CompareResult::Passed:
+                return 0;
+            case CompareResult::Regressed:
+                return 1;
+            case CompareResult::Invalid:
+                return 2;
+        }
+    }
 
-int main(int argc, const char* argv[])
-{
-    // Select the ANGLE backend.
-    glfwInitHint(GLFW_ANGLE_PLATFORM_TYPE, GLFW_ANGLE_PLATFORM_TYPE_VULKAN);
-    for (int i = 1; i < argc; i++)
+    if (matrixBackends)
     {
-        if (!strcmp(argv[i], "--gl"))
+        return run_backend_matrix(argc,
+                                  argv,
+                                  matrixBackends,
+                                  matrixRuns,
+                                  maxFrames ? maxFrames : kMatrixFrames,
+                                  warmupFrames,
+                                  resultsPath)
+                   ? 0
+                   : 1;
+    }
+
+#ifdef _WIN32
+    if (controlPath)
+    {
+        fprintf(stderr, "--control needs Unix domain sockets.\n");
+        return 1;
+    }
+#endif
+
+    if (simMode == SimMode::GPU && cpuRender)
+    {
+        fprintf(stderr, "--sim gpu requires the GPU renderer.\n");
+        return 1;
+    }
+    if (lifecycleMode != LifecycleMode::None && (cpuRender || simMode != SimMode::ClosedForm))
+    {
+        fprintf(stderr, "--lifecycle requires the GPU renderer and no --sim.\n");
+        return 1;
+    }
+    if (packed && (simMode == SimMode::GPU || lifecycleMode == LifecycleMode::GPU))
+    {
+        fprintf(stderr, "--packed requires instances that come from the CPU.\n");
+        return 1;
+    }
+    if (sortInstances &&
+        (cpuRender || simMode == SimMode::GPU || lifecycleMode == LifecycleMode::GPU))
+    {
+        fprintf(stderr, "--sort requires the GPU renderer and instances from the CPU.\n");
+        return 1;
+    }
+    // Sorted instances stream every frame.
+    streamInstances = streamInstances || sortInstances;
+    if (goldenDir &&
+        (cpuRender || simMode != SimMode::ClosedForm || lifecycleMode != LifecycleMode::None))
+    {
+        fprintf(stderr, "--golden-test renders on the GPU with closed-form motion only.\n");
+        return 1;
+    }
+
+    // --output streams every rendered frame as uncompressed video, to a file or to stdout ("-").
+    // It's opened before anything gets printed, since writing video to stdout sends the rest of
+    // the output to stderr.
+    std::unique_ptr<FrameSink> outputSink;
+    if (outputPath)
+    {
+        if (captureSpec)
         {
-            glfwInitHint(GLFW_ANGLE_PLATFORM_TYPE, GLFW_ANGLE_PLATFORM_TYPE_OPENGL);
+            fprintf(stderr, "--output and --capture can't be used together.\n");
+            return 1;
         }
-        else if (!strcmp(argv[i], "--gles"))
+        size_t pathLength = strlen(outputPath);
+        VideoFormat format = pathLength >= 4 && !strcmp(outputPath + pathLength - 4, ".y4m")
+                                 ? VideoFormat::Y4M
+                                 : VideoFormat::RGBA;
+        if (outputFormat && !strcmp(outputFormat, "y4m"))
         {
-            glfwInitHint(GLFW_ANGLE_PLATFORM_TYPE, GLFW_ANGLE_PLATFORM_TYPE_OPENGLES);
+            format = VideoFormat::Y4M;
         }
-        else if (!strcmp(argv[i], "--d3d"))
+        else if (outputFormat && !strcmp(outputFormat, "rgba"))
         {
-            glfwInitHint(GLFW_ANGLE_PLATFORM_TYPE, GLFW_ANGLE_PLATFORM_TYPE_D3D11);
+            format = VideoFormat::RGBA;
         }
-        else if (!strcmp(argv[i], "--vk"))
+        else if (outputFormat)
         {
-            glfwInitHint(GLFW_ANGLE_PLATFORM_TYPE, GLFW_ANGLE_PLATFORM_TYPE_VULKAN);
+            fprintf(stderr, "Unknown output format: %s (expected y4m or rgba)\n", outputFormat);
+            return 1;
         }
-        else if (!strcmp(argv[i], "--mtl"))
+        // The stream plays back at --capture-fps, but every frame goes into it.
+        outputSink = VideoSink::Open(outputPath,
+                                     format,
+                                     outputPolicy,
+                                     std::max(static_cast<int>(captureFPS + .5), 1));
+        if (!outputSink)
         {
-            glfwInitHint(GLFW_ANGLE_PLATFORM_TYPE, GLFW_ANGLE_PLATFORM_TYPE_METAL);
+            return 1;
         }
     }
 
+#if !defined(_WIN32) && !defined(__APPLE__)
+    // Without a display server, GLFW's null platform still creates EGL contexts (surfaceless,
+    // where the EGL supports it), so benchmarks also run on headless nodes. Frames render
+    // offscreen as usual; only presenting them does nothing.
+    if (!getenv("DISPLAY") && !getenv("WAYLAND_DISPLAY"))
+    {
+        glfwInitHint(GLFW_PLATFORM, GLFW_PLATFORM_NULL);
+    }
+#endif
+
     if (!glfwInit())
     {
         fprintf(stderr, "Failed to initialize glfw.\n");
@@ -158,6 +1651,8 @@ int main(int argc, const char* argv[])
     glfwWindowHint(GLFW_CONTEXT_VERSION_MINOR, 1);
     glfwWindowHint(GLFW_OPENGL_PROFILE, GLFW_OPENGL_CORE_PROFILE);
     glfwWindowHint(GLFW_SAMPLES, 0);
+    // The golden test renders offscreen.
+    glfwWindowHint(GLFW_VISIBLE, goldenDir ? GLFW_FALSE : GLFW_TRUE);
     GLFWwindow* window = glfwCreateWindow(W, H, "Rive Bubbles", nullptr, nullptr);
     if (!window)
     {
@@ -179,60 +1674,368 @@ int main(int argc, const char* argv[])
 
     printf("GL_VENDOR: %s\n", glGetString(GL_VENDOR));
     printf("GL_RENDERER: %s\n", glGetString(GL_RENDERER));
+    std::string glRenderer = reinterpret_cast<const char*>(glGetString(GL_RENDERER));
     printf("GL_VERSION: %s\n", glGetString(GL_VERSION));
     fflush(stdout);
 
-    GLuint program = glCreateProgram();
-    if (!compile_and_attach_shader(program, GL_VERTEX_SHADER, vs) ||
-        !compile_and_attach_shader(program, GL_FRAGMENT_SHADER, fs) || !link_program(program))
+    if (enable_parallel_shader_compile((GLADloadproc)glfwGetProcAddress))
+    {
+        printf("Using GL_KHR_parallel_shader_compile\n");
+        fflush(stdout);
+    }
+
+    // Shader compiles and scene uploads run on a worker with a shared context, so the render
+    // loop never stalls on them.
+    auto worker = std::make_unique<GLWorker>(window);
+
+    // Issue every program this run needs before generating the scene, so they build while it
+    // generates. With parallel compile the driver builds them on its own threads; otherwise the
+    // draw program builds on the worker. Only the draw program variant for the requested
+    // features gets built; A, B and P switch variants at runtime.
+    auto shaders = std::make_unique<ShaderVariantCache>(worker.get());
+    bool closedForm = simMode == SimMode::ClosedForm && lifecycleMode == LifecycleMode::None;
+    uint32_t variant = shader_variant(blendMode,
+                                      fetch,
+                                      (aa ? kVariantAntialias : 0) |
+                                          (closedForm ? kVariantClosedForm : 0) |
+                                          (highp ? kVariantHighpFragment : 0) |
+                                          (packed ? kVariantPacked : 0));
+    shaders->request(variant);
+    std::unique_ptr<GPUPhysics> gpuPhysics;
+    if (simMode == SimMode::GPU && !benchSim)
+    {
+        gpuPhysics = std::make_unique<GPUPhysics>();
+        gpuPhysics->init();
+    }
+    std::unique_ptr<GPULifecycle> gpuLifecycle;
+    if (lifecycleMode == LifecycleMode::GPU)
+    {
+        gpuLifecycle = std::make_unique<GPULifecycle>();
+        gpuLifecycle->init();
+    }
+
+    if (benchSim)
+    {
+        bool success = bench_sim(numThreads);
+        shaders.reset();
+        worker.reset();
+        glfwTerminate();
+        return success ? 0 : -1;
+    }
+
+    if (goldenDir)
+    {
+        bool passed = run_golden_test(*shaders,
+                                      fetch,
+                                      shader_variant_flags(variant),
+                                      goldenDir,
+                                      goldenTolerance,
+                                      goldenUpdate);
+        shaders.reset();
+        worker.reset();
+        glfwTerminate();
+        return passed ? 0 : 1;
+    }
+
+    // Generate bubbles, from --seed and the distributions, or load them with --load-scene. Either
+    // way, the same arguments give the same scene on every machine.
+    Bubbles bubbles;
+    // Loaded scenes are mapped. When they only go into the static closed-form buffers, those are
+    // filled straight from the mapping, and the CPU copy of the scene (which only the worker's
+    // rebases use then) is made by the first rebase.
+    std::unique_ptr<MappedScene> mappedScene;
+    bool uploadFromMapping = false;
+    if (loadScenePath)
+    {
+        mappedScene = MappedScene::Open(loadScenePath);
+        if (!mappedScene)
+        {
+            return -1;
+        }
+        if (mappedScene->count() > static_cast<size_t>(INT_MAX))
+        {
+            fprintf(stderr, "%s has too many bubbles.\n", loadScenePath);
+            return -1;
+        }
+        n = static_cast<int>(mappedScene->count());
+        sceneParams = mappedScene->params();
+        uploadFromMapping = !cpuRender && simMode == SimMode::ClosedForm &&
+                            lifecycleMode == LifecycleMode::None && !streamInstances && !packed &&
+                            !saveScenePath;
+        if (!uploadFromMapping)
+        {
+            mappedScene->copyTo(bubbles);
+            mappedScene = nullptr;
+        }
+        printf("loaded %i bubbles from %s%s\n",
+               n,
+               loadScenePath,
+               uploadFromMapping ? " (uploading from the mapping)" : "");
+    }
+    else
+    {
+        generate_scene(bubbles, n, sceneParams);
+        printf("generated %i bubbles with seed %llu\n",
+               n,
+               static_cast<unsigned long long>(sceneParams.seed));
+    }
+    if (saveScenePath && !save_scene(saveScenePath, bubbles, sceneParams))
+    {
+        return -1;
+    }
+    if (simMode != SimMode::ClosedForm)
+    {
+        fit_bubbles_for_simulation(bubbles);
+    }
+    // Lifecycle modes hold up to twice the starting population. Computed in size_t, since n may
+    // be anything up to INT_MAX.
+    size_t liveCapacity = 2 * static_cast<size_t>(n);
+    // Streamed closed-form instances are exported from here; static ones are exported a chunk at
+    // a time as they're uploaded.
+    std::vector<Bubble> instances;
+    if (streamInstances)
+    {
+        instances.resize(n);
+        bubbles.exportInterleaved(instances.data(), 0, n);
+    }
+    // With --packed, instances from the CPU get packed on their way to the GPU.
+    std::vector<PackedBubble> packedInstances(packed ? liveCapacity : 0);
+    // With --sort, instances from the CPU get reordered by screen position every frame. The
+    // closed-form instances hold start positions, so their centers get animated on the CPU first.
+    std::unique_ptr<MortonSorter> sorter;
+    std::vector<float> centerX, centerY;
+    if (sortInstances)
+    {
+        sorter = std::make_unique<MortonSorter>();
+        centerX.resize(padded_size(bubbles));
+        centerY.resize(padded_size(bubbles));
+    }
+    auto packInstances = [&](const void* src, size_t stride, size_t count) -> const void* {
+        if (!packed)
+        {
+            return src;
+        }
+        if (packedInstances.size() < count)
+        {
+            packedInstances.resize(count);
+        }
+        pack_bubbles(src, stride, count, packedInstances.data());
+        return packedInstances.data();
+    };
+
+    // Only the draw program has to be ready for the first frame to start; the simulation
+    // programs are waited for where they are first used.
+    if (!shaders->isReady(variant))
+    {
+        printf("waiting on the draw program to finish compiling\n");
+    }
+    GLuint program = shaders->get(variant);
+    if (!program)
+    {
+        return -1;
+    }
+    printf("using shader variant: %s\n", shader_variant_name(variant).c_str());
+    // No instance buffer is larger than a ring of the lifecycle's 2n LiveBubbles (or of
+    // bench_upload's million Bubbles).
+    auto fetcher = std::make_unique<InstanceFetcher>(fetch, packed);
+    size_t maxInstanceBytes =
+        (benchUpload ? 1000000 : liveCapacity) * sizeof(LiveBubble) * InstanceUploader::kRingFrames;
+    if (!fetcher->init((GLADloadproc)glfwGetProcAddress, maxInstanceBytes))
     {
         return -1;
     }
+    if (benchUpload)
+    {
+        glUseProgram(program);
+        bench_upload(*fetcher, 200);
+        fetcher.reset();
+        shaders.reset();
+        worker.reset();
+        glfwTerminate();
+        return 0;
+    }
+
     glUseProgram(program);
-    GLint uniformWindow = glGetUniformLocation(program, "window");
-    GLint uniformT = glGetUniformLocation(program, "T");
-
-    // Generate bubbles.
-    constexpr int n = 800;
-    Bubble bubbles[n];
-    for (Bubble& bubble : bubbles)
-    {
-        float r = lerp(.1f, .3f, powf(frand(), 4));
-        bubble.x = (frand(-1 + r, 1 - r) + 1) * 1024.f;
-        bubble.y = (frand(-1 + r, 1 - r) + 1) * 1024.f;
-        bubble.r = r * 1024.f;
-        bubble.dx = (frand() - .5f) * .02f * 1024.f;
-        bubble.dy = (frand() - .5f) * .02f * 1024.f;
-        // bubble.da = 0; //(frand() - .5) * .03;
-        bubble.color = {frand(.5f, 1), frand(.5f, 1), frand(.5f, 1), frand(.75f, 1)};
-    }
-
-    GLuint bubbleBuff;
-    glGenBuffers(1, &bubbleBuff);
-    glBindBuffer(GL_ARRAY_BUFFER, bubbleBuff);
-    glBufferData(GL_ARRAY_BUFFER, sizeof(bubbles), bubbles, GL_STATIC_DRAW);
-
-    glEnableVertexAttribArray(0);
-    glVertexAttribPointer(0, 3, GL_FLOAT, GL_FALSE, sizeof(Bubble), 0);
-    glVertexAttribDivisor(0, 1);
-
-    glEnableVertexAttribArray(1);
-    glVertexAttribPointer(1,
-                          2,
-                          GL_FLOAT,
-                          GL_FALSE,
-                          sizeof(Bubble),
-                          reinterpret_cast<const void*>(offsetof(Bubble, dx)));
-    glVertexAttribDivisor(1, 1);
-
-    glEnableVertexAttribArray(2);
-    glVertexAttribPointer(2,
-                          4,
-                          GL_FLOAT,
-                          GL_TRUE,
-                          sizeof(Bubble),
-                          reinterpret_cast<const void*>(offsetof(Bubble, color)));
-    glVertexAttribDivisor(2, 1);
+
+    // Indirect draws need a vertex array object.
+    GLuint vao;
+    glGenVertexArrays(1, &vao);
+    glBindVertexArray(vao);
+
+    // With GPU physics or GPU lifecycle the instances live in the simulation's state buffer
+    // instead.
+    // The lifecycle keeps about n bubbles alive, in buffers with room for twice that.
+    std::unique_ptr<LifecycleSpawner> spawner;
+    std::unique_ptr<CPULifecycle> cpuLifecycle;
+    // Instances that the CPU produces every frame stream through an uploader; the closed-form
+    // instances otherwise sit in a static buffer. Rebased or regenerated scenes are uploaded into
+    // the other buffer of the pair by the worker, and swapped in once ready. A scene has to fit in
+    // one buffer.
+    std::unique_ptr<InstanceUploader> uploader;
+    GLuint bubbleBuffs[2] = {0, 0};
+    int bubbleBuffIdx = 0;
+    // How many bubbles each buffer of the pair has room for. The second one is only allocated by
+    // the first rebase or regeneration.
+    int bubbleBuffCounts[2] = {n, 0};
+    // Exports (and packs) bubbles [0, count) into 'buffer' a chunk at a time, so the upload never
+    // stages a copy of the whole scene.
+    auto uploadScene = [&](GLuint buffer, size_t count, bool reallocate) {
+        size_t instanceSize = fetcher->instanceSize();
+        size_t chunkCount = kSceneUploadChunk / sizeof(Bubble);
+        std::vector<Bubble> chunkInstances(std::min(chunkCount, count));
+        glBindBuffer(GL_ARRAY_BUFFER, buffer);
+        if (reallocate)
+        {
+            glBufferData(GL_ARRAY_BUFFER, count * instanceSize, nullptr, GL_STATIC_DRAW);
+        }
+        for (size_t first = 0; first < count; first += chunkCount)
+        {
+            size_t chunk = std::min(chunkCount, count - first);
+            bubbles.exportInterleaved(chunkInstances.data(), first, chunk);
+            const void* data = packInstances(chunkInstances.data(), sizeof(Bubble), chunk);
+            glBufferSubData(GL_ARRAY_BUFFER, first * instanceSize, chunk * instanceSize, data);
+        }
+    };
+    if (simMode == SimMode::GPU)
+    {
+        if (!gpuPhysics->finishInit())
+        {
+            return -1;
+        }
+        gpuPhysics->reset(bubbles);
+    }
+    else if (lifecycleMode != LifecycleMode::None)
+    {
+        spawner = std::make_unique<LifecycleSpawner>(n,
+                                                     simulation_radius_scale(bubbles),
+                                                     static_cast<uint32_t>(sceneParams.seed));
+        if (lifecycleMode == LifecycleMode::CPU)
+        {
+            cpuLifecycle = std::make_unique<CPULifecycle>();
+            cpuLifecycle->reset(liveCapacity,
+                                *spawner,
+                                n,
+                                static_cast<float>(W),
+                                static_cast<float>(H));
+            uploader = std::make_unique<InstanceUploader>(
+                uploadMode,
+                cpuLifecycle->capacity() * (packed ? sizeof(PackedBubble) : sizeof(LiveBubble)));
+        }
+        else
+        {
+            if (!gpuLifecycle->finishInit())
+            {
+                return -1;
+            }
+            gpuLifecycle->reset(static_cast<uint32_t>(liveCapacity),
+                                *spawner,
+                                n,
+                                static_cast<float>(W),
+                                static_cast<float>(H));
+        }
+    }
+    else if (simMode == SimMode::CPU || streamInstances)
+    {
+        uploader = std::make_unique<InstanceUploader>(uploadMode, n * fetcher->instanceSize());
+    }
+    else if (uploadFromMapping)
+    {
+        // The driver reads the records from the mapped file a chunk at a time, so nothing stages
+        // the whole scene in memory, and startup is bounded by how fast the file reads.
+        size_t bytes = static_cast<size_t>(n) * sizeof(Bubble);
+        const uint8_t* records = reinterpret_cast<const uint8_t*>(mappedScene->bubbles());
+        glGenBuffers(2, bubbleBuffs);
+        glBindBuffer(GL_ARRAY_BUFFER, bubbleBuffs[0]);
+        glBufferData(GL_ARRAY_BUFFER, bytes, nullptr, GL_STATIC_DRAW);
+        for (size_t offset = 0; offset < bytes; offset += kSceneUploadChunk)
+        {
+            size_t chunk = std::min(kSceneUploadChunk, bytes - offset);
+            glBufferSubData(GL_ARRAY_BUFFER, offset, chunk, records + offset);
+        }
+    }
+    else
+    {
+        glGenBuffers(2, bubbleBuffs);
+        uploadScene(bubbleBuffs[0], static_cast<size_t>(n), true);
+    }
+
+    // The CPU simulation steps on the simulate stage of whichever pipeline is running.
+    std::unique_ptr<BubblePhysics> physics;
+    std::unique_ptr<WorkerPool> physicsWorkers;
+    if (simMode == SimMode::CPU)
+    {
+        physics = std::make_unique<BubblePhysics>();
+        physics->reset(bubbles);
+        physicsWorkers = std::make_unique<WorkerPool>(numThreads - 1);
+    }
+
+    // The CPU renderer runs as a simulate/rasterize/present pipeline. The kernel for the
+    // blend/AA combination is chosen once, up front.
+    std::unique_ptr<CPUFramePipeline<Bubbles>> cpuPipeline;
+    // Hybrid: the CPU simulates, the GPU renders.
+    std::unique_ptr<InstancePipeline> instancePipeline;
+    if (cpuRender)
+    {
+        CPUFramePipeline<Bubbles>::SimulateFn simulate;
+        if (physics)
+        {
+            simulate = [&](FrameSlot& slot) {
+                for (int i = 0; i < slot.steps; ++i)
+                {
+                    physics->step(1,
+                                  static_cast<float>(slot.width),
+                                  static_cast<float>(slot.height),
+                                  *physicsWorkers);
+                }
+                physics->exportCenters(slot.cx.data(), slot.cy.data());
+            };
+        }
+        RasterKernel<Bubbles> kernel = select_raster_kernel<Bubbles>(blendMode, aa);
+        cpuPipeline = std::make_unique<CPUFramePipeline<Bubbles>>(bubbles,
+                                                                  kernel,
+                                                                  pack_unorm4x8(.1f, .1f, .1f, .1f),
+                                                                  pipelineDepth,
+                                                                  numThreads - 1,
+                                                                  SimClock(deterministic),
+                                                                  std::move(simulate));
+    }
+    else if (physics)
+    {
+        auto simulate = [&](InstanceSlot& slot) {
+            for (int i = 0; i < slot.steps; ++i)
+            {
+                physics->step(1,
+                              static_cast<float>(slot.width),
+                              static_cast<float>(slot.height),
+                              *physicsWorkers);
+            }
+            physics->exportInstances(bubbles, slot.instances.data());
+        };
+        instancePipeline = std::make_unique<InstancePipeline>(n,
+                                                              pipelineDepth,
+                                                              SimClock(deterministic),
+                                                              std::move(simulate));
+    }
+
+    // --capture and --output read rendered frames back asynchronously and stream them to a sink.
+    std::unique_ptr<FrameCapture> capture;
+    if (captureSpec)
+    {
+        std::unique_ptr<FrameSink> sink = open_frame_sink(captureSpec);
+        if (!sink)
+        {
+            return -1;
+        }
+        capture = std::make_unique<FrameCapture>(window, std::move(sink), captureDepth, captureFPS);
+    }
+    else if (outputSink)
+    {
+        capture = std::make_unique<FrameCapture>(window,
+                                                 std::move(outputSink),
+                                                 captureDepth,
+                                                 0,
+                                                 outputPolicy == QueuePolicy::Block);
+    }
 
     GLuint tex = 0;
 
@@ -245,10 +2048,211 @@ int main(int argc, const char* argv[])
     glClearColor(.1f, .1f, .1f, .1f);
     glDisable(GL_DITHER);
 
-    int totalFrames = 0;
+    // Drives the GPU-side simulation; the pipelines keep their own clocks on their own threads.
+    SimClock clock(deterministic);
+    // Closed-form motion on the GPU is evaluated relative to this step; see rebase_bubbles().
+    int64_t baseT = 0;
+    // A rebase or scene switch in flight on the worker, and the base step it will take effect at.
+    // The worker owns 'bubbles', 'mappedScene' and 'packedInstances' until it is ready.
+    std::shared_ptr<GLWorker::Job> sceneJob;
+    int64_t sceneJobBaseT = 0;
+    int sceneJobCount = n;
+    bool regenerateKeyWasDown = false;
+    // The variant selected with A/B/P, which replaces 'variant' once it has been built.
+    uint32_t nextVariant = variant;
+    bool variantKeysWereDown[3] = {};
     int frames = 0;
+    uint64_t lastHeapAllocations = g_heapAllocations.load();
     double start = now();
     int lastWidth = 0, lastHeight = 0;
+    // Since the last "reset" over the control socket, and the rate over the last report.
+    uint64_t totalFrames = 0;
+    double statsStart = start;
+    double lastFPS = 0;
+    bool vsync = false;
+    // With --frames or --results: how long each frame took, from one presented frame to the
+    // next, once the warmup is over. Reserved up front, so recording doesn't allocate.
+    std::vector<double> frameMs;
+    frameMs.reserve(maxFrames ? maxFrames : kMatrixFrames);
+    int warmupFramesLeft = warmupFrames;
+    double lastFrameEnd = 0;
+
+#ifndef _WIN32
+    // Scripts drive a running instance over --control. Variant changes take the same path as the
+    // A/B/P keys, and scene changes the same path as R, so they show up a few frames later.
+    std::unique_ptr<ControlSocket> control;
+    if (controlPath && !(control = ControlSocket::Open(controlPath)))
+    {
+        return -1;
+    }
+    // The static closed-form scene is the only one that can be regenerated live.
+    const bool staticScene = !cpuRender && simMode == SimMode::ClosedForm &&
+                             lifecycleMode == LifecycleMode::None && !uploader;
+    bool controlSceneChange = false;
+    int controlBubbles = n;
+    auto handleCommand = [&](const std::string& line) -> std::string {
+        std::vector<std::string> words = split_words(line);
+        if (words.empty())
+        {
+            return "error: empty command";
+        }
+        const std::string& command = words[0];
+        auto arg = [&](size_t i) { return i < words.size() ? words[i].c_str() : ""; };
+        bool on = !strcmp(arg(1), "on");
+        bool onOff = words.size() == 2 && (on || !strcmp(arg(1), "off"));
+        if (command == "help")
+        {
+            return "ok: metrics | reset | renderer | aa on|off | blend overwrite|srcover|additive "
+                   "| precision highp|mediump | vsync on|off | resize W H | bubbles N | "
+                   "regenerate [SEED]";
+        }
+        if (command == "renderer")
+        {
+            // The CPU and GPU renderers set up different pipelines and threads at startup, so
+            // switching between them takes a restart (with or without --cpu).
+            const char* renderer = cpuRender ? "cpu" : "gpu";
+            if (words.size() == 1 || (words.size() == 2 && !strcmp(arg(1), renderer)))
+            {
+                return std::string("ok: ") + renderer;
+            }
+            return std::string("error: the renderer is fixed at startup; this one is ") + renderer;
+        }
+        if (command == "metrics")
+        {
+            double seconds = now() - statsStart;
+            char json[512];
+            snprintf(json,
+                     sizeof(json),
+                     "{\"frames\":%llu,\"seconds\":%.3f,\"fps\":%.2f,\"fps_window\":%.2f,"
+                     "\"bubbles\":%i,\"width\":%i,\"height\":%i,\"renderer\":\"%s\","
+                     "\"variant\":\"%s\",\"vsync\":%s,\"seed\":%llu}",
+                     static_cast<unsigned long long>(totalFrames),
+                     seconds,
+                     seconds > 0 ? totalFrames / seconds : 0.0,
+                     lastFPS,
+                     n,
+                     lastWidth,
+                     lastHeight,
+                     cpuRender ? "cpu" : "gpu",
+                     cpuRender ? "" : shader_variant_name(variant).c_str(),
+                     vsync ? "true" : "false",
+                     static_cast<unsigned long long>(sceneParams.seed));
+            return json;
+        }
+        if (command == "reset")
+        {
+            // Also throws away what the periodic report has gathered, so it starts over too.
+            frames = 0;
+            start = statsStart = now();
+            totalFrames = 0;
+            lastFPS = 0;
+            lastHeapAllocations = g_heapAllocations.load();
+            if (uploader)
+            {
+                uint64_t bytes;
+                double uploadSeconds, stallSeconds;
+                uploader->takeStats(&bytes, &uploadSeconds, &stallSeconds);
+            }
+            if (sorter)
+            {
+                sorter->takeSeconds();
+            }
+            if (capture)
+            {
+                uint64_t captured, dropped;
+                capture->takeStats(&captured, &dropped);
+            }
+            return "ok";
+        }
+        if (command == "aa" || command == "blend" || command == "precision")
+        {
+            if (cpuRender)
+            {
+                return "error: the CPU renderer has no shader variants";
+            }
+            uint32_t flags = shader_variant_flags(nextVariant);
+            BlendMode blend = shader_variant_blend_mode(nextVariant);
+            if (command == "aa" && onOff)
+            {
+                flags = on ? flags | kVariantAntialias : flags & ~kVariantAntialias;
+            }
+            else if (command == "precision" && words.size() == 2 &&
+                     (!strcmp(arg(1), "highp") || !strcmp(arg(1), "mediump")))
+            {
+                bool highpFragment = !strcmp(arg(1), "highp");
+                flags = highpFragment ? flags | kVariantHighpFragment
+                                      : flags & ~kVariantHighpFragment;
+            }
+            else if (command != "blend" || words.size() != 2 ||
+                     !blend_mode_from_name(arg(1), &blend))
+            {
+                return "error: usage: aa on|off, blend overwrite|srcover|additive, "
+                       "precision highp|mediump";
+            }
+            nextVariant = shader_variant(blend, shader_variant_fetch(nextVariant), flags);
+            shaders->request(nextVariant);
+            return "ok";
+        }
+        if (command == "vsync")
+        {
+            if (!onOff)
+            {
+                return "error: usage: vsync on|off";
+            }
+            vsync = on;
+            glfwSwapInterval(vsync ? 1 : 0);
+            return "ok";
+        }
+        if (command == "resize")
+        {
+            int w = atoi(arg(1)), h = atoi(arg(2));
+            if (words.size() != 3 || w <= 0 || h <= 0)
+            {
+                return "error: usage: resize W H";
+            }
+            // The framebuffer size, and so everything sized to it, follows on a later frame.
+            glfwSetWindowSize(window, w, h);
+            return "ok";
+        }
+        if (command == "bubbles" || command == "regenerate")
+        {
+            if (!staticScene)
+            {
+                return "error: only the static closed-form scene can be changed live";
+            }
+            if (command == "bubbles")
+            {
+                // The back buffer gets reallocated for the new count, which has to stay within
+                // what the fetch path can read from one buffer.
+                long maxCount = static_cast<long>(std::min(
+                    static_cast<size_t>(kMaxControlBubbles),
+                    fetcher->maxBytes() / fetcher->instanceSize()));
+                long count = strtol(arg(1), nullptr, 10);
+                if (words.size() != 2 || count < 1 || count > maxCount)
+                {
+                    return "error: usage: bubbles N, with N from 1 to " +
+                           std::to_string(maxCount);
+                }
+                controlBubbles = static_cast<int>(count);
+            }
+            else if (words.size() == 2)
+            {
+                sceneParams.seed = strtoull(arg(1), nullptr, 0);
+            }
+            else if (words.size() == 1)
+            {
+                ++sceneParams.seed;
+            }
+            else
+            {
+                return "error: usage: regenerate [SEED]";
+            }
+            controlSceneChange = true;
+            return "ok";
+        }
+        return "error: unknown command: " + command;
+    };
+#endif
 
     while (!glfwWindowShouldClose(window))
     {
@@ -256,9 +2260,12 @@ int main(int argc, const char* argv[])
         glfwGetFramebufferSize(window, &width, &height);
         if (lastWidth != width || lastHeight != height)
         {
-            printf("rendering %i bubbles at %i x %i\n", n, width, height);
+            printf("rendering %i bubbles at %i x %i%s\n",
+                   n,
+                   width,
+                   height,
+                   cpuRender ? " on the CPU" : "");
             glViewport(0, 0, width, height);
-            glUniform2f(uniformWindow, static_cast<float>(width), static_cast<float>(height));
 
             glDeleteTextures(1, &tex);
             glGenTextures(1, &tex);
@@ -268,19 +2275,285 @@ int main(int argc, const char* argv[])
             glBindFramebuffer(GL_FRAMEBUFFER, blitFBO);
             glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_TEXTURE_2D, tex, 0);
 
-            glBindFramebuffer(GL_FRAMEBUFFER, renderFBO);
-            glDrawBuffers(0, nullptr);
-            glFramebufferParameteri(GL_DRAW_FRAMEBUFFER, GL_FRAMEBUFFER_DEFAULT_WIDTH, width);
-            glFramebufferParameteri(GL_DRAW_FRAMEBUFFER, GL_FRAMEBUFFER_DEFAULT_HEIGHT, height);
-            glBindImageTexture(0, tex, 0, 0, 0, GL_WRITE_ONLY, GL_R32UI);
+            bind_render_target(renderFBO, tex, width, height, variant);
+
+            if (cpuPipeline)
+            {
+                cpuPipeline->setFramebufferSize(width, height);
+            }
+            if (instancePipeline)
+            {
+                instancePipeline->setFramebufferSize(width, height);
+            }
 
             lastWidth = width;
             lastHeight = height;
         }
 
-        glBindFramebuffer(GL_FRAMEBUFFER, renderFBO);
-        glUniform1f(uniformT, static_cast<float>(totalFrames++));
-        glDrawArraysInstanced(GL_TRIANGLE_STRIP, 0, 4, n);
+        if (cpuPipeline)
+        {
+            // The CPU framebuffer is cleared every frame so the blending modes don't saturate.
+            FrameSlot* frame = cpuPipeline->acquireFrame();
+            if (frame->width == width && frame->height == height)
+            {
+                glBindTexture(GL_TEXTURE_2D, tex);
+                glTexSubImage2D(GL_TEXTURE_2D,
+                                0,
+                                0,
+                                0,
+                                width,
+                                height,
+                                GL_RGBA,
+                                GL_UNSIGNED_BYTE,
+                                frame->pixels.data());
+            }
+            cpuPipeline->releaseFrame(frame);
+        }
+        else
+        {
+            // A toggles antialiasing, B cycles blend modes, P toggles fragment precision.
+            const int variantKeys[3] = {GLFW_KEY_A, GLFW_KEY_B, GLFW_KEY_P};
+            for (int i = 0; i < 3; ++i)
+            {
+                bool down = glfwGetKey(window, variantKeys[i]) == GLFW_PRESS;
+                if (down && !variantKeysWereDown[i])
+                {
+                    if (i == 0)
+                    {
+                        nextVariant ^= kVariantAntialias;
+                    }
+                    else if (i == 1)
+                    {
+                        int blend = static_cast<int>(shader_variant_blend_mode(nextVariant));
+                        nextVariant = shader_variant(static_cast<BlendMode>((blend + 1) % 3),
+                                                     shader_variant_fetch(nextVariant),
+                                                     shader_variant_flags(nextVariant));
+                    }
+                    else
+                    {
+                        nextVariant ^= kVariantHighpFragment;
+                    }
+                    shaders->request(nextVariant);
+                }
+                variantKeysWereDown[i] = down;
+            }
+            // Keep drawing with the current variant until the next one has been built.
+            if (nextVariant != variant && shaders->isReady(nextVariant))
+            {
+                if (GLuint nextProgram = shaders->get(nextVariant))
+                {
+                    variant = nextVariant;
+                    program = nextProgram;
+                    glUseProgram(program);
+                    bind_render_target(renderFBO, tex, width, height, variant);
+                    printf("using shader variant: %s\n", shader_variant_name(variant).c_str());
+                }
+                else
+                {
+                    nextVariant = variant;
+                }
+            }
+            // Where this frame's instances are drawn from.
+            GLuint drawBuffer = 0;
+            GLsizei drawStride = static_cast<GLsizei>(fetcher->instanceSize());
+            size_t drawOffset = 0;
+            if (instancePipeline)
+            {
+                InstanceSlot* frame = instancePipeline->acquireFrame();
+                const void* data = frame->instances.data();
+                if (sorter)
+                {
+                    data = sorter->sort(data,
+                                        sizeof(Bubble),
+                                        n,
+                                        static_cast<float>(width),
+                                        static_cast<float>(height));
+                }
+                data = packInstances(data, sizeof(Bubble), n);
+                drawBuffer = uploader->buffer();
+                drawOffset = uploader->upload(data, n * fetcher->instanceSize());
+                instancePipeline->releaseFrame(frame);
+            }
+            // Simulated instances are already where they belong; T only drives closed-form motion.
+            float T = 0;
+            GLsizei instanceCount = n;
+            if (gpuPhysics)
+            {
+                for (int steps = clock.advance(); steps > 0; --steps)
+                {
+                    gpuPhysics->step(1, static_cast<float>(width), static_cast<float>(height));
+                }
+                glUseProgram(program);
+                drawBuffer = gpuPhysics->instanceBuffer();
+            }
+            else if (cpuLifecycle)
+            {
+                for (int steps = clock.advance(); steps > 0; --steps)
+                {
+                    cpuLifecycle->step(1,
+                                       static_cast<float>(width),
+                                       static_cast<float>(height),
+                                       *spawner);
+                }
+                instanceCount = static_cast<GLsizei>(cpuLifecycle->size());
+                if (!packed)
+                {
+                    drawStride = sizeof(LiveBubble);
+                }
+                const void* data = cpuLifecycle->data();
+                if (sorter)
+                {
+                    data = sorter->sort(data,
+                                        sizeof(LiveBubble),
+                                        instanceCount,
+                                        static_cast<float>(width),
+                                        static_cast<float>(height));
+                }
+                data = packInstances(data, sizeof(LiveBubble), instanceCount);
+                drawBuffer = uploader->buffer();
+                drawOffset = uploader->upload(data, instanceCount * drawStride);
+            }
+            else if (gpuLifecycle)
+            {
+                for (int steps = clock.advance(); steps > 0; --steps)
+                {
+                    gpuLifecycle->step(1,
+                                       static_cast<float>(width),
+                                       static_cast<float>(height),
+                                       *spawner);
+                }
+                glUseProgram(program);
+                // The live bubbles ping-pong between two buffers.
+                drawBuffer = gpuLifecycle->instanceBuffer();
+                drawStride = sizeof(LiveBubble);
+                glBindBuffer(GL_DRAW_INDIRECT_BUFFER, gpuLifecycle->drawCommandBuffer());
+            }
+            else if (simMode == SimMode::ClosedForm && uploader)
+            {
+                clock.advance();
+                int64_t newBaseT = clock.rebaseTime(baseT);
+                if (newBaseT != baseT)
+                {
+                    rebase_bubbles(bubbles,
+                                   static_cast<double>(newBaseT - baseT),
+                                   static_cast<float>(width),
+                                   static_cast<float>(height));
+                    bubbles.exportInterleaved(instances.data(), 0, n);
+                    baseT = newBaseT;
+                }
+                T = static_cast<float>(clock.T() - baseT);
+                const void* data = instances.data();
+                if (sorter)
+                {
+                    float w = static_cast<float>(width), h = static_cast<float>(height);
+                    animate_bubbles(bubbles, T, w, h, centerX.data(), centerY.data());
+                    data = sorter->sort(data,
+                                        sizeof(Bubble),
+                                        n,
+                                        StridedPtr<const float>(centerX.data(), sizeof(float)),
+                                        StridedPtr<const float>(centerY.data(), sizeof(float)),
+                                        w,
+                                        h);
+                }
+                data = packInstances(data, sizeof(Bubble), n);
+                drawBuffer = uploader->buffer();
+                drawOffset = uploader->upload(data, n * fetcher->instanceSize());
+            }
+            else if (simMode == SimMode::ClosedForm)
+            {
+                clock.advance();
+                if (sceneJob && sceneJob->ready())
+                {
+                    sceneJob = nullptr;
+                    bubbleBuffIdx ^= 1;
+                    baseT = sceneJobBaseT;
+                    if (n != sceneJobCount)
+                    {
+                        n = instanceCount = sceneJobCount;
+                        printf("rendering %i bubbles\n", n);
+                    }
+                }
+                // R regenerates the scene, with the next seed. Scene changes over the control
+                // socket have set the seed and count already.
+                bool regenerate = glfwGetKey(window, GLFW_KEY_R) == GLFW_PRESS;
+                bool regenerateKey = regenerate && !regenerateKeyWasDown;
+                regenerateKeyWasDown = regenerate;
+#ifndef _WIN32
+                bool regenerateNow = regenerateKey || controlSceneChange;
+#else
+                bool regenerateNow = regenerateKey;
+#endif
+                int64_t newBaseT = clock.rebaseTime(baseT);
+                if (!sceneJob && (newBaseT != baseT || regenerateNow))
+                {
+                    // Keep drawing from the current buffer (and base) while the worker prepares
+                    // the other one.
+                    int backIdx = bubbleBuffIdx ^ 1;
+                    GLuint backBuffer = bubbleBuffs[backIdx];
+                    double dT = static_cast<double>(newBaseT - baseT);
+                    float w = static_cast<float>(width), h = static_cast<float>(height);
+                    sceneJobBaseT = regenerateNow ? clock.steps() : newBaseT;
+                    sceneJobCount = n;
+                    // Each regeneration takes the next seed, so a run's sequence of scenes is
+                    // reproducible too.
+                    if (regenerateKey)
+                    {
+                        ++sceneParams.seed;
+                    }
+#ifndef _WIN32
+                    if (regenerateNow)
+                    {
+                        sceneJobCount = controlBubbles;
+                        controlSceneChange = false;
+                    }
+#endif
+                    SceneParams params = sceneParams;
+                    size_t count = static_cast<size_t>(sceneJobCount);
+                    // The back buffer only gets reallocated when the count changes.
+                    bool reallocate = bubbleBuffCounts[backIdx] != sceneJobCount;
+                    bubbleBuffCounts[backIdx] = sceneJobCount;
+                    sceneJob = worker->submit(
+                        [&, backBuffer, dT, w, h, regenerateNow, params, count, reallocate]() {
+                            if (regenerateNow)
+                            {
+                                generate_scene(bubbles, count, params);
+                            }
+                            else
+                            {
+                                if (mappedScene)
+                                {
+                                    mappedScene->copyTo(bubbles);
+                                }
+                                rebase_bubbles(bubbles, dT, w, h);
+                            }
+                            mappedScene = nullptr;
+                            uploadScene(backBuffer, count, reallocate);
+                        });
+                }
+                T = static_cast<float>(clock.T() - baseT);
+                drawBuffer = bubbleBuffs[bubbleBuffIdx];
+            }
+            glBindFramebuffer(GL_FRAMEBUFFER, renderFBO);
+            if (shader_variant_blend_mode(variant) != BlendMode::Overwrite)
+            {
+                // Blended variants accumulate, so they start each frame from a clear.
+                glClear(GL_COLOR_BUFFER_BIT);
+            }
+            fetcher->bind(drawBuffer, drawStride, drawOffset);
+            fetcher->setGlobals(static_cast<float>(width), static_cast<float>(height), T);
+            if (gpuLifecycle)
+            {
+                glDrawArraysIndirect(GL_TRIANGLE_STRIP, nullptr);
+            }
+            else
+            {
+                glDrawArraysInstanced(GL_TRIANGLE_STRIP, 0, 4, instanceCount);
+            }
+            if (uploader)
+            {
+                uploader->endFrame();
+            }
+        }
 
         glBindFramebuffer(GL_READ_FRAMEBUFFER, blitFBO);
         glBindFramebuffer(GL_DRAW_FRAMEBUFFER, 0);
@@ -294,22 +2567,124 @@ int main(int argc, const char* argv[])
                           height,
                           GL_COLOR_BUFFER_BIT,
                           GL_NEAREST);
+        if (capture)
+        {
+            capture->captureFrame(width, height, now());
+        }
 
         glfwSwapBuffers(window);
 
+        if (launchTime > 0)
+        {
+            printf("time to first frame: %.1f ms\n", (now() - launchTime) * 1e3);
+            launchTime = 0;
+        }
         ++frames;
+        ++totalFrames;
         double end = now();
+        if (maxFrames || resultsPath)
+        {
+            if (warmupFramesLeft > 0 || lastFrameEnd == 0)
+            {
+                warmupFramesLeft = std::max(warmupFramesLeft - 1, 0);
+            }
+            else
+            {
+                frameMs.push_back((end - lastFrameEnd) * 1e3);
+            }
+            lastFrameEnd = end;
+            if (maxFrames && frameMs.size() >= static_cast<size_t>(maxFrames))
+            {
+                glfwSetWindowShouldClose(window, GLFW_TRUE);
+            }
+        }
         double seconds = end - start;
         if (seconds >= 2)
         {
-            printf("%f fps\n", frames / seconds);
+            uint64_t heapAllocations = g_heapAllocations.load();
+            lastFPS = frames / seconds;
+            printf("%f fps", lastFPS);
+            if (cpuPipeline)
+            {
+                // Includes anything the GL driver allocates through our operator new.
+                printf(" (%.2f heap allocations/frame)",
+                       static_cast<double>(heapAllocations - lastHeapAllocations) / frames);
+            }
+            if (uploader)
+            {
+                uint64_t bytes;
+                double uploadSeconds, stallSeconds;
+                uploader->takeStats(&bytes, &uploadSeconds, &stallSeconds);
+                printf(" (upload: %.2f GB/s, %.2f MB/frame, %.3f ms/frame stalled)",
+                       bytes / std::max(uploadSeconds, 1e-9) * 1e-9,
+                       bytes * 1e-6 / frames,
+                       stallSeconds * 1e3 / frames);
+            }
+            if (sorter)
+            {
+                printf(" (sort: %.3f ms/frame)", sorter->takeSeconds() * 1e3 / frames);
+            }
+            if (capture)
+            {
+                uint64_t captured, dropped;
+                capture->takeStats(&captured, &dropped);
+                printf(" (capture: %.1f fps, %llu dropped)",
+                       captured / seconds,
+                       static_cast<unsigned long long>(dropped));
+            }
+            printf("\n");
+            lastHeapAllocations = heapAllocations;
             fflush(stdout);
             frames = 0;
             start = end;
         }
 
         glfwPollEvents();
+#ifndef _WIN32
+        if (control)
+        {
+            control->poll(handleCommand);
+        }
+#endif
+    }
+
+    bool resultsWritten = true;
+    if (resultsPath)
+    {
+        // The names the command line uses, in enum order.
+        const char* modeNames[] = {"none", "cpu", "gpu"};
+        const char* uploadNames[] = {"subdata", "orphan", "ring"};
+        BenchResult result;
+        result.backend = backend;
+        result.config = cpuRender ? std::string("cpu ") + blend_mode_name(blendMode) +
+                                        (aa ? " aa, " : " no-aa, ") + std::to_string(numThreads) +
+                                        " threads"
+                                  : shader_variant_name(variant);
+        result.config += std::string(", sim ") + modeNames[static_cast<int>(simMode)];
+        result.config += std::string(", lifecycle ") + modeNames[static_cast<int>(lifecycleMode)];
+        if (streamInstances)
+        {
+            result.config += std::string(", upload ") + uploadNames[static_cast<int>(uploadMode)];
+        }
+        result.config += sortInstances ? ", sorted" : "";
+        result.glRenderer = glRenderer;
+        result.bubbles = n;
+        result.width = lastWidth;
+        result.height = lastHeight;
+        result.seed = sceneParams.seed;
+        result.frameMs = std::move(frameMs);
+        resultsWritten = append_bench_result(resultsPath, result);
     }
 
+    capture.reset();
+    cpuPipeline.reset();
+    instancePipeline.reset();
+    gpuPhysics.reset();
+    gpuLifecycle.reset();
+    uploader.reset();
+    fetcher.reset();
+    shaders.reset();
+    worker.reset();
     glfwTerminate();
+    return resultsWritten ? 0 : 1;
 }
@@ -0,0 +1,225 @@
+/*
+ * Copyright 2022 Rive
+ */
+
+#pragma once
+
+// A local control channel: a Unix domain socket that scripts connect to and send commands over,
+// one per line. Each command gets one line back. Everything is non-blocking, so the render loop
+// polls it once a frame and never waits on a client.
+
+#ifndef _WIN32
+
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+#include <memory>
+#include <string>
+#include <vector>
+#include <fcntl.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#ifndef MSG_NOSIGNAL
+#define MSG_NOSIGNAL 0
+#endif
+
+// Splits a command line into words at spaces and tabs.
+static inline std::vector<std::string> split_words(const std::string& line)
+{
+    std::vector<std::string> words;
+    size_t i = 0;
+    while (i < line.size())
+    {
+        size_t start = line.find_first_not_of(" \t", i);
+        if (start == std::string::npos)
+        {
+            break;
+        }
+        size_t end = line.find_first_of(" \t", start);
+        end = end == std::string::npos ? line.size() : end;
+        words.push_back(line.substr(start, end - start));
+        i = end;
+    }
+    return words;
+}
+
+class ControlSocket
+{
+public:
+    // Lines longer than this are dropped, along with the client that sent them.
+    constexpr static size_t kMaxLineLength = 4096;
+    // So are clients that send commands without reading the replies, once this much piles up.
+    constexpr static size_t kMaxPendingOutput = 64 * 1024;
+    // The most read from one client per poll, so a client that never stops sending can't stall
+    // the frame. The rest waits for the next poll.
+    constexpr static size_t kMaxInputPerPoll = 64 * 1024;
+
+    // Listens on 'path', replacing any stale socket there. Returns null, after printing why, if it
+    // can't.
+    static std::unique_ptr<ControlSocket> Open(const char* path)
+    {
+        sockaddr_un address = {};
+        address.sun_family = AF_UNIX;
+        if (strlen(path) >= sizeof(address.sun_path))
+        {
+            fprintf(stderr, "Control socket path is too long: %s\n", path);
+            return nullptr;
+        }
+        strcpy(address.sun_path, path);
+        int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+        unlink(path);
+        if (fd < 0 || !set_non_blocking(fd) ||
+            bind(fd, reinterpret_cast<sockaddr*>(&address), sizeof(address)) != 0 ||
+            listen(fd, 4) != 0)
+        {
+            fprintf(stderr, "Failed to listen on %s: %s\n", path, strerror(errno));
+            if (fd >= 0)
+            {
+                close(fd);
+            }
+            return nullptr;
+        }
+        return std::unique_ptr<ControlSocket>(new ControlSocket(fd, path));
+    }
+
+    ~ControlSocket()
+    {
+        for (Client& client : m_clients)
+        {
+            close(client.fd);
+        }
+        close(m_listenFD);
+        unlink(m_path.c_str());
+    }
+
+    ControlSocket(const ControlSocket&) = delete;
+    ControlSocket& operator=(const ControlSocket&) = delete;
+
+    // Accepts new clients and runs every complete line they have sent through
+    // handler(const std::string& line) -> std::string, which returns the reply (without a
+    // newline). Never blocks.
+    template <typename Handler> void poll(Handler&& handler)
+    {
+        for (int fd; (fd = accept(m_listenFD, nullptr, nullptr)) >= 0;)
+        {
+            if (set_non_blocking(fd))
+            {
+                m_clients.push_back({fd, {}, {}});
+            }
+            else
+            {
+                close(fd);
+            }
+        }
+        for (size_t i = 0; i < m_clients.size();)
+        {
+            if (serve(m_clients[i], handler))
+            {
+                ++i;
+            }
+            else
+            {
+                close(m_clients[i].fd);
+                m_clients.erase(m_clients.begin() + i);
+            }
+        }
+    }
+
+private:
+    struct Client
+    {
+        int fd;
+        std::string input;  // Received, not yet a complete line.
+        std::string output; // Replies the socket didn't have room for yet.
+    };
+
+    ControlSocket(int fd, const char* path) : m_listenFD(fd), m_path(path) {}
+
+    static bool set_non_blocking(int fd)
+    {
+        int flags = fcntl(fd, F_GETFL, 0);
+        return flags >= 0 && fcntl(fd, F_SETFL, flags | O_NONBLOCK) == 0;
+    }
+
+    // Returns false once the client has gone away or misbehaved. A client that closes its end
+    // after its last command still gets the replies to everything it sent, if they fit in the
+    // socket buffer.
+    template <typename Handler> bool serve(Client& client, Handler& handler)
+    {
+        char buffer[1024];
+        bool open = true;
+        for (size_t total = 0; total < kMaxInputPerPoll;)
+        {
+            ssize_t received = recv(client.fd, buffer, sizeof(buffer), 0);
+            if (received > 0)
+            {
+                total += static_cast<size_t>(received);
+                client.input.append(buffer, static_cast<size_t>(received));
+                // Checked as the input arrives, so a flood is caught before either buffer grows
+                // much past its limit.
+                if (!handleLines(client, handler))
+                {
+                    return false;
+                }
+            }
+            else if (received == 0 || (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR))
+            {
+                open = false;
+                break;
+            }
+            else if (errno != EINTR)
+            {
+                break;
+            }
+        }
+        while (!client.output.empty())
+        {
+            ssize_t sent =
+                send(client.fd, client.output.data(), client.output.size(), MSG_NOSIGNAL);
+            if (sent > 0)
+            {
+                client.output.erase(0, static_cast<size_t>(sent));
+            }
+            else if (sent < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+            {
+                break;
+            }
+            else if (sent < 0 && errno != EINTR)
+            {
+                return false;
+            }
+        }
+        return open;
+    }
+
+    // Runs the complete lines in the client's input through the handler. Returns false if the
+    // client has gone over kMaxLineLength or kMaxPendingOutput.
+    template <typename Handler> static bool handleLines(Client& client, Handler& handler)
+    {
+        size_t lineEnd;
+        while ((lineEnd = client.input.find('\n')) != std::string::npos)
+        {
+            std::string line = client.input.substr(0, lineEnd);
+            client.input.erase(0, lineEnd + 1);
+            if (!line.empty() && line.back() == '\r')
+            {
+                line.pop_back();
+            }
+            client.output += handler(line);
+            client.output += '\n';
+            if (client.output.size() > kMaxPendingOutput)
+            {
+                return false;
+            }
+        }
+        return client.input.size() <= kMaxLineLength;
+    }
+
+    const int m_listenFD;
+    const std::string m_path;
+    std::vector<Client> m_clients;
+};
+
+#endif
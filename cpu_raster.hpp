@@ -0,0 +1,270 @@
+/*
+ * Copyright 2022 Rive
+ */
+
+#pragma once
+
+#include "bubble_storage.hpp"
+#include "frame_arena.hpp"
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+
+// How a shaded bubble fragment combines with the framebuffer.
+enum class BlendMode
+{
+    Overwrite, // Replaces the destination, like the imageStore in "fs" (but only where covered).
+    SrcOver,   // Premultiplied source-over.
+    Additive,  // Saturating add.
+};
+
+static inline const char* blend_mode_name(BlendMode mode)
+{
+    const char* names[] = {"overwrite", "srcover", "additive"};
+    return names[static_cast<int>(mode)];
+}
+
+// The inverse of blend_mode_name(). Returns false, without printing, if 'name' isn't one.
+static inline bool blend_mode_from_name(const char* name, BlendMode* mode)
+{
+    for (BlendMode candidate : {BlendMode::Overwrite, BlendMode::SrcOver, BlendMode::Additive})
+    {
+        if (!strcmp(name, blend_mode_name(candidate)))
+        {
+            *mode = candidate;
+            return true;
+        }
+    }
+    return false;
+}
+
+// RGBA8 pixels, packed the same as packUnorm4x8 (red in the low byte).
+struct RasterTarget
+{
+    uint32_t* pixels;
+    int width, height;
+};
+
+static inline float clamp01(float x)
+{
+    x = x > 0 ? x : 0;
+    return x < 1 ? x : 1;
+}
+
+static inline uint32_t pack_unorm4x8(float r, float g, float b, float a)
+{
+    auto unorm8 = [](float c) {
+        return static_cast<uint32_t>(static_cast<int32_t>(clamp01(c) * 255.f + .5f));
+    };
+    return unorm8(r) | unorm8(g) << 8 | unorm8(b) << 16 | unorm8(a) << 24;
+}
+
+static inline void clear_rows(const RasterTarget& target, int y0, int y1, uint32_t color)
+{
+    std::fill(target.pixels + static_cast<size_t>(y0) * target.width,
+              target.pixels + static_cast<size_t>(y1) * target.width,
+              color);
+}
+
+// Combines premultiplied source color (r, g, b, a) with the packed destination pixel.
+template <BlendMode B>
+static inline uint32_t blend_pixel(float r, float g, float b, float a, uint32_t dst)
+{
+    if constexpr (B == BlendMode::Overwrite)
+    {
+        return pack_unorm4x8(r, g, b, a);
+    }
+    else
+    {
+        constexpr float k = 1 / 255.f;
+        float dr = static_cast<float>(dst & 0xff) * k;
+        float dg = static_cast<float>((dst >> 8) & 0xff) * k;
+        float db = static_cast<float>((dst >> 16) & 0xff) * k;
+        float da = static_cast<float>(dst >> 24) * k;
+        if constexpr (B == BlendMode::SrcOver)
+        {
+            float ia = 1 - a;
+            return pack_unorm4x8(r + dr * ia, g + dg * ia, b + db * ia, a + da * ia);
+        }
+        else
+        {
+            return pack_unorm4x8(r + dr, g + dg, b + db, a + da);
+        }
+    }
+}
+
+// Per-bubble constants for shading a span of pixels.
+struct SpanShader
+{
+    float x, y, invR;
+    float red, green, blue, alpha;
+};
+
+// Shades pixels [x0, x1) of one row with the color math from "fs". Interior spans are known to be
+// fully covered, so only edge spans evaluate coverage.
+template <BlendMode B, bool AA, bool Edge>
+static inline void shade_span(uint32_t* __restrict row,
+                              int x0,
+                              int x1,
+                              const SpanShader& s,
+                              float oy)
+{
+    float oy2 = oy * oy;
+    float absOY = fabsf(oy);
+    for (int px = x0; px < x1; ++px)
+    {
+        float ox = (px + .5f - s.x) * s.invR;
+        float d2 = ox * ox + oy2;
+        float coverage = 1;
+        if constexpr (Edge)
+        {
+            static_assert(AA, "only antialiased bubbles have edge spans");
+            // fwidth(f) in pixels: |df/dx| + |df/dy|.
+            float fw = 2 * (fabsf(ox) + absOY) * s.invR + 1e-7f;
+            coverage = clamp01(.5f - (d2 - 1) / fw);
+        }
+        float a = s.alpha * (.25f + .75f * d2) * coverage;
+        uint32_t dst = row[px];
+        uint32_t src = blend_pixel<B>(s.red * a, s.green * a, s.blue * a, a, dst);
+        if constexpr (Edge)
+        {
+            row[px] = coverage > 0 ? src : dst;
+        }
+        else
+        {
+            row[px] = src;
+        }
+    }
+}
+
+// Pixel centers px + .5 that fall within [x - halfWidth, x + halfWidth], as a half-open range
+// clipped to [0, width).
+static inline void span_pixels(float x, float halfWidth, int width, int* x0, int* x1)
+{
+    *x0 = std::max(static_cast<int>(ceilf(x - halfWidth - .5f)), 0);
+    *x1 = std::min(static_cast<int>(floorf(x + halfWidth - .5f)) + 1, width);
+}
+
+// One scanline of a bubble: the fully covered interior [ix0, ix1) and, with AA, the outer
+// bounds [ox0, ox1) whose remainder is the antialiased edge.
+struct RowSpan
+{
+    int ix0, ix1;
+    int ox0, ox1;
+};
+
+// Shades bubbles[ids[0..count)] into rows [y0, y1) of the target with the same coverage and color
+// as "fs". Rather than evaluating coverage across the whole bounding box, each scanline is split
+// analytically into a fully covered interior span and the thin antialiased edges around it;
+// only the edges pay for the coverage math. The spans of a bubble are set up first, in scratch
+// memory, so the shading loops that follow do no root finding. The blend mode and AA are
+// template parameters so the per-pixel loops carry no mode checks.
+template <BlendMode B, bool AA, typename Store>
+void rasterize_bubbles(const RasterTarget& target,
+                       const Store& bubbles,
+                       const float* cx,
+                       const float* cy,
+                       const uint32_t* ids,
+                       size_t count,
+                       int y0,
+                       int y1,
+                       FrameArena::SubArena& scratch)
+{
+    y0 = std::max(y0, 0);
+    y1 = std::min(y1, target.height);
+    RowSpan* spans = scratch.alloc<RowSpan>(std::max(y1 - y0, 0));
+    for (size_t j = 0; j < count; ++j)
+    {
+        uint32_t i = ids[j];
+        float r = bubbles.r(i);
+        if (r <= 0)
+        {
+            continue;
+        }
+        SpanShader s{cx[i],
+                     cy[i],
+                     1 / r,
+                     bubbles.color(i, 0),
+                     bubbles.color(i, 1),
+                     bubbles.color(i, 2),
+                     bubbles.color(i, 3)};
+        // In pixel units, "fs" reaches full coverage where r^2 - d^2 >= |dx| + |dy|, and zero
+        // coverage where d^2 - r^2 >= |dx| + |dy|. Bounding |dx| + |dy| <= sqrt(2) * d gives
+        // conservative radii for both: the roots of d^2 +/- sqrt(2) * d - r^2 = 0.
+        constexpr float kSqrtHalf = .70710678f;
+        float innerR = r, outerR = r;
+        if constexpr (AA)
+        {
+            float q = sqrtf(2 + 4 * r * r) * .5f;
+            innerR = std::max(q - kSqrtHalf, 0.f);
+            outerR = q + kSqrtHalf;
+        }
+        int t = std::max(static_cast<int>(floorf(s.y - outerR)), y0);
+        int b = std::min(static_cast<int>(ceilf(s.y + outerR)), y1);
+
+        for (int py = t; py < b; ++py)
+        {
+            RowSpan& span = spans[py - t];
+            float dy = py + .5f - s.y;
+            float innerW2 = innerR * innerR - dy * dy;
+            span.ix0 = span.ix1 = 0;
+            if (innerW2 > 0)
+            {
+                span_pixels(s.x, sqrtf(innerW2), target.width, &span.ix0, &span.ix1);
+            }
+            if constexpr (AA)
+            {
+                float outerW2 = outerR * outerR - dy * dy;
+                span.ox0 = span.ox1 = 0;
+                if (outerW2 > 0)
+                {
+                    span_pixels(s.x, sqrtf(outerW2), target.width, &span.ox0, &span.ox1);
+                }
+                if (span.ix0 >= span.ix1)
+                {
+                    // No interior on this row; the whole outer span is edge.
+                    span.ix0 = span.ix1 = span.ox1;
+                }
+            }
+        }
+
+        for (int py = t; py < b; ++py)
+        {
+            const RowSpan& span = spans[py - t];
+            uint32_t* row = target.pixels + static_cast<size_t>(py) * target.width;
+            float oy = (py + .5f - s.y) * s.invR;
+            shade_span<B, AA, false>(row, span.ix0, span.ix1, s, oy);
+            if constexpr (AA)
+            {
+                shade_span<B, AA, true>(row, span.ox0, span.ix0, s, oy);
+                shade_span<B, AA, true>(row, span.ix1, span.ox1, s, oy);
+            }
+        }
+    }
+}
+
+template <typename Store>
+using RasterKernel = void (*)(const RasterTarget&,
+                              const Store&,
+                              const float* cx,
+                              const float* cy,
+                              const uint32_t* ids,
+                              size_t count,
+                              int y0,
+                              int y1,
+                              FrameArena::SubArena& scratch);
+
+// Picks the specialized kernel for a blend/AA combination. Call once per frame, not per bubble.
+template <typename Store> RasterKernel<Store> select_raster_kernel(BlendMode blend, bool aa)
+{
+    constexpr static RasterKernel<Store> kKernels[3][2] = {
+        {rasterize_bubbles<BlendMode::Overwrite, false, Store>,
+         rasterize_bubbles<BlendMode::Overwrite, true, Store>},
+        {rasterize_bubbles<BlendMode::SrcOver, false, Store>,
+         rasterize_bubbles<BlendMode::SrcOver, true, Store>},
+        {rasterize_bubbles<BlendMode::Additive, false, Store>,
+         rasterize_bubbles<BlendMode::Additive, true, Store>},
+    };
+    return kKernels[static_cast<int>(blend)][aa];
+}
@@ -0,0 +1,104 @@
+/*
+ * Copyright 2022 Rive
+ */
+
+#pragma once
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <vector>
+
+// Bump allocator for data that only lives until the end of a frame (bins, spans, scratch).
+// Chunks are retained across frames, so once the arena has grown to a frame's high-water mark
+// it stops touching the heap. reset() is O(1): it bumps an epoch, and each sub-arena rewinds
+// itself lazily on its next allocation.
+//
+// Every worker thread gets its own sub-arena, so allocation never needs to synchronize.
+class FrameArena
+{
+public:
+    class SubArena
+    {
+    public:
+        // Uninitialized storage for 'count' Ts.
+        template <typename T> T* alloc(size_t count)
+        {
+            return static_cast<T*>(allocBytes(count * sizeof(T), alignof(T)));
+        }
+
+    private:
+        friend class FrameArena;
+
+        struct Chunk
+        {
+            std::unique_ptr<char[]> data;
+            size_t size;
+        };
+
+        void* allocBytes(size_t size, size_t align)
+        {
+            if (m_epoch != *m_frameEpoch)
+            {
+                m_epoch = *m_frameEpoch;
+                m_chunkIdx = 0;
+                m_offset = 0;
+            }
+            for (; m_chunkIdx < m_chunks.size(); ++m_chunkIdx, m_offset = 0)
+            {
+                Chunk& chunk = m_chunks[m_chunkIdx];
+                uintptr_t base = reinterpret_cast<uintptr_t>(chunk.data.get());
+                size_t start = ((base + m_offset + align - 1) & ~(align - 1)) - base;
+                if (start + size <= chunk.size)
+                {
+                    m_offset = start + size;
+                    return chunk.data.get() + start;
+                }
+            }
+            size_t chunkSize = std::max(m_chunkSize, size + align);
+            m_chunks.push_back({std::unique_ptr<char[]>(new char[chunkSize]), chunkSize});
+            m_chunkIdx = m_chunks.size() - 1;
+            m_offset = 0;
+            return allocBytes(size, align);
+        }
+
+        const uint64_t* m_frameEpoch = nullptr;
+        size_t m_chunkSize = 0;
+        uint64_t m_epoch = 0;
+        std::vector<Chunk> m_chunks;
+        size_t m_chunkIdx = 0;
+        size_t m_offset = 0;
+    };
+
+    explicit FrameArena(int numThreads = 0, size_t chunkSize = 256 << 10) :
+        m_subArenas(numThreads + 1)
+    {
+        for (PaddedSubArena& sub : m_subArenas)
+        {
+            sub.arena.m_frameEpoch = &m_epoch;
+            sub.arena.m_chunkSize = chunkSize;
+        }
+    }
+
+    FrameArena(const FrameArena&) = delete;
+    FrameArena& operator=(const FrameArena&) = delete;
+
+    // Allocates from the arena of the thread that owns the frame.
+    template <typename T> T* alloc(size_t count) { return m_subArenas[0].arena.alloc<T>(count); }
+
+    // Sub-arena for worker 'threadIdx'. Only that thread may allocate from it.
+    SubArena& thread(int threadIdx) { return m_subArenas[threadIdx + 1].arena; }
+
+    // Invalidates everything allocated since the previous reset.
+    void reset() { ++m_epoch; }
+
+private:
+    struct alignas(64) PaddedSubArena
+    {
+        SubArena arena;
+    };
+
+    uint64_t m_epoch = 0;
+    std::vector<PaddedSubArena> m_subArenas;
+};
@@ -0,0 +1,322 @@
+/*
+ * Copyright 2022 Rive
+ */
+
+#pragma once
+
+#include "glad/glad.h"
+#include "GLFW/glfw3.h"
+#include "gl_worker.hpp"
+#include "shm_frames.hpp"
+#include <algorithm>
+#include <atomic>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <memory>
+#include <string>
+#include <vector>
+
+// What a sink did with a frame.
+enum class FrameWrite
+{
+    Kept,
+    Dropped, // Skipped, but the sink can take more frames.
+    Failed,  // The sink can't take any more frames.
+};
+
+// Where captured frames go. Sinks run on the capture thread, one frame at a time, in order.
+class FrameSink
+{
+public:
+    virtual ~FrameSink() = default;
+
+    // 'pixels' holds height rows of width RGBA8 pixels, bottom row first (as GL reads them).
+    virtual FrameWrite writeFrame(const uint8_t* pixels,
+                                  int width,
+                                  int height,
+                                  uint64_t frameIndex) = 0;
+};
+
+// Writes frames as raw RGBA8, top row first, to a FILE: a file or a pipe into another process
+// (e.g. "ffmpeg -f rawvideo -pix_fmt rgba -s 2048x2048 -i - out.mp4").
+class StdioSink : public FrameSink
+{
+public:
+    static std::unique_ptr<StdioSink> OpenFile(const char* path)
+    {
+        FILE* file = fopen(path, "wb");
+        if (!file)
+        {
+            fprintf(stderr, "Failed to open %s for capture.\n", path);
+            return nullptr;
+        }
+        return std::unique_ptr<StdioSink>(new StdioSink(file, false));
+    }
+
+    static std::unique_ptr<StdioSink> OpenPipe(const char* command)
+    {
+#ifdef _WIN32
+        FILE* pipe = _popen(command, "wb");
+#else
+        FILE* pipe = popen(command, "w");
+#endif
+        if (!pipe)
+        {
+            fprintf(stderr, "Failed to start \"%s\" for capture.\n", command);
+            return nullptr;
+        }
+        return std::unique_ptr<StdioSink>(new StdioSink(pipe, true));
+    }
+
+    ~StdioSink() override
+    {
+        if (m_isPipe)
+        {
+#ifdef _WIN32
+            _pclose(m_file);
+#else
+            pclose(m_file);
+#endif
+        }
+        else
+        {
+            fclose(m_file);
+        }
+    }
+
+    FrameWrite writeFrame(const uint8_t* pixels, int width, int height, uint64_t) override
+    {
+        size_t rowBytes = static_cast<size_t>(width) * 4;
+        for (int y = height - 1; y >= 0; --y)
+        {
+            if (fwrite(pixels + y * rowBytes, 1, rowBytes, m_file) != rowBytes)
+            {
+                return FrameWrite::Failed;
+            }
+        }
+        return FrameWrite::Kept;
+    }
+
+private:
+    StdioSink(FILE* file, bool isPipe) : m_file(file), m_isPipe(isPipe) {}
+
+    FILE* const m_file;
+    const bool m_isPipe;
+};
+
+#ifndef _WIN32
+// Publishes frames into a shared memory ring (see shm_frames.hpp) for other local processes to
+// read in place. The ring is created, with slots the size of the first frame, when that frame
+// arrives. Larger frames don't fit, and are dropped.
+class SharedMemorySink : public FrameSink
+{
+public:
+    explicit SharedMemorySink(const char* name) : m_name(name) {}
+
+    FrameWrite writeFrame(const uint8_t* pixels,
+                          int width,
+                          int height,
+                          uint64_t frameIndex) override
+    {
+        ptrdiff_t rowBytes = static_cast<ptrdiff_t>(width) * 4;
+        if (!m_writer)
+        {
+            m_writer = ShmFrameWriter::Create(m_name.c_str(), rowBytes * height);
+            if (!m_writer)
+            {
+                return FrameWrite::Failed;
+            }
+        }
+        // Flip to top row first on the way in.
+        return m_writer->publish(pixels + (height - 1) * rowBytes,
+                                 -rowBytes,
+                                 static_cast<uint32_t>(width),
+                                 static_cast<uint32_t>(height),
+                                 frameIndex)
+                   ? FrameWrite::Kept
+                   : FrameWrite::Dropped;
+    }
+
+private:
+    const std::string m_name;
+    std::unique_ptr<ShmFrameWriter> m_writer;
+};
+#endif
+
+// Parses "file:PATH", "pipe:COMMAND" or "shm:NAME". Returns null, after printing why, if the spec
+// is bad or the sink can't be opened.
+static inline std::unique_ptr<FrameSink> open_frame_sink(const char* spec)
+{
+    if (!strncmp(spec, "file:", 5))
+    {
+        return StdioSink::OpenFile(spec + 5);
+    }
+    if (!strncmp(spec, "pipe:", 5))
+    {
+        return StdioSink::OpenPipe(spec + 5);
+    }
+    if (!strncmp(spec, "shm:", 4))
+    {
+#ifdef _WIN32
+        fprintf(stderr, "Shared memory capture needs POSIX shared memory.\n");
+        return nullptr;
+#else
+        return std::make_unique<SharedMemorySink>(spec + 4);
+#endif
+    }
+    fprintf(stderr,
+            "Unknown capture sink: %s (expected file:PATH, pipe:COMMAND or shm:NAME)\n",
+            spec);
+    return nullptr;
+}
+
+// Captures rendered frames without stalling the render loop. The render thread only issues a
+// glReadPixels into the next pixel pack buffer of a ring, plus a fence. A capture thread, with a
+// context shared with the render context, waits for each fence, maps the buffer and hands the
+// pixels to the sink, so a frame is consumed about 'depth' frames after it was read. If the sink
+// falls behind and the ring fills up, frames are dropped rather than waited for, unless the
+// capture was asked to block.
+class FrameCapture
+{
+public:
+    // Must be called on the thread that owns 'shareWith'. Captures at most 'fps' frames per
+    // second (of the times passed to captureFrame()), or every frame if fps is 0. With
+    // 'blockWhenFull', a full ring makes captureFrame() wait for the sink instead of dropping.
+    FrameCapture(GLFWwindow* shareWith,
+                 std::unique_ptr<FrameSink> sink,
+                 int depth,
+                 double fps,
+                 bool blockWhenFull = false) :
+        m_worker(shareWith),
+        m_sink(std::move(sink)),
+        m_slots(std::max(depth, 1)),
+        m_interval(fps > 0 ? 1 / fps : 0),
+        m_blockWhenFull(blockWhenFull)
+    {
+        for (Slot& slot : m_slots)
+        {
+            glGenBuffers(1, &slot.buffer);
+        }
+    }
+
+    ~FrameCapture()
+    {
+        for (Slot& slot : m_slots)
+        {
+            if (slot.job)
+            {
+                slot.job->wait();
+            }
+            glDeleteBuffers(1, &slot.buffer);
+        }
+    }
+
+    FrameCapture(const FrameCapture&) = delete;
+    FrameCapture& operator=(const FrameCapture&) = delete;
+
+    // Render thread: call once a frame has been rendered, with the framebuffer that holds it
+    // bound to GL_READ_FRAMEBUFFER. Captures it if it's time to and the ring has room.
+    void captureFrame(int width, int height, double time)
+    {
+        if (m_sinkFailed.load(std::memory_order_relaxed) || time < m_nextTime)
+        {
+            return;
+        }
+        // After a stall, pick the schedule back up from now, rather than catching up with
+        // frames captured back to back.
+        m_nextTime += m_interval;
+        if (m_nextTime <= time)
+        {
+            m_nextTime = time + m_interval;
+        }
+        Slot& slot = m_slots[m_nextSlot];
+        if (slot.job && !slot.job->ready())
+        {
+            if (!m_blockWhenFull)
+            {
+                ++m_dropped;
+                return;
+            }
+            slot.job->wait();
+        }
+        slot.job = nullptr;
+        m_nextSlot = (m_nextSlot + 1) % m_slots.size();
+
+        size_t bytes = static_cast<size_t>(width) * height * 4;
+        glBindBuffer(GL_PIXEL_PACK_BUFFER, slot.buffer);
+        if (slot.size != bytes)
+        {
+            glBufferData(GL_PIXEL_PACK_BUFFER, bytes, nullptr, GL_STREAM_READ);
+            slot.size = bytes;
+        }
+        glReadPixels(0, 0, width, height, GL_RGBA, GL_UNSIGNED_BYTE, nullptr);
+        glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+        GLsync fence = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+        // The capture thread can only wait on a fence once it has been flushed.
+        glFlush();
+
+        GLuint buffer = slot.buffer;
+        uint64_t frameIndex = m_frameIndex++;
+        slot.job = m_worker.submit([this, buffer, bytes, fence, width, height, frameIndex]() {
+            while (glClientWaitSync(fence, 0, 1000000000) == GL_TIMEOUT_EXPIRED)
+            {
+            }
+            glDeleteSync(fence);
+            if (m_sinkFailed.load(std::memory_order_relaxed))
+            {
+                return;
+            }
+            glBindBuffer(GL_PIXEL_PACK_BUFFER, buffer);
+            if (auto* pixels = static_cast<const uint8_t*>(
+                    glMapBufferRange(GL_PIXEL_PACK_BUFFER, 0, bytes, GL_MAP_READ_BIT)))
+            {
+                switch (m_sink->writeFrame(pixels, width, height, frameIndex))
+                {
+                    case FrameWrite::Kept:
+                        m_captured.fetch_add(1, std::memory_order_relaxed);
+                        break;
+                    case FrameWrite::Dropped:
+                        m_sinkDropped.fetch_add(1, std::memory_order_relaxed);
+                        break;
+                    case FrameWrite::Failed:
+                        fprintf(stderr, "Capture sink failed; no longer capturing.\n");
+                        m_sinkFailed = true;
+                        break;
+                }
+                glUnmapBuffer(GL_PIXEL_PACK_BUFFER);
+            }
+            glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+        });
+    }
+
+    // Frames the sink kept, and frames dropped because the ring was full or by the sink, since the
+    // previous call.
+    void takeStats(uint64_t* captured, uint64_t* dropped)
+    {
+        *captured = m_captured.exchange(0, std::memory_order_relaxed);
+        *dropped = m_dropped + m_sinkDropped.exchange(0, std::memory_order_relaxed);
+        m_dropped = 0;
+    }
+
+private:
+    struct Slot
+    {
+        GLuint buffer = 0;
+        size_t size = 0;
+        std::shared_ptr<GLWorker::Job> job; // Consumes the buffer; null once it has.
+    };
+
+    GLWorker m_worker;
+    std::unique_ptr<FrameSink> m_sink;
+    std::vector<Slot> m_slots;
+    size_t m_nextSlot = 0;
+    const double m_interval;
+    const bool m_blockWhenFull;
+    double m_nextTime = 0;
+    uint64_t m_frameIndex = 0;
+    uint64_t m_dropped = 0;
+    std::atomic<uint64_t> m_captured{0};
+    std::atomic<uint64_t> m_sinkDropped{0};
+    std::atomic<bool> m_sinkFailed{false};
+};
@@ -0,0 +1,470 @@
+/*
+ * Copyright 2022 Rive
+ */
+
+#pragma once
+
+#include "bubble_storage.hpp"
+#include "cpu_raster.hpp"
+#include "frame_arena.hpp"
+#include "sim_clock.hpp"
+#include <atomic>
+#include <condition_variable>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <type_traits>
+#include <vector>
+
+// Bounded, lock-free, single-producer/single-consumer ring.
+template <typename T> class SPSCQueue
+{
+public:
+    explicit SPSCQueue(size_t capacity) : m_items(capacity + 1) {}
+
+    bool push(const T& item)
+    {
+        size_t tail = m_tail.load(std::memory_order_relaxed);
+        size_t next = (tail + 1) % m_items.size();
+        if (next == m_head.load(std::memory_order_acquire))
+        {
+            return false;
+        }
+        m_items[tail] = item;
+        m_tail.store(next, std::memory_order_release);
+        return true;
+    }
+
+    bool pop(T* item)
+    {
+        size_t head = m_head.load(std::memory_order_relaxed);
+        if (head == m_tail.load(std::memory_order_acquire))
+        {
+            return false;
+        }
+        *item = m_items[head];
+        m_head.store((head + 1) % m_items.size(), std::memory_order_release);
+        return true;
+    }
+
+    // Blocking variants. Return false if 'quit' gets set while waiting.
+    bool push(const T& item, const std::atomic<bool>& quit)
+    {
+        while (!push(item))
+        {
+            if (quit.load(std::memory_order_relaxed))
+            {
+                return false;
+            }
+            std::this_thread::yield();
+        }
+        return true;
+    }
+
+    bool pop(T* item, const std::atomic<bool>& quit)
+    {
+        while (!pop(item))
+        {
+            if (quit.load(std::memory_order_relaxed))
+            {
+                return false;
+            }
+            std::this_thread::yield();
+        }
+        return true;
+    }
+
+private:
+    std::vector<T> m_items;
+    alignas(64) std::atomic<size_t> m_head{0};
+    alignas(64) std::atomic<size_t> m_tail{0};
+};
+
+// Persistent threads that execute fork/join batches of tasks together with the calling thread.
+class WorkerPool
+{
+public:
+    explicit WorkerPool(int numThreads)
+    {
+        for (int i = 0; i < numThreads; ++i)
+        {
+            m_threads.emplace_back([this]() { threadMain(); });
+        }
+    }
+
+    ~WorkerPool()
+    {
+        {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            m_quit = true;
+        }
+        m_startCV.notify_all();
+        for (std::thread& thread : m_threads)
+        {
+            thread.join();
+        }
+    }
+
+    int numThreads() const { return static_cast<int>(m_threads.size()) + 1; }
+
+    // Runs fn(taskIdx, threadIdx) for every task in [0, numTasks), and returns once all are done.
+    // threadIdx is in [0, numThreads()). Does not allocate.
+    template <typename Fn> void run(int numTasks, Fn&& fn)
+    {
+        using FnType = std::remove_reference_t<Fn>;
+        {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            m_task = [](void* ctx, int taskIdx, int threadIdx) {
+                (*static_cast<FnType*>(ctx))(taskIdx, threadIdx);
+            };
+            m_taskContext = const_cast<void*>(static_cast<const void*>(&fn));
+            m_numTasks = numTasks;
+            m_nextTask.store(0, std::memory_order_relaxed);
+            m_busyThreads = static_cast<int>(m_threads.size());
+            ++m_generation;
+        }
+        m_startCV.notify_all();
+        work(static_cast<int>(m_threads.size()));
+        std::unique_lock<std::mutex> lock(m_mutex);
+        m_doneCV.wait(lock, [this]() { return m_busyThreads == 0; });
+    }
+
+private:
+    void threadMain()
+    {
+        int threadIdx;
+        uint64_t generation = 0;
+        {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            threadIdx = m_nextThreadIdx++;
+        }
+        for (;;)
+        {
+            {
+                std::unique_lock<std::mutex> lock(m_mutex);
+                m_startCV.wait(lock, [&]() { return m_quit || m_generation != generation; });
+                if (m_quit)
+                {
+                    return;
+                }
+                generation = m_generation;
+            }
+            work(threadIdx);
+            std::lock_guard<std::mutex> lock(m_mutex);
+            if (--m_busyThreads == 0)
+            {
+                m_doneCV.notify_one();
+            }
+        }
+    }
+
+    void work(int threadIdx)
+    {
+        for (int taskIdx; (taskIdx = m_nextTask.fetch_add(1)) < m_numTasks;)
+        {
+            m_task(m_taskContext, taskIdx, threadIdx);
+        }
+    }
+
+    std::vector<std::thread> m_threads;
+    std::mutex m_mutex;
+    std::condition_variable m_startCV, m_doneCV;
+    bool m_quit = false;
+    uint64_t m_generation = 0;
+    int m_nextThreadIdx = 0;
+    int m_busyThreads = 0;
+    void (*m_task)(void*, int, int) = nullptr;
+    void* m_taskContext = nullptr;
+    int m_numTasks = 0;
+    std::atomic<int> m_nextTask{0};
+};
+
+// One frame's worth of CPU render state, recycled around the pipeline. Variable-size data (the
+// bins) comes from the slot's arena, which resets when the slot is reused.
+struct FrameSlot
+{
+    double T;  // Simulation time, in steps.
+    int steps; // Fixed steps since the previous frame.
+    int width, height;
+    std::vector<float> cx, cy;
+    int numBands;
+    uint32_t* bandStart;
+    uint32_t* binned;
+    FrameArena arena;
+    std::vector<uint32_t> pixels;
+};
+
+// Three-stage CPU render pipeline:
+//
+//   simulate (own thread)  ->  rasterize (own thread + workers)  ->  present (GL thread)
+//
+// While frame N is being presented, N+1 rasterizes and N+2 simulates. Stages hand preallocated
+// FrameSlots to each other through SPSC queues; 'depth' slots circulate, so depth=1 is fully
+// serial and each additional slot trades a frame of latency for more overlap.
+//
+// The simulate stage owns 'clock' and advances it once per frame. By default it animates with
+// the closed-form motion from "vs", periodically rebasing the bubbles' positions (the only
+// fields no other stage reads) so the float motion math stays precise. A custom 'simulate'
+// function may instead fill in the slot's centers (cx, cy) itself, e.g. by taking slot.steps
+// fixed steps.
+template <typename Store> class CPUFramePipeline
+{
+public:
+    constexpr static int kBandHeight = 64;
+    using SimulateFn = std::function<void(FrameSlot&)>;
+
+    CPUFramePipeline(Store& bubbles,
+                     RasterKernel<Store> kernel,
+                     uint32_t clearColor,
+                     int depth,
+                     int numWorkers,
+                     SimClock clock,
+                     SimulateFn simulate = nullptr) :
+        m_bubbles(bubbles),
+        m_clock(clock),
+        m_simulate(std::move(simulate)),
+        m_kernel(kernel),
+        m_clearColor(clearColor),
+        m_slots(depth),
+        m_free(depth),
+        m_toRaster(depth),
+        m_toPresent(depth),
+        m_workers(numWorkers),
+        m_scratch(m_workers.numThreads())
+    {
+        for (FrameSlot& slot : m_slots)
+        {
+            slot.cx.resize(padded_size(bubbles));
+            slot.cy.resize(padded_size(bubbles));
+            m_free.push(&slot);
+        }
+    }
+
+    ~CPUFramePipeline()
+    {
+        m_quit = true;
+        if (m_simThread.joinable())
+        {
+            m_simThread.join();
+            m_rasterThread.join();
+        }
+    }
+
+    // Called by the GL thread; frames simulated after this call render at the new size. The
+    // first call starts the pipeline.
+    void setFramebufferSize(int width, int height)
+    {
+        m_framebufferSize.store(static_cast<uint64_t>(width) << 32 | static_cast<uint32_t>(height),
+                                std::memory_order_relaxed);
+        if (!m_simThread.joinable())
+        {
+            m_simThread = std::thread([this]() { simulateMain(); });
+            m_rasterThread = std::thread([this]() { rasterizeMain(); });
+        }
+    }
+
+    // Present stage: blocks until the oldest rasterized frame is ready.
+    FrameSlot* acquireFrame()
+    {
+        FrameSlot* slot = nullptr;
+        m_toPresent.pop(&slot, m_quit);
+        return slot;
+    }
+
+    // Returns a presented slot to the simulate stage.
+    void releaseFrame(FrameSlot* slot) { m_free.push(slot, m_quit); }
+
+private:
+    void simulateMain()
+    {
+        int64_t baseT = 0;
+        for (;;)
+        {
+            FrameSlot* slot;
+            if (!m_free.pop(&slot, m_quit))
+            {
+                return;
+            }
+            uint64_t size = m_framebufferSize.load(std::memory_order_relaxed);
+            slot->width = static_cast<int>(size >> 32);
+            slot->height = static_cast<int>(size & 0xffffffff);
+            slot->steps = m_clock.advance();
+            slot->T = m_clock.T();
+            float w = static_cast<float>(slot->width), h = static_cast<float>(slot->height);
+            if (m_simulate)
+            {
+                m_simulate(*slot);
+            }
+            else
+            {
+                int64_t newBaseT = m_clock.rebaseTime(baseT);
+                if (newBaseT != baseT)
+                {
+                    rebase_bubbles(m_bubbles, static_cast<double>(newBaseT - baseT), w, h);
+                    baseT = newBaseT;
+                }
+                animate_bubbles(m_bubbles,
+                                static_cast<float>(slot->T - baseT),
+                                w,
+                                h,
+                                slot->cx.data(),
+                                slot->cy.data());
+            }
+            slot->arena.reset();
+            slot->numBands = (slot->height + kBandHeight - 1) / kBandHeight;
+            slot->bandStart = slot->arena.alloc<uint32_t>(slot->numBands + 1);
+            slot->binned = bin_bubbles(m_bubbles,
+                                       slot->cy.data(),
+                                       kBandHeight,
+                                       slot->numBands,
+                                       slot->bandStart,
+                                       [slot](size_t count) {
+                                           return slot->arena.alloc<uint32_t>(count);
+                                       });
+            if (!m_toRaster.push(slot, m_quit))
+            {
+                return;
+            }
+        }
+    }
+
+    void rasterizeMain()
+    {
+        for (;;)
+        {
+            FrameSlot* slot;
+            if (!m_toRaster.pop(&slot, m_quit))
+            {
+                return;
+            }
+            slot->pixels.resize(static_cast<size_t>(slot->width) * slot->height);
+            RasterTarget target{slot->pixels.data(), slot->width, slot->height};
+            m_workers.run(slot->numBands, [&](int band, int threadIdx) {
+                int y0 = band * kBandHeight;
+                int y1 = std::min(y0 + kBandHeight, slot->height);
+                uint32_t first = slot->bandStart[band];
+                clear_rows(target, y0, y1, m_clearColor);
+                m_kernel(target,
+                         m_bubbles,
+                         slot->cx.data(),
+                         slot->cy.data(),
+                         slot->binned + first,
+                         slot->bandStart[band + 1] - first,
+                         y0,
+                         y1,
+                         m_scratch.thread(threadIdx));
+            });
+            m_scratch.reset();
+            if (!m_toPresent.push(slot, m_quit))
+            {
+                return;
+            }
+        }
+    }
+
+    Store& m_bubbles;
+    SimClock m_clock; // Only touched by the simulate stage.
+    const SimulateFn m_simulate;
+    const RasterKernel<Store> m_kernel;
+    const uint32_t m_clearColor;
+    std::vector<FrameSlot> m_slots;
+    SPSCQueue<FrameSlot*> m_free, m_toRaster, m_toPresent;
+    WorkerPool m_workers;
+    FrameArena m_scratch; // Per-worker sub-arenas for rasterization scratch.
+    std::atomic<uint64_t> m_framebufferSize{0};
+    std::atomic<bool> m_quit{false};
+    std::thread m_simThread, m_rasterThread;
+};
+
+// Per-frame instance data for the GPU renderer.
+struct InstanceSlot
+{
+    int width, height;
+    int steps; // Fixed steps since the previous frame.
+    std::vector<Bubble> instances;
+};
+
+// Two-stage pipeline for hybrid modes: a simulate thread writes every instance of frame N+1
+// into a slot while the GL thread uploads and draws frame N. Like CPUFramePipeline, 'depth'
+// preallocated slots circulate through SPSC queues, and the simulate thread owns 'clock'.
+class InstancePipeline
+{
+public:
+    using SimulateFn = std::function<void(InstanceSlot&)>;
+
+    InstancePipeline(size_t numInstances, int depth, SimClock clock, SimulateFn simulate) :
+        m_clock(clock),
+        m_simulate(std::move(simulate)),
+        m_slots(depth),
+        m_free(depth),
+        m_toPresent(depth)
+    {
+        for (InstanceSlot& slot : m_slots)
+        {
+            slot.instances.resize(numInstances);
+            m_free.push(&slot);
+        }
+    }
+
+    ~InstancePipeline()
+    {
+        m_quit = true;
+        if (m_simThread.joinable())
+        {
+            m_simThread.join();
+        }
+    }
+
+    // Called by the GL thread; frames simulated after this call use the new size. The first
+    // call starts the pipeline.
+    void setFramebufferSize(int width, int height)
+    {
+        m_framebufferSize.store(static_cast<uint64_t>(width) << 32 | static_cast<uint32_t>(height),
+                                std::memory_order_relaxed);
+        if (!m_simThread.joinable())
+        {
+            m_simThread = std::thread([this]() { simulateMain(); });
+        }
+    }
+
+    // Blocks until the oldest simulated frame is ready.
+    InstanceSlot* acquireFrame()
+    {
+        InstanceSlot* slot = nullptr;
+        m_toPresent.pop(&slot, m_quit);
+        return slot;
+    }
+
+    // Returns an uploaded slot to the simulate stage.
+    void releaseFrame(InstanceSlot* slot) { m_free.push(slot, m_quit); }
+
+private:
+    void simulateMain()
+    {
+        for (;;)
+        {
+            InstanceSlot* slot;
+            if (!m_free.pop(&slot, m_quit))
+            {
+                return;
+            }
+            uint64_t size = m_framebufferSize.load(std::memory_order_relaxed);
+            slot->width = static_cast<int>(size >> 32);
+            slot->height = static_cast<int>(size & 0xffffffff);
+            slot->steps = m_clock.advance();
+            m_simulate(*slot);
+            if (!m_toPresent.push(slot, m_quit))
+            {
+                return;
+            }
+        }
+    }
+
+    SimClock m_clock; // Only touched by the simulate thread.
+    const SimulateFn m_simulate;
+    std::vector<InstanceSlot> m_slots;
+    SPSCQueue<InstanceSlot*> m_free, m_toPresent;
+    std::atomic<uint64_t> m_framebufferSize{0};
+    std::atomic<bool> m_quit{false};
+    std::thread m_simThread;
+};
@@ -0,0 +1,221 @@
+/*
+ * Copyright 2022 Rive
+ */
+
+#pragma once
+
+#include "glad/glad.h"
+#include <cstdio>
+#include <cstring>
+#include <initializer_list>
+#include <sstream>
+#include <string>
+#include <utility>
+#include <vector>
+
+// GL_KHR_parallel_shader_compile, which glad wasn't generated with.
+#ifndef GL_COMPLETION_STATUS_KHR
+#define GL_COMPLETION_STATUS_KHR 0x91B1
+#endif
+typedef void(APIENTRYP PFNGLMAXSHADERCOMPILERTHREADSKHRPROC)(GLuint count);
+
+// Set by enable_parallel_shader_compile() when the driver compiles on its own threads and can be
+// polled for completion.
+inline bool g_parallelShaderCompile = false;
+
+static inline bool has_gl_extension(const char* name)
+{
+    GLint numExtensions = 0;
+    glGetIntegerv(GL_NUM_EXTENSIONS, &numExtensions);
+    for (GLint i = 0; i < numExtensions; ++i)
+    {
+        const char* extension =
+            reinterpret_cast<const char*>(glGetStringi(GL_EXTENSIONS, static_cast<GLuint>(i)));
+        if (extension && !strcmp(extension, name))
+        {
+            return true;
+        }
+    }
+    return false;
+}
+
+// Turns on GL_KHR_parallel_shader_compile for the current context, if it's available, and lets
+// the driver use as many compiler threads as it wants.
+static inline bool enable_parallel_shader_compile(GLADloadproc getProcAddress)
+{
+    if (!has_gl_extension("GL_KHR_parallel_shader_compile"))
+    {
+        return false;
+    }
+    auto maxShaderCompilerThreads = reinterpret_cast<PFNGLMAXSHADERCOMPILERTHREADSKHRPROC>(
+        getProcAddress("glMaxShaderCompilerThreadsKHR"));
+    if (maxShaderCompilerThreads)
+    {
+        maxShaderCompilerThreads(0xffffffff);
+    }
+    g_parallelShaderCompile = true;
+    return true;
+}
+
+static inline void print_shader_error(GLuint shader, const char* source)
+{
+    GLint maxLength = 0;
+    glGetShaderiv(shader, GL_INFO_LOG_LENGTH, &maxLength);
+    std::vector<GLchar> infoLog(maxLength + 1);
+    glGetShaderInfoLog(shader, maxLength, &maxLength, &infoLog[0]);
+    fprintf(stderr, "Failed to compile shader\n");
+    int l = 1;
+    std::stringstream stream(source);
+    std::string lineStr;
+    while (std::getline(stream, lineStr, '\n'))
+    {
+        fprintf(stderr, "%4i| %s\n", l++, lineStr.c_str());
+    }
+    fprintf(stderr, "%s\n", &infoLog[0]);
+    fflush(stderr);
+}
+
+static inline void print_link_error(GLuint program)
+{
+    GLint maxLength = 0;
+    glGetProgramiv(program, GL_INFO_LOG_LENGTH, &maxLength);
+    std::vector<GLchar> infoLog(maxLength + 1);
+    glGetProgramInfoLog(program, maxLength, &maxLength, &infoLog[0]);
+    fprintf(stderr, "Failed to link program %s\n", &infoLog[0]);
+    fflush(stderr);
+}
+
+static inline bool compile_and_attach_shader(GLuint program, GLuint type, const char* source)
+{
+    GLuint shader = glCreateShader(type);
+    glShaderSource(shader, 1, &source, nullptr);
+    glCompileShader(shader);
+    GLint isCompiled = 0;
+    glGetShaderiv(shader, GL_COMPILE_STATUS, &isCompiled);
+    if (isCompiled == GL_FALSE)
+    {
+        print_shader_error(shader, source);
+        glDeleteShader(shader);
+        return false;
+    }
+    glAttachShader(program, shader);
+    glDeleteShader(shader);
+    return true;
+}
+
+static inline bool link_program(GLuint program)
+{
+    glLinkProgram(program);
+    GLint isLinked = 0;
+    glGetProgramiv(program, GL_LINK_STATUS, &isLinked);
+    if (isLinked == GL_FALSE)
+    {
+        print_link_error(program);
+        return false;
+    }
+    return true;
+}
+
+// A program whose compiles and link have been issued but not checked. Querying a compile or link
+// status blocks until the driver is done, so a PendingProgram defers that to finish(). With
+// GL_KHR_parallel_shader_compile, the driver builds it on its own threads in the meantime and
+// isReady() says when finish() will no longer block.
+class PendingProgram
+{
+public:
+    PendingProgram() = default;
+
+    PendingProgram(std::initializer_list<std::pair<GLenum, std::string>> stages)
+    {
+        m_program = glCreateProgram();
+        for (const auto& [type, source] : stages)
+        {
+            GLuint shader = glCreateShader(type);
+            const char* str = source.c_str();
+            glShaderSource(shader, 1, &str, nullptr);
+            glCompileShader(shader);
+            glAttachShader(m_program, shader);
+            m_shaders.push_back({shader, source});
+        }
+        glLinkProgram(m_program);
+    }
+
+    PendingProgram(PendingProgram&& other) { *this = std::move(other); }
+
+    PendingProgram& operator=(PendingProgram&& other)
+    {
+        std::swap(m_program, other.m_program);
+        std::swap(m_shaders, other.m_shaders);
+        return *this;
+    }
+
+    ~PendingProgram()
+    {
+        for (const auto& shader : m_shaders)
+        {
+            glDeleteShader(shader.first);
+        }
+        glDeleteProgram(m_program);
+    }
+
+    bool isPending() const { return m_program != 0; }
+
+    bool isReady() const
+    {
+        if (!g_parallelShaderCompile || !m_program)
+        {
+            return true;
+        }
+        GLint complete = GL_FALSE;
+        glGetProgramiv(m_program, GL_COMPLETION_STATUS_KHR, &complete);
+        return complete == GL_TRUE;
+    }
+
+    // Returns the linked program, or 0 if it failed to build (after printing why). Blocks unless
+    // isReady(). Ownership of the program passes to the caller.
+    GLuint finish()
+    {
+        GLuint program = m_program;
+        if (!program)
+        {
+            return 0;
+        }
+        m_program = 0;
+        GLint isLinked = GL_FALSE;
+        glGetProgramiv(program, GL_LINK_STATUS, &isLinked);
+        bool failed = isLinked == GL_FALSE;
+        for (const auto& [shader, source] : m_shaders)
+        {
+            GLint isCompiled = GL_FALSE;
+            glGetShaderiv(shader, GL_COMPILE_STATUS, &isCompiled);
+            if (isCompiled == GL_FALSE)
+            {
+                print_shader_error(shader, source.c_str());
+                failed = true;
+            }
+            glDetachShader(program, shader);
+            glDeleteShader(shader);
+        }
+        m_shaders.clear();
+        if (failed)
+        {
+            if (isLinked == GL_FALSE)
+            {
+                print_link_error(program);
+            }
+            glDeleteProgram(program);
+            return 0;
+        }
+        return program;
+    }
+
+private:
+    GLuint m_program = 0;
+    std::vector<std::pair<GLuint, std::string>> m_shaders;
+};
+
+// Issues the compile and link of a compute program; see PendingProgram.
+static inline PendingProgram start_compute_program(std::string source)
+{
+    return PendingProgram({{GL_COMPUTE_SHADER, std::move(source)}});
+}
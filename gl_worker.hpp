@@ -0,0 +1,178 @@
+/*
+ * Copyright 2022 Rive
+ */
+
+#pragma once
+
+#include "glad/glad.h"
+#include "GLFW/glfw3.h"
+#include "gl_program.hpp"
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+
+// Background thread with its own GL context, shared with the render context, for work that would
+// otherwise hitch the render loop: shader compiles and large uploads. Each submitted Job ends
+// with a fence. The render thread polls Job::ready(), which never blocks; once it returns true,
+// the job's objects can be used from the render context.
+class GLWorker
+{
+public:
+    class Job
+    {
+    public:
+        ~Job()
+        {
+            if (m_fence)
+            {
+                glDeleteSync(m_fence);
+            }
+        }
+
+        // Render thread: returns whether the job has finished. The first time it has, makes the
+        // calling context's subsequent commands wait (on the GPU, not the CPU) for the job's
+        // commands to complete.
+        bool ready()
+        {
+            if (!m_done.load(std::memory_order_acquire))
+            {
+                return false;
+            }
+            if (m_fence)
+            {
+                glWaitSync(m_fence, 0, GL_TIMEOUT_IGNORED);
+                glDeleteSync(m_fence);
+                m_fence = nullptr;
+            }
+            return true;
+        }
+
+        // Blocks until ready(). Only for startup, or where the render loop means to wait.
+        void wait()
+        {
+            while (!ready())
+            {
+                std::this_thread::yield();
+            }
+        }
+
+    private:
+        friend class GLWorker;
+        std::function<void()> m_work;
+        GLsync m_fence = nullptr;
+        std::atomic<bool> m_done{false};
+    };
+
+    // Must be called on the thread that owns 'shareWith' (GLFW creates windows on the main
+    // thread). If the shared context can't be created, jobs run inline on submit().
+    explicit GLWorker(GLFWwindow* shareWith)
+    {
+        glfwWindowHint(GLFW_VISIBLE, GLFW_FALSE);
+        m_window = glfwCreateWindow(1, 1, "GL worker", nullptr, shareWith);
+        glfwWindowHint(GLFW_VISIBLE, GLFW_TRUE);
+        if (m_window)
+        {
+            m_thread = std::thread([this]() { workerMain(); });
+        }
+        else
+        {
+            fprintf(stderr, "Failed to create a shared context; GL jobs will run inline.\n");
+        }
+    }
+
+    ~GLWorker()
+    {
+        if (m_thread.joinable())
+        {
+            {
+                std::lock_guard<std::mutex> lock(m_mutex);
+                m_quit = true;
+            }
+            m_cv.notify_one();
+            m_thread.join();
+        }
+        if (m_window)
+        {
+            glfwDestroyWindow(m_window);
+        }
+    }
+
+    GLWorker(const GLWorker&) = delete;
+    GLWorker& operator=(const GLWorker&) = delete;
+
+    // Queues 'work' to run on the worker's context, in submission order.
+    std::shared_ptr<Job> submit(std::function<void()> work)
+    {
+        auto job = std::make_shared<Job>();
+        job->m_work = std::move(work);
+        if (!m_thread.joinable())
+        {
+            job->m_work();
+            job->m_done = true;
+            return job;
+        }
+        {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            m_jobs.push_back(job);
+        }
+        m_cv.notify_one();
+        return job;
+    }
+
+private:
+    void workerMain()
+    {
+        glfwMakeContextCurrent(m_window);
+        for (;;)
+        {
+            std::shared_ptr<Job> job;
+            {
+                std::unique_lock<std::mutex> lock(m_mutex);
+                m_cv.wait(lock, [this]() { return m_quit || !m_jobs.empty(); });
+                if (m_jobs.empty())
+                {
+                    break;
+                }
+                job = std::move(m_jobs.front());
+                m_jobs.pop_front();
+            }
+            job->m_work();
+            job->m_fence = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+            // Another context can only wait on a fence once it has been flushed.
+            glFlush();
+            job->m_done.store(true, std::memory_order_release);
+        }
+        glfwMakeContextCurrent(nullptr);
+    }
+
+    GLFWwindow* m_window = nullptr;
+    std::thread m_thread;
+    std::mutex m_mutex;
+    std::condition_variable m_cv;
+    std::deque<std::shared_ptr<Job>> m_jobs;
+    bool m_quit = false;
+};
+
+// Compiles and links a vertex/fragment program on 'worker'. Once the returned job is ready,
+// *program holds the program, or 0 if it failed to build. 'program' must outlive the job.
+static inline std::shared_ptr<GLWorker::Job> compile_program_async(GLWorker& worker,
+                                                                   const char* vsSource,
+                                                                   const char* fsSource,
+                                                                   GLuint* program)
+{
+    return worker.submit([=]() {
+        GLuint result = glCreateProgram();
+        if (!compile_and_attach_shader(result, GL_VERTEX_SHADER, vsSource) ||
+            !compile_and_attach_shader(result, GL_FRAGMENT_SHADER, fsSource) ||
+            !link_program(result))
+        {
+            glDeleteProgram(result);
+            result = 0;
+        }
+        *program = result;
+    });
+}
@@ -0,0 +1,189 @@
+/*
+ * Copyright 2022 Rive
+ */
+
+#pragma once
+
+#include <algorithm>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <vector>
+
+// How far a rendered image may stray from its golden before the test fails.
+struct GoldenTolerance
+{
+    int channel = 2; // Largest difference, in 8-bit steps, that any channel may have.
+    // How many pixels may exceed 'channel' anyway. Rasterizers disagree on a few edge pixels (up
+    // to 140 of the golden scene's 65536, between llvmpipe and softpipe), but a missing or
+    // misplaced bubble changes over 500.
+    uint64_t maxPixels = 256;
+};
+
+// Writes RGBA8 pixels, top row first, as a binary PAM ("P7", RGB_ALPHA), which most image tools
+// open and which needs no encoder.
+static inline bool write_pam(const std::string& path, const uint8_t* pixels, int width, int height)
+{
+    FILE* file = fopen(path.c_str(), "wb");
+    if (!file)
+    {
+        fprintf(stderr, "Failed to open %s for writing.\n", path.c_str());
+        return false;
+    }
+    fprintf(file,
+            "P7\nWIDTH %i\nHEIGHT %i\nDEPTH 4\nMAXVAL 255\nTUPLTYPE RGB_ALPHA\nENDHDR\n",
+            width,
+            height);
+    size_t bytes = static_cast<size_t>(width) * height * 4;
+    bool success = fwrite(pixels, 1, bytes, file) == bytes;
+    success = fclose(file) == 0 && success;
+    if (!success)
+    {
+        fprintf(stderr, "Failed to write %s.\n", path.c_str());
+    }
+    return success;
+}
+
+// Reads a PAM that write_pam() wrote. Returns false, without printing, if it can't.
+static inline bool read_pam(const std::string& path,
+                            std::vector<uint8_t>* pixels,
+                            int* width,
+                            int* height)
+{
+    FILE* file = fopen(path.c_str(), "rb");
+    if (!file)
+    {
+        return false;
+    }
+    *width = *height = 0;
+    int depth = 0, maxval = 0;
+    bool valid = false;
+    char line[128];
+    if (fgets(line, sizeof(line), file) && !strcmp(line, "P7\n"))
+    {
+        while (fgets(line, sizeof(line), file))
+        {
+            if (!strcmp(line, "ENDHDR\n"))
+            {
+                valid = *width > 0 && *height > 0 && depth == 4 && maxval == 255;
+                break;
+            }
+            sscanf(line, "WIDTH %i", width);
+            sscanf(line, "HEIGHT %i", height);
+            sscanf(line, "DEPTH %i", &depth);
+            sscanf(line, "MAXVAL %i", &maxval);
+        }
+    }
+    if (valid)
+    {
+        pixels->resize(static_cast<size_t>(*width) * *height * 4);
+        valid = fread(pixels->data(), 1, pixels->size(), file) == pixels->size();
+    }
+    fclose(file);
+    return valid;
+}
+
+struct ImageDiff
+{
+    uint64_t differingPixels = 0; // Pixels with any channel beyond the tolerance.
+    int maxDelta = 0;             // Largest difference in any channel of any pixel.
+};
+
+// Compares two RGBA8 images of the same size. If 'diffImage' isn't null, it gets an image of
+// where they differ: opaque red wherever a pixel is beyond the tolerance, and the expected image,
+// dimmed and in gray, everywhere else.
+static inline ImageDiff diff_images(const uint8_t* actual,
+                                    const uint8_t* expected,
+                                    int width,
+                                    int height,
+                                    int channelTolerance,
+                                    std::vector<uint8_t>* diffImage)
+{
+    ImageDiff diff;
+    size_t numPixels = static_cast<size_t>(width) * height;
+    if (diffImage)
+    {
+        diffImage->resize(numPixels * 4);
+    }
+    for (size_t i = 0; i < numPixels; ++i)
+    {
+        const uint8_t* a = actual + i * 4;
+        const uint8_t* e = expected + i * 4;
+        int delta = 0;
+        for (int c = 0; c < 4; ++c)
+        {
+            delta = std::max(delta, abs(a[c] - e[c]));
+        }
+        diff.maxDelta = std::max(diff.maxDelta, delta);
+        bool differs = delta > channelTolerance;
+        diff.differingPixels += differs;
+        if (diffImage)
+        {
+            uint8_t* d = diffImage->data() + i * 4;
+            uint8_t gray = static_cast<uint8_t>((e[0] * 77 + e[1] * 150 + e[2] * 29) >> 10);
+            d[0] = differs ? 255 : gray;
+            d[1] = differs ? 0 : gray;
+            d[2] = differs ? 0 : gray;
+            d[3] = 255;
+        }
+    }
+    return diff;
+}
+
+// Checks one rendered image, RGBA8 top row first, against '<dir>/<name>.pam'. With 'update', the
+// golden is (re)written instead. On a mismatch, '<name>.actual.pam' and '<name>.diff.pam' are
+// written next to the golden. Prints a line of results, and returns whether the image passed.
+static inline bool check_golden(const std::string& dir,
+                                const std::string& name,
+                                const uint8_t* pixels,
+                                int width,
+                                int height,
+                                const GoldenTolerance& tolerance,
+                                bool update)
+{
+    std::string base = dir + "/" + name;
+    if (update)
+    {
+        if (!write_pam(base + ".pam", pixels, width, height))
+        {
+            return false;
+        }
+        printf("updated %s.pam\n", base.c_str());
+        return true;
+    }
+    std::vector<uint8_t> golden;
+    int goldenWidth, goldenHeight;
+    if (!read_pam(base + ".pam", &golden, &goldenWidth, &goldenHeight))
+    {
+        printf("FAIL %s: no golden (run with --golden-update to create it)\n", name.c_str());
+        return false;
+    }
+    if (goldenWidth != width || goldenHeight != height)
+    {
+        printf("FAIL %s: golden is %i x %i, rendered %i x %i\n",
+               name.c_str(),
+               goldenWidth,
+               goldenHeight,
+               width,
+               height);
+        return false;
+    }
+    std::vector<uint8_t> diffImage;
+    ImageDiff diff =
+        diff_images(pixels, golden.data(), width, height, tolerance.channel, &diffImage);
+    bool passed = diff.differingPixels <= tolerance.maxPixels;
+    printf("%s %s: %llu pixels differ by more than %i (max difference %i)\n",
+           passed ? "PASS" : "FAIL",
+           name.c_str(),
+           static_cast<unsigned long long>(diff.differingPixels),
+           tolerance.channel,
+           diff.maxDelta);
+    if (!passed)
+    {
+        write_pam(base + ".actual.pam", pixels, width, height);
+        write_pam(base + ".diff.pam", diffImage.data(), width, height);
+    }
+    return passed;
+}
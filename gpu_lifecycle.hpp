@@ -0,0 +1,307 @@
+/*
+ * Copyright 2022 Rive
+ */
+
+#pragma once
+
+#include "gl_program.hpp"
+#include "gpu_scan.hpp"
+#include "lifecycle.hpp"
+#include <array>
+#include <string>
+#include <utility>
+#include <vector>
+
+// Declarations shared by the lifecycle compute shaders. LiveBubble has the same std430 layout as
+// the C++ struct. lifecycle_update() mirrors update_live_bubble().
+constexpr static char lifecycle_common_cs[] = R"(#version 310 es
+layout(local_size_x=256) in;
+struct Bubble {
+    float x, y, r, dx, dy;
+    float red, green, blue, alpha;
+};
+struct LiveBubble {
+    Bubble bubble;
+    float age, lifetime;
+    float maxR, maxAlpha;
+};
+uniform uint capacity;
+uniform uint spawnCount;
+uniform float dt;
+uniform vec2 window;
+bool lifecycle_update(inout LiveBubble b) {
+    b.age += dt;
+    float t = b.age / b.lifetime;
+    float grow = clamp(t / .15, 0.0, 1.0);
+    grow = grow * grow * (3.0 - 2.0 * grow);
+    float pop = clamp((t - (1.0 - .08)) / .08, 0.0, 1.0);
+    float r = b.maxR * grow * (1.0 + .3 * pop);
+    b.bubble.r = r;
+    b.bubble.alpha = b.maxAlpha * (1.0 - pop);
+    vec2 p = vec2(b.bubble.x, b.bubble.y) + vec2(b.bubble.dx, b.bubble.dy) * dt;
+    vec2 v = vec2(b.bubble.dx, b.bubble.dy);
+    v = mix(v, abs(v), lessThan(p, vec2(r)));
+    v = mix(v, -abs(v), greaterThan(p, window - r));
+    p = clamp(p, vec2(r), window - r);
+    b.bubble.x = p.x;
+    b.bubble.y = p.y;
+    b.bubble.dx = v.x;
+    b.bubble.dy = v.y;
+    return b.age < b.lifetime;
+}
+)";
+
+// Ages the live bubbles in place and writes their alive flags. Flags past the live count, up to
+// and including flags[capacity], are zeroed so the scan's last element is the survivor count.
+constexpr static char lifecycle_update_cs[] = R"(
+layout(std430, binding=0) buffer Src { LiveBubble src[]; };
+layout(std430, binding=2) writeonly buffer Flags { uint flags[]; };
+layout(std430, binding=3) readonly buffer Counts { uint liveCount; uint survivorCount; };
+void main() {
+    uint i = gl_GlobalInvocationID.x;
+    if (i > capacity) {
+        return;
+    }
+    bool alive = false;
+    if (i < liveCount) {
+        LiveBubble b = src[i];
+        alive = lifecycle_update(b);
+        src[i] = b;
+    }
+    flags[i] = alive ? 1u : 0u;
+})";
+
+// After the scan, flags[i] is survivor i's index in the compacted buffer.
+constexpr static char lifecycle_compact_cs[] = R"(
+layout(std430, binding=0) readonly buffer Src { LiveBubble src[]; };
+layout(std430, binding=1) writeonly buffer Dst { LiveBubble dst[]; };
+layout(std430, binding=2) readonly buffer Flags { uint flags[]; };
+void main() {
+    uint i = gl_GlobalInvocationID.x;
+    if (i < capacity && flags[i + 1u] != flags[i]) {
+        dst[flags[i]] = src[i];
+    }
+})";
+
+// Publishes the new counts and the indirect draw. One invocation.
+constexpr static char lifecycle_finalize_cs[] = R"(
+layout(std430, binding=1) writeonly buffer Draw { uint drawCommand[4]; };
+layout(std430, binding=2) readonly buffer Flags { uint flags[]; };
+layout(std430, binding=3) writeonly buffer Counts { uint liveCount; uint survivorCount; };
+void main() {
+    uint survivors = flags[capacity];
+    uint count = min(survivors + spawnCount, capacity);
+    liveCount = count;
+    survivorCount = survivors;
+    drawCommand[0] = 4u;
+    drawCommand[1] = count;
+    drawCommand[2] = 0u;
+    drawCommand[3] = 0u;
+})";
+
+constexpr static char lifecycle_spawn_cs[] = R"(
+layout(std430, binding=0) readonly buffer Spawns { LiveBubble spawns[]; };
+layout(std430, binding=1) writeonly buffer Dst { LiveBubble dst[]; };
+layout(std430, binding=3) readonly buffer Counts { uint liveCount; uint survivorCount; };
+void main() {
+    uint j = gl_GlobalInvocationID.x;
+    if (j < spawnCount && survivorCount + j < liveCount) {
+        dst[survivorCount + j] = spawns[j];
+    }
+})";
+
+// Bubble lifecycle on the GPU, with the same behavior as CPULifecycle. The live bubbles are
+// ping-ponged between two fixed-capacity buffers: each step ages them in place, scans the alive
+// flags with GPUScan, scatters the survivors in order into the other buffer, and appends the
+// step's spawns (generated on the CPU). The live count never leaves the GPU; it is written into
+// a DrawArraysIndirect command.
+class GPULifecycle
+{
+public:
+    ~GPULifecycle()
+    {
+        glDeleteBuffers(2, m_state);
+        for (GLuint buffer : {m_flags, m_counts, m_drawCommand, m_spawns})
+        {
+            glDeleteBuffers(1, &buffer);
+        }
+        for (GLuint program : programs())
+        {
+            glDeleteProgram(program);
+        }
+    }
+
+    // Issues the shader compiles; see PendingProgram.
+    void init()
+    {
+        const char* sources[kNumPrograms] = {lifecycle_update_cs,
+                                             lifecycle_compact_cs,
+                                             lifecycle_finalize_cs,
+                                             lifecycle_spawn_cs};
+        for (int i = 0; i < kNumPrograms; ++i)
+        {
+            m_pending[i] = start_compute_program(std::string(lifecycle_common_cs) + sources[i]);
+        }
+        m_scan.init();
+        glGenBuffers(2, m_state);
+        for (GLuint* buffer : {&m_flags, &m_counts, &m_drawCommand, &m_spawns})
+        {
+            glGenBuffers(1, buffer);
+        }
+    }
+
+    bool isReady() const
+    {
+        for (const PendingProgram& pending : m_pending)
+        {
+            if (!pending.isReady())
+            {
+                return false;
+            }
+        }
+        return m_scan.isReady();
+    }
+
+    // Waits for the programs issued by init(). Returns false if any failed to build.
+    bool finishInit()
+    {
+        GLuint* programs[kNumPrograms] = {&m_updateProgram,
+                                          &m_compactProgram,
+                                          &m_finalizeProgram,
+                                          &m_spawnProgram};
+        bool success = m_scan.finishInit();
+        for (int i = 0; i < kNumPrograms; ++i)
+        {
+            *programs[i] = m_pending[i].finish();
+            success = success && *programs[i];
+        }
+        return success;
+    }
+
+    // Allocates every buffer up front; nothing is reallocated while stepping.
+    void reset(uint32_t capacity,
+               LifecycleSpawner& spawner,
+               uint32_t initialCount,
+               float w,
+               float h)
+    {
+        m_capacity = capacity;
+        m_current = 0;
+        // Generous: the spawn rate is a small fraction of the population per step.
+        m_maxSpawns = std::max(capacity / 16, 64u);
+        m_spawnStaging.resize(m_maxSpawns);
+        std::vector<LiveBubble> initial(capacity);
+        uint32_t count = std::min(initialCount, capacity);
+        spawner.prewarm(w, h, initial.data(), count);
+        for (GLuint buffer : m_state)
+        {
+            glBindBuffer(GL_SHADER_STORAGE_BUFFER, buffer);
+            glBufferData(GL_SHADER_STORAGE_BUFFER,
+                         capacity * sizeof(LiveBubble),
+                         initial.data(),
+                         GL_DYNAMIC_COPY);
+        }
+        glBindBuffer(GL_SHADER_STORAGE_BUFFER, m_flags);
+        glBufferData(GL_SHADER_STORAGE_BUFFER,
+                     (capacity + 1) * sizeof(uint32_t),
+                     nullptr,
+                     GL_DYNAMIC_COPY);
+        uint32_t counts[2] = {count, count};
+        glBindBuffer(GL_SHADER_STORAGE_BUFFER, m_counts);
+        glBufferData(GL_SHADER_STORAGE_BUFFER, sizeof(counts), counts, GL_DYNAMIC_COPY);
+        uint32_t drawCommand[4] = {4, count, 0, 0};
+        glBindBuffer(GL_SHADER_STORAGE_BUFFER, m_drawCommand);
+        glBufferData(GL_SHADER_STORAGE_BUFFER, sizeof(drawCommand), drawCommand, GL_DYNAMIC_COPY);
+        glBindBuffer(GL_SHADER_STORAGE_BUFFER, m_spawns);
+        glBufferData(GL_SHADER_STORAGE_BUFFER,
+                     m_maxSpawns * sizeof(LiveBubble),
+                     nullptr,
+                     GL_DYNAMIC_DRAW);
+        m_scan.reserve(capacity + 1);
+    }
+
+    // The live bubbles after the most recent step, drawn with the indirect command in
+    // drawCommandBuffer().
+    GLuint instanceBuffer() const { return m_state[m_current]; }
+    GLuint drawCommandBuffer() const { return m_drawCommand; }
+
+    // Advances every bubble by 'dt' steps. Changes the current program. Ends with the barriers
+    // for drawing.
+    void step(float dt, float w, float h, LifecycleSpawner& spawner)
+    {
+        uint32_t spawnCount =
+            static_cast<uint32_t>(spawner.spawn(dt, w, h, m_spawnStaging.data(), m_maxSpawns));
+        if (spawnCount)
+        {
+            glBindBuffer(GL_SHADER_STORAGE_BUFFER, m_spawns);
+            glBufferSubData(GL_SHADER_STORAGE_BUFFER,
+                            0,
+                            spawnCount * sizeof(LiveBubble),
+                            m_spawnStaging.data());
+        }
+        for (GLuint program : programs())
+        {
+            glProgramUniform1ui(program, glGetUniformLocation(program, "capacity"), m_capacity);
+            glProgramUniform1ui(program, glGetUniformLocation(program, "spawnCount"), spawnCount);
+            glProgramUniform1f(program, glGetUniformLocation(program, "dt"), dt);
+            glProgramUniform2f(program, glGetUniformLocation(program, "window"), w, h);
+        }
+        GLuint src = m_state[m_current], dst = m_state[m_current ^ 1];
+
+        glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 0, src);
+        glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 2, m_flags);
+        glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 3, m_counts);
+        glUseProgram(m_updateProgram);
+        glDispatchCompute((m_capacity + 1 + 255) / 256, 1, 1);
+        glMemoryBarrier(GL_SHADER_STORAGE_BARRIER_BIT);
+
+        m_scan.exclusiveScan(m_flags, m_capacity + 1);
+        glMemoryBarrier(GL_SHADER_STORAGE_BARRIER_BIT);
+
+        // The scan rebinds slots 0 and 1.
+        glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 0, src);
+        glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 1, dst);
+        glUseProgram(m_compactProgram);
+        glDispatchCompute((m_capacity + 255) / 256, 1, 1);
+
+        glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 1, m_drawCommand);
+        glUseProgram(m_finalizeProgram);
+        glDispatchCompute(1, 1, 1);
+        glMemoryBarrier(GL_SHADER_STORAGE_BARRIER_BIT);
+
+        if (spawnCount)
+        {
+            glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 0, m_spawns);
+            glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 1, dst);
+            glUseProgram(m_spawnProgram);
+            glDispatchCompute((spawnCount + 255) / 256, 1, 1);
+        }
+        glMemoryBarrier(GL_SHADER_STORAGE_BARRIER_BIT | GL_VERTEX_ATTRIB_ARRAY_BARRIER_BIT |
+                        GL_COMMAND_BARRIER_BIT);
+        m_current ^= 1;
+    }
+
+private:
+    constexpr static int kNumPrograms = 4;
+
+    std::array<GLuint, kNumPrograms> programs() const
+    {
+        return {m_updateProgram, m_compactProgram, m_finalizeProgram, m_spawnProgram};
+    }
+
+    PendingProgram m_pending[kNumPrograms];
+    GLuint m_updateProgram = 0;
+    GLuint m_compactProgram = 0;
+    GLuint m_finalizeProgram = 0;
+    GLuint m_spawnProgram = 0;
+    GPUScan m_scan;
+    GLuint m_state[2] = {0, 0};
+    int m_current = 0;
+    GLuint m_flags = 0;
+    GLuint m_counts = 0;      // {live count, survivor count}
+    GLuint m_drawCommand = 0; // DrawArraysIndirectCommand
+    GLuint m_spawns = 0;
+    std::vector<LiveBubble> m_spawnStaging;
+    uint32_t m_capacity = 0;
+    uint32_t m_maxSpawns = 0;
+};
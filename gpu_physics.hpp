@@ -0,0 +1,298 @@
+/*
+ * Copyright 2022 Rive
+ */
+
+#pragma once
+
+#include "bubble_storage.hpp"
+#include "gl_program.hpp"
+#include "gpu_scan.hpp"
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+// Declarations shared by the physics compute shaders. The Bubble struct has the same std430
+// layout as the C++ Bubble, so the state buffers double as instance buffers for "vs".
+constexpr static char physics_common_cs[] = R"(#version 310 es
+layout(local_size_x=256) in;
+struct Bubble {
+    float x, y, r, dx, dy;
+    float red, green, blue, alpha;
+};
+uniform uint count;
+uniform vec2 window;
+uniform ivec2 gridSize;
+uniform float invCellSize;
+uniform float dt;
+ivec2 cell_coord(vec2 p) {
+    return clamp(ivec2(p * invCellSize), ivec2(0), gridSize - 1);
+}
+)";
+
+constexpr static char physics_clear_cs[] = R"(
+layout(std430, binding=2) writeonly buffer CellStart { uint cellStart[]; };
+void main() {
+    if (gl_GlobalInvocationID.x < count) {
+        cellStart[gl_GlobalInvocationID.x] = 0u;
+    }
+})";
+
+// Counts bubbles per cell. The atomic's return value is the bubble's rank within its cell,
+// which the scatter uses as its offset from the cell start.
+constexpr static char physics_count_cs[] = R"(
+layout(std430, binding=0) readonly buffer Src { Bubble src[]; };
+layout(std430, binding=2) buffer CellStart { uint cellStart[]; };
+layout(std430, binding=3) writeonly buffer Slots { uvec2 slots[]; };
+void main() {
+    uint i = gl_GlobalInvocationID.x;
+    if (i >= count) {
+        return;
+    }
+    ivec2 g = cell_coord(vec2(src[i].x, src[i].y));
+    uint cell = uint(g.y * gridSize.x + g.x);
+    slots[i] = uvec2(cell, atomicAdd(cellStart[cell], 1u));
+})";
+
+constexpr static char physics_scatter_cs[] = R"(
+layout(std430, binding=0) readonly buffer Src { Bubble src[]; };
+layout(std430, binding=1) writeonly buffer Dst { Bubble dst[]; };
+layout(std430, binding=2) readonly buffer CellStart { uint cellStart[]; };
+layout(std430, binding=3) readonly buffer Slots { uvec2 slots[]; };
+void main() {
+    uint i = gl_GlobalInvocationID.x;
+    if (i >= count) {
+        return;
+    }
+    uvec2 slot = slots[i];
+    dst[cellStart[slot.x] + slot.y] = src[i];
+})";
+
+// Same contact model as BubblePhysics: elastic impulses gathered Jacobi style, plus a
+// half-strength positional push, then integration and wall bounces.
+constexpr static char physics_collide_cs[] = R"(
+layout(std430, binding=0) readonly buffer Src { Bubble src[]; };
+layout(std430, binding=1) writeonly buffer Dst { Bubble dst[]; };
+layout(std430, binding=2) readonly buffer CellStart { uint cellStart[]; };
+float inv_mass(float r) { return r > 0.0 ? 1.0 / (r * r) : 0.0; }
+void main() {
+    uint k = gl_GlobalInvocationID.x;
+    if (k >= count) {
+        return;
+    }
+    Bubble b = src[k];
+    vec2 p = vec2(b.x, b.y);
+    vec2 v = vec2(b.dx, b.dy);
+    float imi = inv_mass(b.r);
+    vec2 dv = vec2(0);
+    vec2 dp = vec2(0);
+    ivec2 g = cell_coord(p);
+    int gx0 = max(g.x - 1, 0);
+    int gx1 = min(g.x + 1, gridSize.x - 1);
+    for (int row = max(g.y - 1, 0); row <= min(g.y + 1, gridSize.y - 1); ++row) {
+        uint runEnd = cellStart[row * gridSize.x + gx1 + 1];
+        for (uint j = cellStart[row * gridSize.x + gx0]; j < runEnd; ++j) {
+            Bubble o = src[j];
+            vec2 n = p - vec2(o.x, o.y);
+            float rr = b.r + o.r;
+            float d2 = dot(n, n);
+            if (j == k || d2 >= rr * rr) {
+                continue;
+            }
+            float d = sqrt(d2);
+            n = d > 1e-6 ? n / d : vec2(k < j ? -1.0 : 1.0, 0.0);
+            float sumInvMass = imi + inv_mass(o.r);
+            if (sumInvMass <= 0.0) {
+                continue;
+            }
+            float approach = dot(v - vec2(o.dx, o.dy), n);
+            if (approach < 0.0) {
+                dv += (-2.0 * approach / sumInvMass * imi) * n;
+            }
+            dp += ((rr - d) * (imi / sumInvMass) * .5) * n;
+        }
+    }
+    v += dv;
+    p += v * dt + dp;
+    vec2 lo = vec2(b.r);
+    vec2 hi = window - b.r;
+    v = mix(v, abs(v), lessThan(p, lo));
+    v = mix(v, -abs(v), greaterThan(p, hi));
+    p = clamp(p, lo, hi);
+    dst[k] = Bubble(p.x, p.y, b.r, v.x, v.y, b.red, b.green, b.blue, b.alpha);
+})";
+
+// Bubble simulation on the GPU, with the same collision model as BubblePhysics. State lives in
+// two SSBOs of Bubbles: each step counting-sorts the state into the second buffer by grid cell,
+// then resolves collisions from there and writes the integrated result back into the first.
+// Nothing comes back to the CPU; the first buffer is drawn directly as the instance buffer
+// (with speed = 0, since the instances hold velocities, not closed-form motion).
+class GPUPhysics
+{
+public:
+    // Caps the grid so its cell starts stay a modest buffer for tiny bubbles.
+    constexpr static uint32_t kMaxCells = 1 << 20;
+
+    ~GPUPhysics()
+    {
+        glDeleteBuffers(2, m_state);
+        glDeleteBuffers(1, &m_cellStart);
+        glDeleteBuffers(1, &m_slots);
+        for (GLuint program : {m_clearProgram, m_countProgram, m_scatterProgram, m_collideProgram})
+        {
+            glDeleteProgram(program);
+        }
+    }
+
+    // Issues the shader compiles; see PendingProgram.
+    void init()
+    {
+        const char* sources[kNumPrograms] = {physics_clear_cs,
+                                             physics_count_cs,
+                                             physics_scatter_cs,
+                                             physics_collide_cs};
+        for (int i = 0; i < kNumPrograms; ++i)
+        {
+            m_pending[i] = start_compute_program(std::string(physics_common_cs) + sources[i]);
+        }
+        m_scan.init();
+        glGenBuffers(2, m_state);
+        glGenBuffers(1, &m_cellStart);
+        glGenBuffers(1, &m_slots);
+    }
+
+    bool isReady() const
+    {
+        for (const PendingProgram& pending : m_pending)
+        {
+            if (!pending.isReady())
+            {
+                return false;
+            }
+        }
+        return m_scan.isReady();
+    }
+
+    // Waits for the programs issued by init(). Returns false if any failed to build.
+    bool finishInit()
+    {
+        GLuint* programs[kNumPrograms] = {&m_clearProgram,
+                                          &m_countProgram,
+                                          &m_scatterProgram,
+                                          &m_collideProgram};
+        bool success = m_scan.finishInit();
+        for (int i = 0; i < kNumPrograms; ++i)
+        {
+            *programs[i] = m_pending[i].finish();
+            success = success && *programs[i];
+        }
+        return success;
+    }
+
+    template <typename Store> void reset(const Store& bubbles)
+    {
+        m_count = static_cast<uint32_t>(bubbles.size());
+        std::vector<Bubble> instances(m_count);
+        bubbles.exportInterleaved(instances.data(), 0, m_count);
+        m_maxR = 0;
+        for (const Bubble& bubble : instances)
+        {
+            m_maxR = std::max(m_maxR, bubble.r);
+        }
+        glBindBuffer(GL_SHADER_STORAGE_BUFFER, m_state[0]);
+        glBufferData(GL_SHADER_STORAGE_BUFFER,
+                     m_count * sizeof(Bubble),
+                     instances.data(),
+                     GL_DYNAMIC_COPY);
+        glBindBuffer(GL_SHADER_STORAGE_BUFFER, m_state[1]);
+        glBufferData(GL_SHADER_STORAGE_BUFFER, m_count * sizeof(Bubble), nullptr, GL_DYNAMIC_COPY);
+        glBindBuffer(GL_SHADER_STORAGE_BUFFER, m_slots);
+        glBufferData(GL_SHADER_STORAGE_BUFFER,
+                     m_count * 2 * sizeof(uint32_t),
+                     nullptr,
+                     GL_DYNAMIC_COPY);
+        m_cellCapacity = 0;
+    }
+
+    uint32_t size() const { return m_count; }
+
+    // The Bubbles after the most recent step, in grid order.
+    GLuint instanceBuffer() const { return m_state[0]; }
+
+    // Advances the simulation by 'dt' frames inside a w x h box. Changes the current program.
+    // Ends with the barrier for drawing from instanceBuffer().
+    void step(float dt, float w, float h)
+    {
+        float cellSize = std::max({2 * m_maxR, 1.f, sqrtf(w * h / kMaxCells)});
+        int gridW = std::max(static_cast<int>(ceilf(w / cellSize)), 1);
+        int gridH = std::max(static_cast<int>(ceilf(h / cellSize)), 1);
+        // One extra cell start, left at zero by the clear, receives the total from the scan.
+        uint32_t numCellStarts = static_cast<uint32_t>(gridW * gridH) + 1;
+        if (numCellStarts > m_cellCapacity)
+        {
+            glBindBuffer(GL_SHADER_STORAGE_BUFFER, m_cellStart);
+            glBufferData(GL_SHADER_STORAGE_BUFFER,
+                         numCellStarts * sizeof(uint32_t),
+                         nullptr,
+                         GL_DYNAMIC_COPY);
+            m_cellCapacity = numCellStarts;
+        }
+        for (GLuint program : {m_clearProgram, m_countProgram, m_scatterProgram, m_collideProgram})
+        {
+            glProgramUniform1ui(program,
+                                glGetUniformLocation(program, "count"),
+                                program == m_clearProgram ? numCellStarts : m_count);
+            glProgramUniform2f(program, glGetUniformLocation(program, "window"), w, h);
+            glProgramUniform2i(program, glGetUniformLocation(program, "gridSize"), gridW, gridH);
+            glProgramUniform1f(program, glGetUniformLocation(program, "invCellSize"), 1 / cellSize);
+            glProgramUniform1f(program, glGetUniformLocation(program, "dt"), dt);
+        }
+        GLuint bubbleGroups = (m_count + 255) / 256;
+
+        glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 2, m_cellStart);
+        glUseProgram(m_clearProgram);
+        glDispatchCompute((numCellStarts + 255) / 256, 1, 1);
+        glMemoryBarrier(GL_SHADER_STORAGE_BARRIER_BIT);
+
+        glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 0, m_state[0]);
+        glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 3, m_slots);
+        glUseProgram(m_countProgram);
+        glDispatchCompute(bubbleGroups, 1, 1);
+        glMemoryBarrier(GL_SHADER_STORAGE_BARRIER_BIT);
+
+        m_scan.exclusiveScan(m_cellStart, numCellStarts);
+        glMemoryBarrier(GL_SHADER_STORAGE_BARRIER_BIT);
+
+        // The scan rebinds slots 0 and 1.
+        glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 0, m_state[0]);
+        glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 1, m_state[1]);
+        glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 2, m_cellStart);
+        glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 3, m_slots);
+        glUseProgram(m_scatterProgram);
+        glDispatchCompute(bubbleGroups, 1, 1);
+        glMemoryBarrier(GL_SHADER_STORAGE_BARRIER_BIT);
+
+        glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 0, m_state[1]);
+        glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 1, m_state[0]);
+        glUseProgram(m_collideProgram);
+        glDispatchCompute(bubbleGroups, 1, 1);
+        glMemoryBarrier(GL_VERTEX_ATTRIB_ARRAY_BARRIER_BIT | GL_SHADER_STORAGE_BARRIER_BIT);
+    }
+
+private:
+    constexpr static int kNumPrograms = 4;
+
+    PendingProgram m_pending[kNumPrograms];
+    GLuint m_clearProgram = 0;
+    GLuint m_countProgram = 0;
+    GLuint m_scatterProgram = 0;
+    GLuint m_collideProgram = 0;
+    GPUScan m_scan;
+    GLuint m_state[2] = {0, 0};
+    GLuint m_cellStart = 0;
+    GLuint m_slots = 0;
+    uint32_t m_cellCapacity = 0;
+    uint32_t m_count = 0;
+    float m_maxR = 0;
+};
@@ -0,0 +1,164 @@
+/*
+ * Copyright 2022 Rive
+ */
+
+#pragma once
+
+#include "gl_program.hpp"
+#include <cstdint>
+#include <vector>
+
+constexpr static char scan_blocks_cs[] = R"(#version 310 es
+layout(local_size_x=256) in;
+layout(std430, binding=0) buffer Data { uint data[]; };
+layout(std430, binding=1) writeonly buffer Sums { uint sums[]; };
+uniform uint count;
+shared uint partial[256];
+void main() {
+    uint t = gl_LocalInvocationID.x;
+    uint base = gl_GlobalInvocationID.x * 4u;
+    uint v[4];
+    uint sum = 0u;
+    for (uint k = 0u; k < 4u; ++k) {
+        v[k] = base + k < count ? data[base + k] : 0u;
+        sum += v[k];
+    }
+    partial[t] = sum;
+    memoryBarrierShared();
+    barrier();
+    for (uint offset = 1u; offset < 256u; offset <<= 1) {
+        uint add = t >= offset ? partial[t - offset] : 0u;
+        memoryBarrierShared();
+        barrier();
+        partial[t] += add;
+        memoryBarrierShared();
+        barrier();
+    }
+    if (t == 255u) {
+        sums[gl_WorkGroupID.x] = partial[t];
+    }
+    uint run = partial[t] - sum;
+    for (uint k = 0u; k < 4u; ++k) {
+        if (base + k < count) {
+            data[base + k] = run;
+        }
+        run += v[k];
+    }
+})";
+
+constexpr static char add_block_offsets_cs[] = R"(#version 310 es
+layout(local_size_x=256) in;
+layout(std430, binding=0) buffer Data { uint data[]; };
+layout(std430, binding=1) readonly buffer Sums { uint sums[]; };
+uniform uint count;
+void main() {
+    uint base = gl_GlobalInvocationID.x * 4u;
+    uint add = sums[gl_WorkGroupID.x];
+    for (uint k = 0u; k < 4u; ++k) {
+        if (base + k < count) {
+            data[base + k] += add;
+        }
+    }
+})";
+
+// In-place exclusive prefix sum of a uint SSBO, on the GPU. Each workgroup scans 1024 elements
+// and writes its total to a per-level sums buffer; the sums are scanned recursively and added
+// back. To also get the grand total, scan one extra element that holds zero.
+class GPUScan
+{
+public:
+    constexpr static uint32_t kBlockSize = 1024;
+
+    ~GPUScan()
+    {
+        glDeleteProgram(m_scanProgram);
+        glDeleteProgram(m_addProgram);
+        glDeleteBuffers(static_cast<GLsizei>(m_levels.size()), m_levels.data());
+    }
+
+    // Issues the shader compiles; see PendingProgram.
+    void init()
+    {
+        m_pendingScan = start_compute_program(scan_blocks_cs);
+        m_pendingAdd = start_compute_program(add_block_offsets_cs);
+    }
+
+    bool isReady() const { return m_pendingScan.isReady() && m_pendingAdd.isReady(); }
+
+    // Waits for the programs issued by init(). Returns false if they failed to build.
+    bool finishInit()
+    {
+        m_scanProgram = m_pendingScan.finish();
+        m_addProgram = m_pendingAdd.finish();
+        m_scanCount = glGetUniformLocation(m_scanProgram, "count");
+        m_addCount = glGetUniformLocation(m_addProgram, "count");
+        return m_scanProgram && m_addProgram;
+    }
+
+    // Allocates the block sums for scans of up to 'maxCount' elements.
+    void reserve(uint32_t maxCount)
+    {
+        if (maxCount <= m_capacity)
+        {
+            return;
+        }
+        glDeleteBuffers(static_cast<GLsizei>(m_levels.size()), m_levels.data());
+        m_levels.clear();
+        uint32_t count = maxCount;
+        do
+        {
+            count = num_blocks(count);
+            GLuint buffer;
+            glGenBuffers(1, &buffer);
+            glBindBuffer(GL_SHADER_STORAGE_BUFFER, buffer);
+            glBufferData(GL_SHADER_STORAGE_BUFFER,
+                         count * sizeof(uint32_t),
+                         nullptr,
+                         GL_DYNAMIC_COPY);
+            m_levels.push_back(buffer);
+        } while (count > 1);
+        m_capacity = maxCount;
+    }
+
+    // Scans the first 'count' elements of 'buffer'. Changes the current program. Does not issue
+    // a barrier after the final pass; the caller issues whichever one matches its next read.
+    void exclusiveScan(GLuint buffer, uint32_t count)
+    {
+        reserve(count);
+        scanLevel(buffer, count, 0);
+    }
+
+private:
+    static uint32_t num_blocks(uint32_t count) { return (count + kBlockSize - 1) / kBlockSize; }
+
+    void scanLevel(GLuint buffer, uint32_t count, size_t level)
+    {
+        uint32_t blocks = num_blocks(count);
+        glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 0, buffer);
+        glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 1, m_levels[level]);
+        glUseProgram(m_scanProgram);
+        glUniform1ui(m_scanCount, count);
+        glDispatchCompute(blocks, 1, 1);
+        if (blocks == 1)
+        {
+            return;
+        }
+        glMemoryBarrier(GL_SHADER_STORAGE_BARRIER_BIT);
+        scanLevel(m_levels[level], blocks, level + 1);
+        glMemoryBarrier(GL_SHADER_STORAGE_BARRIER_BIT);
+        glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 0, buffer);
+        glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 1, m_levels[level]);
+        glUseProgram(m_addProgram);
+        glUniform1ui(m_addCount, count);
+        glDispatchCompute(blocks, 1, 1);
+    }
+
+    PendingProgram m_pendingScan;
+    PendingProgram m_pendingAdd;
+    GLuint m_scanProgram = 0;
+    GLuint m_addProgram = 0;
+    GLint m_scanCount = -1;
+    GLint m_addCount = -1;
+    std::vector<GLuint> m_levels;
+    uint32_t m_capacity = 0;
+};
@@ -0,0 +1,272 @@
+/*
+ * Copyright 2022 Rive
+ */
+
+#pragma once
+
+#include "glad/glad.h"
+#include "bubble_storage.hpp"
+#include "cpu_raster.hpp"
+#include "gl_program.hpp"
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+
+// GL_EXT_texture_buffer (core only in GLES 3.2), which glad wasn't generated with.
+#ifndef GL_TEXTURE_BUFFER_EXT
+#define GL_TEXTURE_BUFFER_EXT 0x8C2A
+#define GL_MAX_TEXTURE_BUFFER_SIZE_EXT 0x8C2B
+#endif
+typedef void(APIENTRYP PFNGLTEXBUFFEREXTPROC)(GLenum target, GLenum internalformat, GLuint buffer);
+
+// How the draw program's vertex shader gets at the instance data.
+enum class InstanceFetch
+{
+    Attribs, // Three instanced vertex attributes.
+    SSBO,    // Pulled from a shader storage buffer, indexed by gl_InstanceID.
+    TBO,     // Pulled from a texture buffer, indexed by gl_InstanceID.
+};
+
+// A Bubble in 20 bytes instead of 36: half-float speeds and an RGBA8 color. Half-float speeds
+// drift a few pixels from the full-precision motion by the time the closed-form path rebases.
+struct PackedBubble
+{
+    float x, y, r;
+    uint32_t speed; // packHalf2x16(dx, dy)
+    uint32_t color; // packUnorm4x8
+};
+static_assert(sizeof(PackedBubble) == 20, "vertex pulling reads PackedBubbles as 5 words");
+
+// Round to nearest, ties to even. Values too small for a normal half flush to zero, values too
+// large become infinity, and NaN stays NaN.
+static inline uint16_t float_to_half(float value)
+{
+    uint32_t bits;
+    memcpy(&bits, &value, sizeof(bits));
+    uint32_t sign = (bits >> 16) & 0x8000;
+    int32_t exponent = static_cast<int32_t>((bits >> 23) & 0xff) - 127 + 15;
+    uint32_t mantissa = bits & 0x7fffff;
+    if (exponent == 0xff - 127 + 15 && mantissa)
+    {
+        return static_cast<uint16_t>(sign | 0x7e00);
+    }
+    if (exponent <= 0)
+    {
+        return static_cast<uint16_t>(sign);
+    }
+    if (exponent >= 31)
+    {
+        return static_cast<uint16_t>(sign | 0x7c00);
+    }
+    uint32_t half = sign | static_cast<uint32_t>(exponent) << 10 | mantissa >> 13;
+    uint32_t remainder = mantissa & 0x1fff;
+    // A carry out of the mantissa correctly bumps the exponent, up to infinity.
+    if (remainder > 0x1000 || (remainder == 0x1000 && (half & 1)))
+    {
+        ++half;
+    }
+    return static_cast<uint16_t>(half);
+}
+
+// Packs 'count' Bubbles (or structs that start with a Bubble), 'stride' bytes apart.
+static inline void pack_bubbles(const void* src, size_t stride, size_t count, PackedBubble* dst)
+{
+    const char* bytes = static_cast<const char*>(src);
+    for (size_t i = 0; i < count; ++i)
+    {
+        const Bubble& b = *reinterpret_cast<const Bubble*>(bytes + i * stride);
+        dst[i] = {b.x,
+                  b.y,
+                  b.r,
+                  static_cast<uint32_t>(float_to_half(b.dx)) |
+                      static_cast<uint32_t>(float_to_half(b.dy)) << 16,
+                  pack_unorm4x8(b.color[0], b.color[1], b.color[2], b.color[3])};
+    }
+}
+
+// Points the instanced attributes of the draw program at an array of Bubbles (or of structs that
+// start with a Bubble), or of PackedBubbles, that begins 'offset' bytes into 'buffer'.
+static inline void bind_instance_attribs(GLuint buffer,
+                                         GLsizei stride,
+                                         size_t offset = 0,
+                                         bool packed = false)
+{
+    auto pointer = [offset](size_t fieldOffset) {
+        return reinterpret_cast<const void*>(offset + fieldOffset);
+    };
+    glBindBuffer(GL_ARRAY_BUFFER, buffer);
+
+    glEnableVertexAttribArray(0);
+    glVertexAttribPointer(0, 3, GL_FLOAT, GL_FALSE, stride, pointer(0));
+    glVertexAttribDivisor(0, 1);
+
+    glEnableVertexAttribArray(1);
+    glVertexAttribPointer(1,
+                          2,
+                          packed ? GL_HALF_FLOAT : GL_FLOAT,
+                          GL_FALSE,
+                          stride,
+                          pointer(packed ? offsetof(PackedBubble, speed) : offsetof(Bubble, dx)));
+    glVertexAttribDivisor(1, 1);
+
+    glEnableVertexAttribArray(2);
+    glVertexAttribPointer(2,
+                          4,
+                          packed ? GL_UNSIGNED_BYTE : GL_FLOAT,
+                          GL_TRUE,
+                          stride,
+                          pointer(packed ? offsetof(PackedBubble, color)
+                                         : offsetof(Bubble, color)));
+    glVertexAttribDivisor(2, 1);
+}
+
+// The draw program's "Globals" uniform block, std140.
+struct DrawGlobals
+{
+    float window[2];
+    float T;
+    int32_t instanceBase;   // First word of the instances, for vertex pulling.
+    int32_t instanceStride; // Words per instance, for vertex pulling.
+    int32_t pad[3];
+};
+
+// Feeds instances and globals to the draw program. Globals go through a uniform buffer on every
+// path. Instances go through vertex attributes or get pulled by the vertex shader, from the same
+// buffers either way, so the instance fetch path is the only thing that differs between runs.
+class InstanceFetcher
+{
+public:
+    // The texture unit that vertex pulling from a texture buffer uses.
+    constexpr static GLuint kTextureBufferUnit = 1;
+
+    InstanceFetcher(InstanceFetch fetch, bool packed) : m_fetch(fetch), m_packed(packed)
+    {
+        glGenBuffers(1, &m_globalsBuffer);
+        glBindBuffer(GL_UNIFORM_BUFFER, m_globalsBuffer);
+        glBufferData(GL_UNIFORM_BUFFER, sizeof(DrawGlobals), nullptr, GL_DYNAMIC_DRAW);
+        if (m_fetch == InstanceFetch::TBO)
+        {
+            glGenTextures(1, &m_texture);
+        }
+    }
+
+    ~InstanceFetcher()
+    {
+        glDeleteTextures(1, &m_texture);
+        glDeleteBuffers(1, &m_globalsBuffer);
+    }
+
+    InstanceFetcher(const InstanceFetcher&) = delete;
+    InstanceFetcher& operator=(const InstanceFetcher&) = delete;
+
+    // Returns whether the current context can fetch up to 'maxBytes' of instances this way, after
+    // printing why not. Texture buffers need GL_EXT_texture_buffer, whose entry point gets loaded
+    // here.
+    bool init(GLADloadproc getProcAddress, size_t maxBytes)
+    {
+        if (m_fetch == InstanceFetch::SSBO)
+        {
+            GLint maxVertexBlocks = 0;
+            glGetIntegerv(GL_MAX_VERTEX_SHADER_STORAGE_BLOCKS, &maxVertexBlocks);
+            if (maxVertexBlocks < 1)
+            {
+                fprintf(stderr, "Vertex shaders can't read storage buffers on this driver.\n");
+                return false;
+            }
+            GLint64 maxBlockBytes = 0;
+            glGetInteger64v(GL_MAX_SHADER_STORAGE_BLOCK_SIZE, &maxBlockBytes);
+            m_maxBytes = static_cast<size_t>(maxBlockBytes);
+            if (maxBytes > m_maxBytes)
+            {
+                fprintf(stderr,
+                        "%zu bytes of instances exceed the storage block limit of %zu bytes.\n",
+                        maxBytes,
+                        m_maxBytes);
+                return false;
+            }
+        }
+        else if (m_fetch == InstanceFetch::TBO)
+        {
+            if (has_gl_extension("GL_EXT_texture_buffer"))
+            {
+                m_texBuffer = reinterpret_cast<PFNGLTEXBUFFEREXTPROC>(
+                    getProcAddress("glTexBufferEXT"));
+            }
+            if (!m_texBuffer)
+            {
+                fprintf(stderr, "Texture buffers need GL_EXT_texture_buffer.\n");
+                return false;
+            }
+            GLint maxTexels = 0;
+            glGetIntegerv(GL_MAX_TEXTURE_BUFFER_SIZE_EXT, &maxTexels);
+            m_maxBytes = static_cast<size_t>(maxTexels) * 4;
+            if (maxBytes / 4 > static_cast<size_t>(maxTexels))
+            {
+                fprintf(stderr,
+                        "%zu bytes of instances exceed the texture buffer limit of %i texels.\n",
+                        maxBytes,
+                        maxTexels);
+                return false;
+            }
+        }
+        return true;
+    }
+
+    InstanceFetch fetch() const { return m_fetch; }
+    bool packed() const { return m_packed; }
+
+    // The most bytes of instances this way can fetch from one buffer, once init() has run.
+    size_t maxBytes() const { return m_maxBytes; }
+
+    // Bytes per instance that the CPU writes: PackedBubbles if packed, otherwise Bubbles.
+    size_t instanceSize() const { return m_packed ? sizeof(PackedBubble) : sizeof(Bubble); }
+
+    // Makes the instances that begin 'offset' bytes into 'buffer', 'stride' bytes apart, the ones
+    // drawn next. Storage buffer bindings are shared with the compute passes, so call this every
+    // frame, after any simulation has run.
+    void bind(GLuint buffer, GLsizei stride, size_t offset = 0)
+    {
+        m_globals.instanceBase = static_cast<int32_t>(offset / 4);
+        m_globals.instanceStride = stride / 4;
+        switch (m_fetch)
+        {
+            case InstanceFetch::Attribs:
+                bind_instance_attribs(buffer, stride, offset, m_packed);
+                break;
+            case InstanceFetch::SSBO:
+                glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 0, buffer);
+                break;
+            case InstanceFetch::TBO:
+                glActiveTexture(GL_TEXTURE0 + kTextureBufferUnit);
+                glBindTexture(GL_TEXTURE_BUFFER_EXT, m_texture);
+                if (buffer != m_textureSource)
+                {
+                    m_texBuffer(GL_TEXTURE_BUFFER_EXT, GL_R32UI, buffer);
+                    m_textureSource = buffer;
+                }
+                glActiveTexture(GL_TEXTURE0);
+                break;
+        }
+    }
+
+    // Uploads this frame's globals. Call after bind().
+    void setGlobals(float width, float height, float T)
+    {
+        m_globals.window[0] = width;
+        m_globals.window[1] = height;
+        m_globals.T = T;
+        glBindBufferBase(GL_UNIFORM_BUFFER, 0, m_globalsBuffer);
+        glBufferSubData(GL_UNIFORM_BUFFER, 0, sizeof(DrawGlobals), &m_globals);
+    }
+
+private:
+    const InstanceFetch m_fetch;
+    const bool m_packed;
+    GLuint m_globalsBuffer = 0;
+    GLuint m_texture = 0;
+    GLuint m_textureSource = 0;
+    PFNGLTEXBUFFEREXTPROC m_texBuffer = nullptr;
+    size_t m_maxBytes = SIZE_MAX;
+    DrawGlobals m_globals = {};
+};
@@ -0,0 +1,137 @@
+/*
+ * Copyright 2022 Rive
+ */
+
+#pragma once
+
+#include "glad/glad.h"
+#include <chrono>
+#include <cstdint>
+#include <cstring>
+
+// How per-frame instance data gets into GL.
+enum class UploadMode
+{
+    SubData, // glBufferSubData into one buffer; the driver copies or stalls as it sees fit.
+    Orphan,  // glBufferData(nullptr) first, so the driver can hand out fresh storage.
+    Ring,    // Unsynchronized maps into a 3-frame ring in one buffer, guarded by fences.
+};
+
+// Streams a frame's worth of instance data, up to 'capacity' bytes, into a GL buffer every frame
+// and measures the bandwidth. The data for a frame lands at the offset upload() returns, which
+// moves around in Ring mode, so attribute pointers must be rebased every frame.
+class InstanceUploader
+{
+public:
+    constexpr static int kRingFrames = 3;
+
+    InstanceUploader(UploadMode mode, size_t capacity) : m_mode(mode), m_capacity(capacity)
+    {
+        glGenBuffers(1, &m_buffer);
+        glBindBuffer(GL_ARRAY_BUFFER, m_buffer);
+        glBufferData(GL_ARRAY_BUFFER,
+                     mode == UploadMode::Ring ? kRingFrames * capacity : capacity,
+                     nullptr,
+                     GL_STREAM_DRAW);
+    }
+
+    ~InstanceUploader()
+    {
+        for (GLsync fence : m_fences)
+        {
+            glDeleteSync(fence);
+        }
+        glDeleteBuffers(1, &m_buffer);
+    }
+
+    InstanceUploader(const InstanceUploader&) = delete;
+    InstanceUploader& operator=(const InstanceUploader&) = delete;
+
+    GLuint buffer() const { return m_buffer; }
+
+    // Writes this frame's instances and returns their byte offset within buffer(). Leaves
+    // buffer() bound to GL_ARRAY_BUFFER.
+    size_t upload(const void* data, size_t bytes)
+    {
+        glBindBuffer(GL_ARRAY_BUFFER, m_buffer);
+        size_t offset = 0;
+        if (m_mode == UploadMode::Ring)
+        {
+            // Only wait for the GPU to finish the frame that last used this third of the ring.
+            if (GLsync& fence = m_fences[m_ringIdx])
+            {
+                auto stallStart = std::chrono::steady_clock::now();
+                while (glClientWaitSync(fence, GL_SYNC_FLUSH_COMMANDS_BIT, 1000000000) ==
+                       GL_TIMEOUT_EXPIRED)
+                {
+                }
+                m_stallSeconds += seconds_since(stallStart);
+                glDeleteSync(fence);
+                fence = nullptr;
+            }
+            offset = m_ringIdx * m_capacity;
+        }
+        auto uploadStart = std::chrono::steady_clock::now();
+        switch (m_mode)
+        {
+            case UploadMode::SubData:
+                glBufferSubData(GL_ARRAY_BUFFER, 0, bytes, data);
+                break;
+            case UploadMode::Orphan:
+                glBufferData(GL_ARRAY_BUFFER, m_capacity, nullptr, GL_STREAM_DRAW);
+                glBufferSubData(GL_ARRAY_BUFFER, 0, bytes, data);
+                break;
+            case UploadMode::Ring:
+                // The fence above already guarantees the GPU is done with this range.
+                if (void* dst = glMapBufferRange(GL_ARRAY_BUFFER,
+                                                 offset,
+                                                 bytes,
+                                                 GL_MAP_WRITE_BIT | GL_MAP_UNSYNCHRONIZED_BIT |
+                                                     GL_MAP_INVALIDATE_RANGE_BIT))
+                {
+                    memcpy(dst, data, bytes);
+                    glUnmapBuffer(GL_ARRAY_BUFFER);
+                }
+                break;
+        }
+        m_uploadSeconds += seconds_since(uploadStart);
+        m_bytesUploaded += bytes;
+        return offset;
+    }
+
+    // Call once the draws that read this frame's upload have been issued.
+    void endFrame()
+    {
+        if (m_mode == UploadMode::Ring)
+        {
+            m_fences[m_ringIdx] = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+            m_ringIdx = (m_ringIdx + 1) % kRingFrames;
+        }
+    }
+
+    // Bytes uploaded, seconds spent uploading them, and seconds stalled on fences, since the
+    // previous call.
+    void takeStats(uint64_t* bytes, double* uploadSeconds, double* stallSeconds)
+    {
+        *bytes = m_bytesUploaded;
+        *uploadSeconds = m_uploadSeconds;
+        *stallSeconds = m_stallSeconds;
+        m_bytesUploaded = 0;
+        m_uploadSeconds = m_stallSeconds = 0;
+    }
+
+private:
+    static double seconds_since(std::chrono::steady_clock::time_point start)
+    {
+        return std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    }
+
+    const UploadMode m_mode;
+    const size_t m_capacity;
+    GLuint m_buffer = 0;
+    GLsync m_fences[kRingFrames] = {};
+    int m_ringIdx = 0;
+    uint64_t m_bytesUploaded = 0;
+    double m_uploadSeconds = 0;
+    double m_stallSeconds = 0;
+};
@@ -0,0 +1,201 @@
+/*
+ * Copyright 2022 Rive
+ */
+
+#pragma once
+
+#include "bubble_storage.hpp"
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <vector>
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#define BUBBLES_SSE2
+#include <emmintrin.h>
+#endif
+
+// A bubble with a finite life: it grows in, drifts, then pops and fades. 'bubble' comes first, so
+// an array of LiveBubbles draws directly as instances with a stride of sizeof(LiveBubble).
+struct LiveBubble
+{
+    Bubble bubble; // Current radius and alpha; speed is in pixels per step.
+    float age, lifetime; // In steps.
+    float maxR, maxAlpha;
+};
+
+// Fractions of a lifetime spent growing in and popping.
+constexpr static float kGrowFraction = .15f;
+constexpr static float kPopFraction = .08f;
+
+// Ages a bubble by 'dt' steps, moves it inside a w x h box, and returns whether it is still
+// alive. "lifecycle_update" in gpu_lifecycle.hpp is the GLSL twin of this function.
+static inline bool update_live_bubble(LiveBubble& b, float dt, float w, float h)
+{
+    b.age += dt;
+    float t = b.age / b.lifetime;
+    float grow = std::min(std::max(t / kGrowFraction, 0.f), 1.f);
+    grow = grow * grow * (3 - 2 * grow);
+    float pop = std::min(std::max((t - (1 - kPopFraction)) / kPopFraction, 0.f), 1.f);
+    Bubble& bubble = b.bubble;
+    bubble.r = b.maxR * grow * (1 + .3f * pop);
+    bubble.color[3] = b.maxAlpha * (1 - pop);
+    bubble.x += bubble.dx * dt;
+    bubble.y += bubble.dy * dt;
+    if (bubble.x < bubble.r || bubble.x > w - bubble.r)
+    {
+        bubble.dx = bubble.x < bubble.r ? fabsf(bubble.dx) : -fabsf(bubble.dx);
+        bubble.x = std::min(std::max(bubble.x, bubble.r), w - bubble.r);
+    }
+    if (bubble.y < bubble.r || bubble.y > h - bubble.r)
+    {
+        bubble.dy = bubble.y < bubble.r ? fabsf(bubble.dy) : -fabsf(bubble.dy);
+        bubble.y = std::min(std::max(bubble.y, bubble.r), h - bubble.r);
+    }
+    return b.age < b.lifetime;
+}
+
+// Writes the exclusive prefix sum of in[0..n) to out[] and returns the total. With SSE2, each
+// group of 4 is scanned in-register with two shifted adds, plus a running carry.
+static inline uint32_t exclusive_scan(const uint32_t* in, uint32_t* out, size_t n)
+{
+    uint32_t carry = 0;
+    size_t i = 0;
+#ifdef BUBBLES_SSE2
+    __m128i carry4 = _mm_setzero_si128();
+    for (; i + 4 <= n; i += 4)
+    {
+        __m128i x = _mm_loadu_si128(reinterpret_cast<const __m128i*>(in + i));
+        __m128i inclusive = _mm_add_epi32(x, _mm_slli_si128(x, 4));
+        inclusive = _mm_add_epi32(inclusive, _mm_slli_si128(inclusive, 8));
+        __m128i exclusive = _mm_add_epi32(_mm_sub_epi32(inclusive, x), carry4);
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(out + i), exclusive);
+        carry4 = _mm_add_epi32(carry4, _mm_shuffle_epi32(inclusive, _MM_SHUFFLE(3, 3, 3, 3)));
+    }
+    carry = static_cast<uint32_t>(_mm_cvtsi128_si32(carry4));
+#endif
+    for (; i < n; ++i)
+    {
+        out[i] = carry;
+        carry += in[i];
+    }
+    return carry;
+}
+
+// Spawns bubbles at a steady rate that keeps about 'population' of them alive. Spawns are made on
+// the CPU for both lifecycle implementations, so they see the same sequence of bubbles.
+class LifecycleSpawner
+{
+public:
+    constexpr static float kMinLifetime = 120;
+    constexpr static float kMaxLifetime = 600;
+
+    LifecycleSpawner(size_t population, float radiusScale, uint32_t seed = 1) :
+        m_rate(population / ((kMinLifetime + kMaxLifetime) * .5f)),
+        m_radiusScale(radiusScale),
+        m_state(seed ? seed : 1)
+    {}
+
+    // Writes the bubbles spawned over the next 'dt' steps to dst[] (at most maxCount of them) and
+    // returns how many.
+    size_t spawn(float dt, float w, float h, LiveBubble* dst, size_t maxCount)
+    {
+        m_pending += m_rate * dt;
+        size_t count = std::min(static_cast<size_t>(m_pending), maxCount);
+        m_pending -= static_cast<float>(static_cast<size_t>(m_pending));
+        for (size_t i = 0; i < count; ++i)
+        {
+            dst[i] = make(w, h, 0);
+        }
+        return count;
+    }
+
+    // Writes 'count' bubbles at random points in their lives, for a population that starts out
+    // in its steady state.
+    void prewarm(float w, float h, LiveBubble* dst, size_t count)
+    {
+        for (size_t i = 0; i < count; ++i)
+        {
+            dst[i] = make(w, h, frand());
+            update_live_bubble(dst[i], 0, w, h);
+        }
+    }
+
+private:
+    // xorshift32.
+    float frand()
+    {
+        m_state ^= m_state << 13;
+        m_state ^= m_state >> 17;
+        m_state ^= m_state << 5;
+        return static_cast<float>(m_state >> 8) * (1.f / (1 << 24));
+    }
+    float frand(float lo, float hi) { return lo + (hi - lo) * frand(); }
+
+    // Same distributions as generate_bubbles(), with radii and speeds scaled by m_radiusScale.
+    LiveBubble make(float w, float h, float lifeFraction)
+    {
+        LiveBubble b;
+        b.maxR = (.1f + .2f * powf(frand(), 4)) * 1024.f * m_radiusScale;
+        b.bubble.x = frand(b.maxR, std::max(w - b.maxR, b.maxR));
+        b.bubble.y = frand(b.maxR, std::max(h - b.maxR, b.maxR));
+        b.bubble.r = 0;
+        b.bubble.dx = (frand() - .5f) * .02f * 1024.f * m_radiusScale;
+        b.bubble.dy = (frand() - .5f) * .02f * 1024.f * m_radiusScale;
+        b.maxAlpha = frand(.75f, 1);
+        b.bubble.color = {frand(.5f, 1), frand(.5f, 1), frand(.5f, 1), 0};
+        b.lifetime = frand(kMinLifetime, kMaxLifetime);
+        b.age = b.lifetime * lifeFraction;
+        return b;
+    }
+
+    const float m_rate; // Bubbles per step.
+    const float m_radiusScale;
+    float m_pending = 0;
+    uint32_t m_state;
+};
+
+// Bubble lifecycle on the CPU. Dead bubbles are removed each step by stream compaction: a SIMD
+// exclusive scan of the alive flags gives every survivor its new index, and since that index is
+// never past the old one, survivors move down in place, in order. Spawns append at the end. The
+// instance array is allocated once, at full capacity, and stays dense.
+class CPULifecycle
+{
+public:
+    void reset(size_t capacity, LifecycleSpawner& spawner, size_t initialCount, float w, float h)
+    {
+        m_bubbles.resize(capacity);
+        m_alive.resize(capacity);
+        m_offsets.resize(capacity);
+        m_count = std::min(initialCount, capacity);
+        spawner.prewarm(w, h, m_bubbles.data(), m_count);
+    }
+
+    size_t size() const { return m_count; }
+    size_t capacity() const { return m_bubbles.size(); }
+    const LiveBubble* data() const { return m_bubbles.data(); }
+
+    void step(float dt, float w, float h, LifecycleSpawner& spawner)
+    {
+        for (size_t i = 0; i < m_count; ++i)
+        {
+            m_alive[i] = update_live_bubble(m_bubbles[i], dt, w, h);
+        }
+        size_t survivors = exclusive_scan(m_alive.data(), m_offsets.data(), m_count);
+        for (size_t i = 0; i < m_count; ++i)
+        {
+            if (m_alive[i])
+            {
+                m_bubbles[m_offsets[i]] = m_bubbles[i];
+            }
+        }
+        m_count = survivors +
+                  spawner.spawn(dt, w, h, m_bubbles.data() + survivors, capacity() - survivors);
+    }
+
+private:
+    std::vector<LiveBubble> m_bubbles;
+    std::vector<uint32_t> m_alive;
+    std::vector<uint32_t> m_offsets;
+    size_t m_count = 0;
+};
@@ -0,0 +1,153 @@
+/*
+ * Copyright 2022 Rive
+ */
+
+#pragma once
+
+#include "bubble_storage.hpp"
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <cstring>
+#include <utility>
+#include <vector>
+
+// Interleaves the low 16 bits of x and y, with x in the even bits.
+static inline uint32_t morton_code(uint32_t x, uint32_t y)
+{
+    auto spread = [](uint32_t v) {
+        v &= 0xffff;
+        v = (v | v << 8) & 0x00ff00ff;
+        v = (v | v << 4) & 0x0f0f0f0f;
+        v = (v | v << 2) & 0x33333333;
+        v = (v | v << 1) & 0x55555555;
+        return v;
+    };
+    return spread(x) | spread(y) << 1;
+}
+
+// Reorders instances along a Z-order curve through the window, so consecutive instances cover
+// nearby pixels and the framebuffer writes of a draw stay in the same part of memory. Keys are
+// Morton codes of the tiles that centers fall in, sorted by an LSD radix sort of (key, index)
+// pairs; the instances themselves are only moved once, by the final gather. Buffers grow to the
+// largest count seen and are reused, so the steady state doesn't allocate.
+class MortonSorter
+{
+public:
+    // Finer tiles don't improve locality much (a tile row is already half a cache line of
+    // RGBA8), but each halving of the tile size adds two key bits, and eventually a radix pass.
+    constexpr static float kTileSize = 8;
+    // Small enough that each pass's bucket counters and write cursors stay in L1.
+    constexpr static int kRadixBits = 8;
+    constexpr static uint32_t kNumBuckets = 1 << kRadixBits;
+    constexpr static int kMaxPasses = 4;
+
+    // Sorts 'count' instances of 'stride' bytes, whose centers are (cx[i], cy[i]) in a w x h
+    // window, and returns the sorted copy. It stays valid until the next call.
+    const void* sort(const void* src,
+                     size_t stride,
+                     size_t count,
+                     StridedPtr<const float> cx,
+                     StridedPtr<const float> cy,
+                     float w,
+                     float h)
+    {
+        auto start = std::chrono::steady_clock::now();
+        if (m_keys.size() < count)
+        {
+            m_keys.resize(count);
+            m_indices.resize(count);
+            m_scratchKeys.resize(count);
+            m_scratchIndices.resize(count);
+        }
+        if (m_sorted.size() < count * stride)
+        {
+            m_sorted.resize(count * stride);
+        }
+
+        // Enough bits per axis for the larger window dimension in tiles; a 2048 x 2048 window
+        // needs 16-bit keys, which sort in two passes.
+        int bits = 1;
+        while (kTileSize * (1 << bits) < std::max(w, h) && bits < 16)
+        {
+            ++bits;
+        }
+        int numPasses = std::min((2 * bits + kRadixBits - 1) / kRadixBits, kMaxPasses);
+        float maxTile = static_cast<float>((1 << bits) - 1);
+        auto tile = [maxTile](float coord) {
+            return static_cast<uint32_t>(std::min(std::max(coord / kTileSize, 0.f), maxTile));
+        };
+        // Every pass's histogram comes out of the one read over the keys.
+        uint32_t histograms[kMaxPasses][kNumBuckets] = {};
+        for (size_t i = 0; i < count; ++i)
+        {
+            uint32_t key = morton_code(tile(cx[i]), tile(cy[i]));
+            m_keys[i] = key;
+            m_indices[i] = static_cast<uint32_t>(i);
+            for (int pass = 0; pass < numPasses; ++pass)
+            {
+                ++histograms[pass][(key >> (pass * kRadixBits)) & (kNumBuckets - 1)];
+            }
+        }
+
+        for (int pass = 0; pass < numPasses; ++pass)
+        {
+            // Turn the counts into write cursors.
+            uint32_t* cursors = histograms[pass];
+            uint32_t sum = 0;
+            for (uint32_t bucket = 0; bucket < kNumBuckets; ++bucket)
+            {
+                uint32_t bucketCount = cursors[bucket];
+                cursors[bucket] = sum;
+                sum += bucketCount;
+            }
+            int shift = pass * kRadixBits;
+            for (size_t i = 0; i < count; ++i)
+            {
+                uint32_t dst = cursors[(m_keys[i] >> shift) & (kNumBuckets - 1)]++;
+                m_scratchKeys[dst] = m_keys[i];
+                m_scratchIndices[dst] = m_indices[i];
+            }
+            std::swap(m_keys, m_scratchKeys);
+            std::swap(m_indices, m_scratchIndices);
+        }
+
+        const char* srcBytes = static_cast<const char*>(src);
+        for (size_t i = 0; i < count; ++i)
+        {
+            memcpy(m_sorted.data() + i * stride, srcBytes + m_indices[i] * stride, stride);
+        }
+        m_seconds +=
+            std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+        return m_sorted.data();
+    }
+
+    // Sorts instances that are Bubbles (or structs that start with a Bubble) by their positions.
+    const void* sort(const void* src, size_t stride, size_t count, float w, float h)
+    {
+        const Bubble* first = static_cast<const Bubble*>(src);
+        return sort(src,
+                    stride,
+                    count,
+                    StridedPtr<const float>(&first->x, stride),
+                    StridedPtr<const float>(&first->y, stride),
+                    w,
+                    h);
+    }
+
+    // Seconds spent sorting since the previous call.
+    double takeSeconds()
+    {
+        double seconds = m_seconds;
+        m_seconds = 0;
+        return seconds;
+    }
+
+private:
+    std::vector<uint32_t> m_keys;
+    std::vector<uint32_t> m_indices;
+    std::vector<uint32_t> m_scratchKeys;
+    std::vector<uint32_t> m_scratchIndices;
+    std::vector<char> m_sorted;
+    double m_seconds = 0;
+};
@@ -0,0 +1,260 @@
+/*
+ * Copyright 2022 Rive
+ */
+
+#pragma once
+
+#include "bubble_storage.hpp"
+#include "frame_pipeline.hpp"
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <vector>
+
+// Bubble simulation with elastic bubble-bubble and bubble-wall collisions.
+//
+// Broad phase: each step counting-sorts the bubbles into a uniform grid whose cells are as wide
+// as the largest bubble, so every contact is found within a 3x3 cell neighborhood. Sorting
+// permutes the simulation state itself, which keeps neighbors adjacent in memory and makes each
+// row of 3 neighboring cells one contiguous run.
+//
+// Narrow phase: each bubble tests its runs in fixed-size batches with a branch-free,
+// vectorizable circle test, then resolves the hits. Every bubble only writes its own state
+// (impulses are gathered Jacobi style), so bubbles can be processed in parallel.
+class BubblePhysics
+{
+public:
+    template <typename Store> void reset(const Store& bubbles)
+    {
+        size_t n = bubbles.size();
+        for (std::vector<float>* field : {&m_x, &m_y, &m_vx, &m_vy, &m_r, &m_invMass})
+        {
+            field->resize(n);
+        }
+        for (std::vector<float>* field : {&m_sx, &m_sy, &m_svx, &m_svy, &m_sr, &m_sInvMass})
+        {
+            field->resize(n);
+        }
+        m_id.resize(n);
+        m_sid.resize(n);
+        m_cell.resize(n);
+        m_maxR = 0;
+        for (size_t i = 0; i < n; ++i)
+        {
+            m_x[i] = bubbles.x(i);
+            m_y[i] = bubbles.y(i);
+            m_vx[i] = bubbles.dx(i);
+            m_vy[i] = bubbles.dy(i);
+            m_r[i] = bubbles.r(i);
+            m_invMass[i] = m_r[i] > 0 ? 1 / (m_r[i] * m_r[i]) : 0;
+            m_id[i] = static_cast<uint32_t>(i);
+            m_maxR = std::max(m_maxR, m_r[i]);
+        }
+    }
+
+    size_t size() const { return m_x.size(); }
+
+    // Advances the simulation by 'dt' frames inside a w x h box.
+    void step(float dt, float w, float h, WorkerPool& workers)
+    {
+        buildGrid(w, h);
+        constexpr int kChunk = 2048;
+        int numChunks = static_cast<int>((size() + kChunk - 1) / kChunk);
+        workers.run(numChunks, [&](int chunk, int) {
+            size_t begin = static_cast<size_t>(chunk) * kChunk;
+            collideAndIntegrate(begin, std::min(begin + kChunk, size()), dt, w, h);
+        });
+    }
+
+    // Writes instances for "vs" (zero speed, so the shader leaves them in place). The order
+    // follows the grid, not the original bubble order.
+    template <typename Store> void exportInstances(const Store& bubbles, Bubble* dst) const
+    {
+        for (size_t k = 0; k < size(); ++k)
+        {
+            uint32_t i = m_id[k];
+            dst[k] = {m_x[k],
+                      m_y[k],
+                      m_r[k],
+                      0,
+                      0,
+                      {bubbles.color(i, 0),
+                       bubbles.color(i, 1),
+                       bubbles.color(i, 2),
+                       bubbles.color(i, 3)}};
+        }
+    }
+
+    // Writes centers indexed by original bubble, for the CPU rasterizer.
+    void exportCenters(float* cx, float* cy) const
+    {
+        for (size_t k = 0; k < size(); ++k)
+        {
+            cx[m_id[k]] = m_x[k];
+            cy[m_id[k]] = m_y[k];
+        }
+    }
+
+private:
+    int cellCoord(float v, int numCells) const
+    {
+        return std::min(std::max(static_cast<int>(v * m_invCellSize), 0), numCells - 1);
+    }
+
+    // Counting-sorts the state into the m_s* arrays by grid cell.
+    void buildGrid(float w, float h)
+    {
+        float cellSize = std::max(2 * m_maxR, 1.f);
+        m_invCellSize = 1 / cellSize;
+        m_gridW = std::max(static_cast<int>(ceilf(w / cellSize)), 1);
+        m_gridH = std::max(static_cast<int>(ceilf(h / cellSize)), 1);
+        m_cellStart.assign(static_cast<size_t>(m_gridW) * m_gridH + 1, 0);
+        size_t n = size();
+        for (size_t i = 0; i < n; ++i)
+        {
+            m_cell[i] = cellCoord(m_y[i], m_gridH) * m_gridW + cellCoord(m_x[i], m_gridW);
+            ++m_cellStart[m_cell[i] + 1];
+        }
+        for (size_t c = 1; c < m_cellStart.size(); ++c)
+        {
+            m_cellStart[c] += m_cellStart[c - 1];
+        }
+        // Use m_cellStart[c] as the write cursor, then shift it back into place.
+        for (size_t i = 0; i < n; ++i)
+        {
+            uint32_t k = m_cellStart[m_cell[i]]++;
+            m_sx[k] = m_x[i];
+            m_sy[k] = m_y[i];
+            m_svx[k] = m_vx[i];
+            m_svy[k] = m_vy[i];
+            m_sr[k] = m_r[i];
+            m_sInvMass[k] = m_invMass[i];
+            m_sid[k] = m_id[i];
+        }
+        for (size_t c = m_cellStart.size() - 1; c > 0; --c)
+        {
+            m_cellStart[c] = m_cellStart[c - 1];
+        }
+        m_cellStart[0] = 0;
+    }
+
+    // Resolves contacts for sorted bubbles [begin, end) and writes their integrated state back
+    // to the (now sorted) primary arrays.
+    void collideAndIntegrate(size_t begin, size_t end, float dt, float w, float h)
+    {
+        constexpr uint32_t kBatch = 32;
+        for (size_t k = begin; k < end; ++k)
+        {
+            float xi = m_sx[k], yi = m_sy[k], ri = m_sr[k];
+            float vxi = m_svx[k], vyi = m_svy[k], imi = m_sInvMass[k];
+            float dvx = 0, dvy = 0, dpx = 0, dpy = 0;
+            int gx = cellCoord(xi, m_gridW), gy = cellCoord(yi, m_gridH);
+            int gx0 = std::max(gx - 1, 0), gx1 = std::min(gx + 1, m_gridW - 1);
+            for (int row = std::max(gy - 1, 0); row <= std::min(gy + 1, m_gridH - 1); ++row)
+            {
+                uint32_t runBegin = m_cellStart[row * m_gridW + gx0];
+                uint32_t runEnd = m_cellStart[row * m_gridW + gx1 + 1];
+                for (uint32_t j0 = runBegin; j0 < runEnd; j0 += kBatch)
+                {
+                    uint32_t count = std::min(kBatch, runEnd - j0);
+                    const float* __restrict sx = m_sx.data() + j0;
+                    const float* __restrict sy = m_sy.data() + j0;
+                    const float* __restrict sr = m_sr.data() + j0;
+                    int hit[kBatch];
+                    int anyHit = 0;
+                    for (uint32_t b = 0; b < count; ++b)
+                    {
+                        float ddx = xi - sx[b], ddy = yi - sy[b], rr = ri + sr[b];
+                        hit[b] = ddx * ddx + ddy * ddy < rr * rr;
+                        anyHit |= hit[b];
+                    }
+                    if (!anyHit)
+                    {
+                        continue;
+                    }
+                    for (uint32_t b = 0; b < count; ++b)
+                    {
+                        uint32_t j = j0 + b;
+                        if (!hit[b] || j == k)
+                        {
+                            continue;
+                        }
+                        float nx = xi - m_sx[j], ny = yi - m_sy[j];
+                        float d = sqrtf(nx * nx + ny * ny);
+                        if (d > 1e-6f)
+                        {
+                            nx /= d;
+                            ny /= d;
+                        }
+                        else
+                        {
+                            // Coincident centers: separate along x, in opposite directions.
+                            nx = k < j ? -1.f : 1.f;
+                            ny = 0;
+                        }
+                        float imj = m_sInvMass[j];
+                        float sumInvMass = imi + imj;
+                        if (sumInvMass <= 0)
+                        {
+                            continue;
+                        }
+                        float approach = (vxi - m_svx[j]) * nx + (vyi - m_svy[j]) * ny;
+                        if (approach < 0)
+                        {
+                            // Elastic impulse along the contact normal.
+                            float impulse = -2 * approach / sumInvMass * imi;
+                            dvx += impulse * nx;
+                            dvy += impulse * ny;
+                        }
+                        // Push apart, split by mass. Half strength, since both bubbles of the
+                        // pair apply their share independently and contacts accumulate.
+                        float push = (ri + m_sr[j] - d) * (imi / sumInvMass) * .5f;
+                        dpx += push * nx;
+                        dpy += push * ny;
+                    }
+                }
+            }
+            float vx = vxi + dvx, vy = vyi + dvy;
+            float x = xi + vx * dt + dpx, y = yi + vy * dt + dpy;
+            if (x < ri)
+            {
+                x = ri;
+                vx = fabsf(vx);
+            }
+            else if (x > w - ri)
+            {
+                x = w - ri;
+                vx = -fabsf(vx);
+            }
+            if (y < ri)
+            {
+                y = ri;
+                vy = fabsf(vy);
+            }
+            else if (y > h - ri)
+            {
+                y = h - ri;
+                vy = -fabsf(vy);
+            }
+            m_x[k] = x;
+            m_y[k] = y;
+            m_vx[k] = vx;
+            m_vy[k] = vy;
+            m_r[k] = ri;
+            m_invMass[k] = imi;
+            m_id[k] = m_sid[k];
+        }
+    }
+
+    // Simulation state, permuted into grid order every step.
+    std::vector<float> m_x, m_y, m_vx, m_vy, m_r, m_invMass;
+    std::vector<uint32_t> m_id;
+    // The same state after the counting sort, which the narrow phase reads from.
+    std::vector<float> m_sx, m_sy, m_svx, m_svy, m_sr, m_sInvMass;
+    std::vector<uint32_t> m_sid;
+    std::vector<uint32_t> m_cell;
+    std::vector<uint32_t> m_cellStart;
+    float m_maxR = 0;
+    float m_invCellSize = 1;
+    int m_gridW = 1, m_gridH = 1;
+};
@@ -0,0 +1,381 @@
+/*
+ * Copyright 2022 Rive
+ */
+
+#pragma once
+
+#include "bubble_storage.hpp"
+#include <algorithm>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <memory>
+#include <vector>
+
+#ifdef _WIN32
+// windows.h defines APIENTRY itself, to the same calling convention glad gives it.
+#undef APIENTRY
+#ifndef NOMINMAX
+#define NOMINMAX
+#endif
+#ifndef WIN32_LEAN_AND_MEAN
+#define WIN32_LEAN_AND_MEAN
+#endif
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+// PCG32 (XSH RR): small, fast, and the same sequence on every platform and standard library,
+// unlike rand().
+class PCG32
+{
+public:
+    explicit PCG32(uint64_t seed, uint64_t stream = 0xda3e39cb94b95bdbull) :
+        m_increment(stream << 1 | 1)
+    {
+        next();
+        m_state += seed;
+        next();
+    }
+
+    uint32_t next()
+    {
+        uint64_t state = m_state;
+        m_state = state * 6364136223846793005ull + m_increment;
+        uint32_t xorShifted = static_cast<uint32_t>(((state >> 18) ^ state) >> 27);
+        uint32_t rotation = static_cast<uint32_t>(state >> 59);
+        return xorShifted >> rotation | xorShifted << ((32 - rotation) & 31);
+    }
+
+    // Uniform in [0, 1), with 24 bits of randomness.
+    float uniform() { return static_cast<float>(next() >> 8) * (1.f / (1 << 24)); }
+    float uniform(float lo, float hi) { return lo + (hi - lo) * uniform(); }
+
+private:
+    uint64_t m_state = 0;
+    const uint64_t m_increment;
+};
+
+enum class SizeDistribution : uint8_t
+{
+    Skewed,  // Radii of 10-30% of the half-canvas, mostly small.
+    Uniform, // Radii of 10-30% of the half-canvas, evenly spread.
+    Fixed,   // Every radius 10% of the half-canvas.
+};
+
+enum class SpeedDistribution : uint8_t
+{
+    Default, // Up to 1% of the half-canvas per step, on each axis.
+    Still,
+    Fast, // 4x Default.
+};
+
+enum class ColorDistribution : uint8_t
+{
+    Pastel, // Channels of .5-1.
+    Full,   // Channels of 0-1.
+    Gray,
+};
+
+// Everything that determines a generated scene, besides its size.
+struct SceneParams
+{
+    uint64_t seed = 1;
+    SizeDistribution sizes = SizeDistribution::Skewed;
+    SpeedDistribution speeds = SpeedDistribution::Default;
+    ColorDistribution colors = ColorDistribution::Pastel;
+};
+
+// Makes one bubble for a 2048 x 2048 canvas. Only uses arithmetic that IEEE floats round the same
+// everywhere (no powf()), so a seed gives the same scene on every platform. That relies on the
+// build not contracting a * b + c into an FMA (-ffp-contract=off, /fp:precise).
+static inline Bubble make_scene_bubble(PCG32& rng, const SceneParams& params)
+{
+    Bubble bubble;
+    float u = rng.uniform();
+    float r;
+    switch (params.sizes)
+    {
+        case SizeDistribution::Skewed:
+            r = .1f + .2f * (u * u * u * u);
+            break;
+        case SizeDistribution::Uniform:
+            r = .1f + .2f * u;
+            break;
+        case SizeDistribution::Fixed:
+        default:
+            r = .1f;
+            break;
+    }
+    bubble.x = (rng.uniform(-1 + r, 1 - r) + 1) * 1024.f;
+    bubble.y = (rng.uniform(-1 + r, 1 - r) + 1) * 1024.f;
+    bubble.r = r * 1024.f;
+    float speedScale = params.speeds == SpeedDistribution::Still  ? 0
+                       : params.speeds == SpeedDistribution::Fast ? 4
+                                                                  : 1;
+    bubble.dx = (rng.uniform() - .5f) * .02f * 1024.f * speedScale;
+    bubble.dy = (rng.uniform() - .5f) * .02f * 1024.f * speedScale;
+    float lo = params.colors == ColorDistribution::Full ? 0 : .5f;
+    bubble.color = {rng.uniform(lo, 1),
+                    rng.uniform(lo, 1),
+                    rng.uniform(lo, 1),
+                    rng.uniform(.75f, 1)};
+    if (params.colors == ColorDistribution::Gray)
+    {
+        bubble.color[1] = bubble.color[2] = bubble.color[0];
+    }
+    return bubble;
+}
+
+template <BubbleLayout L>
+static void generate_scene(BubbleStore<L>& bubbles, size_t n, const SceneParams& params)
+{
+    PCG32 rng(params.seed);
+    bubbles.resize(n);
+    for (size_t i = 0; i < n; ++i)
+    {
+        bubbles.set(i, make_scene_bubble(rng, params));
+    }
+}
+
+// Scene files are a 64-byte header followed by 'count' Bubbles, exactly as the instance buffer
+// holds them (little-endian IEEE floats), so the records can be read or mapped straight into an
+// upload.
+constexpr static char kSceneFileMagic[8] = {'B', 'U', 'B', 'S', 'C', 'E', 'N', 'E'};
+constexpr static uint32_t kSceneFileVersion = 1;
+
+struct SceneFileHeader
+{
+    char magic[8];
+    uint32_t version;
+    uint32_t recordSize; // sizeof(Bubble); records of any other size are rejected.
+    uint64_t count;
+    // How the scene was generated, for reference; loading doesn't depend on them.
+    uint64_t seed;
+    uint8_t sizes, speeds, colors;
+    uint8_t reserved[29];
+};
+static_assert(sizeof(SceneFileHeader) == 64, "scene records start 64 bytes into the file");
+
+// save_scene() writes bubbles this many at a time.
+constexpr static size_t kSceneFileChunk = 1 << 16;
+
+template <BubbleLayout L>
+static bool save_scene(const char* path, const BubbleStore<L>& bubbles, const SceneParams& params)
+{
+    FILE* file = fopen(path, "wb");
+    if (!file)
+    {
+        fprintf(stderr, "Failed to open %s for writing.\n", path);
+        return false;
+    }
+    SceneFileHeader header = {};
+    memcpy(header.magic, kSceneFileMagic, sizeof(header.magic));
+    header.version = kSceneFileVersion;
+    header.recordSize = sizeof(Bubble);
+    header.count = bubbles.size();
+    header.seed = params.seed;
+    header.sizes = static_cast<uint8_t>(params.sizes);
+    header.speeds = static_cast<uint8_t>(params.speeds);
+    header.colors = static_cast<uint8_t>(params.colors);
+    bool success = fwrite(&header, sizeof(header), 1, file) == 1;
+    std::vector<Bubble> chunk(std::min(bubbles.size(), kSceneFileChunk));
+    for (size_t first = 0; success && first < bubbles.size(); first += chunk.size())
+    {
+        size_t count = std::min(chunk.size(), bubbles.size() - first);
+        bubbles.exportInterleaved(chunk.data(), first, count);
+        success = fwrite(chunk.data(), sizeof(Bubble), count, file) == count;
+    }
+    success = fclose(file) == 0 && success;
+    if (!success)
+    {
+        fprintf(stderr, "Failed to write %s.\n", path);
+    }
+    return success;
+}
+
+// Returns whether 'header' describes a scene this build can load, after printing why not.
+static inline bool validate_scene_header(const char* path, const SceneFileHeader& header)
+{
+    if (memcmp(header.magic, kSceneFileMagic, sizeof(header.magic)))
+    {
+        fprintf(stderr, "%s is not a scene file.\n", path);
+        return false;
+    }
+    if (header.version != kSceneFileVersion || header.recordSize != sizeof(Bubble))
+    {
+        fprintf(stderr,
+                "%s is a version %u scene with %u-byte records; expected version %u with %zu.\n",
+                path,
+                header.version,
+                header.recordSize,
+                kSceneFileVersion,
+                sizeof(Bubble));
+        return false;
+    }
+    return true;
+}
+
+// A read-only mapping of a whole file.
+class MappedFile
+{
+public:
+    // Returns null, after printing why, if the file can't be opened or mapped.
+    static std::unique_ptr<MappedFile> Open(const char* path)
+    {
+#ifdef _WIN32
+        HANDLE file = CreateFileA(path,
+                                  GENERIC_READ,
+                                  FILE_SHARE_READ,
+                                  nullptr,
+                                  OPEN_EXISTING,
+                                  FILE_FLAG_SEQUENTIAL_SCAN,
+                                  nullptr);
+        LARGE_INTEGER size = {};
+        if (file == INVALID_HANDLE_VALUE || !GetFileSizeEx(file, &size) || size.QuadPart == 0)
+        {
+            fprintf(stderr, "Failed to open %s.\n", path);
+            if (file != INVALID_HANDLE_VALUE)
+            {
+                CloseHandle(file);
+            }
+            return nullptr;
+        }
+        HANDLE mapping = CreateFileMappingA(file, nullptr, PAGE_READONLY, 0, 0, nullptr);
+        void* data = mapping ? MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0) : nullptr;
+        // The view keeps the file mapped.
+        if (mapping)
+        {
+            CloseHandle(mapping);
+        }
+        CloseHandle(file);
+        if (!data)
+        {
+            fprintf(stderr, "Failed to map %s.\n", path);
+            return nullptr;
+        }
+        return std::unique_ptr<MappedFile>(
+            new MappedFile(data, static_cast<size_t>(size.QuadPart)));
+#else
+        int fd = open(path, O_RDONLY);
+        struct stat info;
+        if (fd < 0 || fstat(fd, &info) != 0 || info.st_size == 0)
+        {
+            fprintf(stderr, "Failed to open %s.\n", path);
+            if (fd >= 0)
+            {
+                close(fd);
+            }
+            return nullptr;
+        }
+        size_t size = static_cast<size_t>(info.st_size);
+        void* data = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+        // The mapping keeps the file open.
+        close(fd);
+        if (data == MAP_FAILED)
+        {
+            fprintf(stderr, "Failed to map %s.\n", path);
+            return nullptr;
+        }
+        // Files are read front to back, once: read ahead aggressively.
+        madvise(data, size, MADV_SEQUENTIAL);
+        return std::unique_ptr<MappedFile>(new MappedFile(data, size));
+#endif
+    }
+
+    ~MappedFile()
+    {
+#ifdef _WIN32
+        UnmapViewOfFile(m_data);
+#else
+        munmap(m_data, m_size);
+#endif
+    }
+
+    MappedFile(const MappedFile&) = delete;
+    MappedFile& operator=(const MappedFile&) = delete;
+
+    const uint8_t* data() const { return static_cast<const uint8_t*>(m_data); }
+    size_t size() const { return m_size; }
+
+private:
+    MappedFile(void* data, size_t size) : m_data(data), m_size(size) {}
+
+    void* const m_data;
+    const size_t m_size;
+};
+
+// A scene file, mapped rather than read. Its records are laid out as the instance buffer expects,
+// so uploads can read straight from the mapping, and pages only get read from disk as something
+// (the driver, or copyTo()) touches them.
+class MappedScene
+{
+public:
+    // Returns null, after printing why, if 'path' isn't a scene this build can load.
+    static std::unique_ptr<MappedScene> Open(const char* path)
+    {
+        std::unique_ptr<MappedFile> file = MappedFile::Open(path);
+        if (!file)
+        {
+            return nullptr;
+        }
+        SceneFileHeader header;
+        if (file->size() < sizeof(header))
+        {
+            fprintf(stderr, "%s is not a scene file.\n", path);
+            return nullptr;
+        }
+        memcpy(&header, file->data(), sizeof(header));
+        if (!validate_scene_header(path, header))
+        {
+            return nullptr;
+        }
+        if ((file->size() - sizeof(header)) / sizeof(Bubble) < header.count)
+        {
+            fprintf(stderr, "%s is truncated.\n", path);
+            return nullptr;
+        }
+        return std::unique_ptr<MappedScene>(new MappedScene(std::move(file), header));
+    }
+
+    size_t count() const { return static_cast<size_t>(m_header.count); }
+
+    // The records: 'count' Bubbles. 64 bytes into a page-aligned mapping, so they are aligned.
+    const Bubble* bubbles() const
+    {
+        return reinterpret_cast<const Bubble*>(m_file->data() + sizeof(SceneFileHeader));
+    }
+
+    SceneParams params() const
+    {
+        SceneParams params;
+        params.seed = m_header.seed;
+        params.sizes = static_cast<SizeDistribution>(m_header.sizes);
+        params.speeds = static_cast<SpeedDistribution>(m_header.speeds);
+        params.colors = static_cast<ColorDistribution>(m_header.colors);
+        return params;
+    }
+
+    // Replaces 'store' with the scene.
+    template <BubbleLayout L> void copyTo(BubbleStore<L>& store) const
+    {
+        store.resize(count());
+        const Bubble* records = bubbles();
+        for (size_t i = 0; i < count(); ++i)
+        {
+            store.set(i, records[i]);
+        }
+    }
+
+private:
+    MappedScene(std::unique_ptr<MappedFile> file, const SceneFileHeader& header) :
+        m_file(std::move(file)), m_header(header)
+    {}
+
+    std::unique_ptr<MappedFile> m_file;
+    const SceneFileHeader m_header;
+};
@@ -0,0 +1,447 @@
+/*
+ * Copyright 2022 Rive
+ */
+
+#pragma once
+
+#include "glad/glad.h"
+#include "cpu_raster.hpp"
+#include "gl_program.hpp"
+#include "gl_worker.hpp"
+#include "instance_fetch.hpp"
+#include <array>
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <utility>
+
+// The bubble draw program comes in variants, one per combination of features: a blend mode, an
+// instance fetch path, and the flag bits below. Each variant's GLSL is assembled at compile time
+// from the fragments below, so every combination exists in the binary as a plain string, but
+// only the ones that get requested are ever compiled.
+constexpr static uint32_t kVariantAntialias = 1 << 0;
+// Instances hold a start position and a speed, and the vertex shader moves them in closed form by
+// T. Without this flag, instances already hold their current positions (the simulations).
+constexpr static uint32_t kVariantClosedForm = 1 << 1;
+// highp instead of mediump floats in the fragment shader.
+constexpr static uint32_t kVariantHighpFragment = 1 << 2;
+// Instances are PackedBubbles instead of Bubbles.
+constexpr static uint32_t kVariantPacked = 1 << 3;
+constexpr static uint32_t kNumVariantFlagCombinations = 1 << 4;
+// Variants are numbered flags + combinations * (fetch + 3 * blend). Overwrite stores straight to
+// the image, like the CPU raster's Overwrite; SrcOver and Additive write a color output and use
+// fixed-function blending.
+constexpr static uint32_t kNumShaderVariants = kNumVariantFlagCombinations * 3 * 3;
+
+constexpr static uint32_t shader_variant(BlendMode blendMode, InstanceFetch fetch, uint32_t flags)
+{
+    return flags + kNumVariantFlagCombinations *
+                       (static_cast<uint32_t>(fetch) + 3 * static_cast<uint32_t>(blendMode));
+}
+
+constexpr static uint32_t shader_variant_flags(uint32_t variant)
+{
+    return variant % kNumVariantFlagCombinations;
+}
+
+constexpr static InstanceFetch shader_variant_fetch(uint32_t variant)
+{
+    return static_cast<InstanceFetch>(variant / kNumVariantFlagCombinations % 3);
+}
+
+constexpr static BlendMode shader_variant_blend_mode(uint32_t variant)
+{
+    return static_cast<BlendMode>(variant / kNumVariantFlagCombinations / 3);
+}
+
+static inline std::string shader_variant_name(uint32_t variant)
+{
+    const char* fetchNames[] = {" attribs", " ssbo", " tbo"};
+    std::string name = blend_mode_name(shader_variant_blend_mode(variant));
+    name += fetchNames[static_cast<int>(shader_variant_fetch(variant))];
+    name += variant & kVariantPacked ? " packed" : "";
+    name += variant & kVariantAntialias ? " aa" : " no-aa";
+    name += variant & kVariantClosedForm ? " closed-form" : " static";
+    name += variant & kVariantHighpFragment ? " highp" : " mediump";
+    return name;
+}
+
+// A NUL-terminated string of length N that can be built and concatenated in constant
+// expressions.
+template <size_t N> struct GLSLSource
+{
+    char str[N + 1] = {};
+};
+
+template <size_t N> constexpr GLSLSource<N - 1> glsl(const char (&str)[N])
+{
+    GLSLSource<N - 1> source;
+    for (size_t i = 0; i < N - 1; ++i)
+    {
+        source.str[i] = str[i];
+    }
+    return source;
+}
+
+template <size_t A, size_t B>
+constexpr GLSLSource<A + B> operator+(const GLSLSource<A>& a, const GLSLSource<B>& b)
+{
+    GLSLSource<A + B> source;
+    for (size_t i = 0; i < A; ++i)
+    {
+        source.str[i] = a.str[i];
+    }
+    for (size_t i = 0; i < B; ++i)
+    {
+        source.str[A + i] = b.str[i];
+    }
+    return source;
+}
+
+namespace shader_fragments
+{
+constexpr static char version[] = "#version 310 es\n";
+
+constexpr static char vs_texture_buffer_extension[] =
+    "#extension GL_EXT_texture_buffer : require\n";
+
+// Laid out like DrawGlobals.
+constexpr static char vs_interface[] = R"(precision highp float;
+layout(std140, binding=0) uniform Globals {
+    vec2 window;
+    float T;
+    int instanceBase;
+    int instanceStride;
+};
+out vec2 coord;
+out vec4 color;
+)";
+
+constexpr static char vs_fetch_attribs[] = R"(layout(location=0) in vec3 inbubble;
+layout(location=1) in vec2 inspeed;
+layout(location=2) in vec4 incolor;
+void load_instance(out vec3 bubble, out vec2 speed, out vec4 bubbleColor) {
+    bubble = inbubble;
+    speed = inspeed;
+    bubbleColor = incolor;
+}
+)";
+
+constexpr static char vs_fetch_ssbo[] = R"(layout(std430, binding=0) readonly buffer Instances {
+    uint words[];
+};
+uint instance_word(int i) {
+    return words[i];
+}
+)";
+
+// The binding is InstanceFetcher::kTextureBufferUnit.
+constexpr static char vs_fetch_tbo[] = R"(layout(binding=1) uniform highp usamplerBuffer instances;
+uint instance_word(int i) {
+    return texelFetch(instances, i).r;
+}
+)";
+
+// Decodes a Bubble, or the Bubble that a struct starts with.
+constexpr static char vs_decode_bubble[] = R"(float instance_float(int i) {
+    return uintBitsToFloat(instance_word(i));
+}
+void load_instance(out vec3 bubble, out vec2 speed, out vec4 bubbleColor) {
+    int i = instanceBase + gl_InstanceID * instanceStride;
+    bubble = vec3(instance_float(i), instance_float(i + 1), instance_float(i + 2));
+    speed = vec2(instance_float(i + 3), instance_float(i + 4));
+    bubbleColor = vec4(instance_float(i + 5), instance_float(i + 6),
+                       instance_float(i + 7), instance_float(i + 8));
+}
+)";
+
+// Decodes a PackedBubble.
+constexpr static char vs_decode_packed_bubble[] = R"(float instance_float(int i) {
+    return uintBitsToFloat(instance_word(i));
+}
+void load_instance(out vec3 bubble, out vec2 speed, out vec4 bubbleColor) {
+    int i = instanceBase + gl_InstanceID * instanceStride;
+    bubble = vec3(instance_float(i), instance_float(i + 1), instance_float(i + 2));
+    speed = unpackHalf2x16(instance_word(i + 3));
+    bubbleColor = unpackUnorm4x8(instance_word(i + 4));
+}
+)";
+
+constexpr static char vs_closed_form_center[] = R"(vec2 bubble_center(vec3 bubble, vec2 speed) {
+    float r = bubble.z;
+    vec2 center = bubble.xy + speed * T;
+    vec2 span = window - 2.0 * r;
+    return span - abs(span - mod(center - r, span * 2.0)) + r;
+}
+)";
+
+constexpr static char vs_static_center[] = R"(vec2 bubble_center(vec3 bubble, vec2 speed) {
+    return bubble.xy;
+}
+)";
+
+constexpr static char vs_main[] = R"(void main() {
+    vec3 bubble;
+    vec2 speed;
+    vec4 bubbleColor;
+    load_instance(bubble, speed, bubbleColor);
+    vec2 offset = vec2((gl_VertexID & 1) == 0 ? -1.0 : 1.0, (gl_VertexID & 2) == 0 ? -1.0 : 1.0);
+    coord = offset;
+    color = bubbleColor;
+    float r = bubble.z;
+    vec2 center = bubble_center(bubble, speed);
+    gl_Position.xy = (center + offset * r) * 2.0 / window - 1.0;
+    gl_Position.zw = vec2(0, 1);
+})";
+
+constexpr static char fs_mediump[] = "precision mediump float;\n";
+constexpr static char fs_highp[] = "precision highp float;\n";
+
+constexpr static char fs_interface[] = R"(in vec2 coord;
+in vec4 color;
+)";
+
+// 'f' is the circle's implicit function, negative inside.
+constexpr static char fs_coverage_aa[] = R"(float coverage(float f) {
+    return clamp(.5 - f/fwidth(f), 0.0, 1.0);
+}
+)";
+
+constexpr static char fs_coverage_aliased[] = R"(float coverage(float f) {
+    return f <= 0.0 ? 1.0 : 0.0;
+}
+)";
+
+constexpr static char fs_write_image[] =
+    R"(layout(binding=0, r32ui) uniform highp coherent writeonly uimage2D framebuffer;
+void write_color(vec4 s) {
+    imageStore(framebuffer, ivec2(floor(gl_FragCoord.xy)), uvec4(packUnorm4x8(s)));
+}
+)";
+
+constexpr static char fs_write_output[] = R"(layout(location=0) out vec4 fragColor;
+void write_color(vec4 s) {
+    fragColor = s;
+}
+)";
+
+constexpr static char fs_main[] = R"(void main() {
+    float f = coord.x * coord.x + coord.y * coord.y - 1.0;
+    vec4 s = vec4(color.rgb, 1) * (color.a * mix(.25, 1.0, dot(coord, coord)) * coverage(f));
+    write_color(s);
+})";
+} // namespace shader_fragments
+
+template <uint32_t Variant> constexpr auto vertex_shader_header()
+{
+    using namespace shader_fragments;
+    if constexpr (shader_variant_fetch(Variant) == InstanceFetch::TBO)
+    {
+        return glsl(version) + glsl(vs_texture_buffer_extension) + glsl(vs_interface);
+    }
+    else
+    {
+        return glsl(version) + glsl(vs_interface);
+    }
+}
+
+template <uint32_t Variant> constexpr auto vertex_shader_fetch()
+{
+    using namespace shader_fragments;
+    constexpr InstanceFetch fetch = shader_variant_fetch(Variant);
+    constexpr bool packed = (Variant & kVariantPacked) != 0;
+    if constexpr (fetch == InstanceFetch::Attribs)
+    {
+        // The attribute pointers unpack PackedBubbles.
+        return glsl(vs_fetch_attribs);
+    }
+    else if constexpr (fetch == InstanceFetch::SSBO && packed)
+    {
+        return glsl(vs_fetch_ssbo) + glsl(vs_decode_packed_bubble);
+    }
+    else if constexpr (fetch == InstanceFetch::SSBO)
+    {
+        return glsl(vs_fetch_ssbo) + glsl(vs_decode_bubble);
+    }
+    else if constexpr (packed)
+    {
+        return glsl(vs_fetch_tbo) + glsl(vs_decode_packed_bubble);
+    }
+    else
+    {
+        return glsl(vs_fetch_tbo) + glsl(vs_decode_bubble);
+    }
+}
+
+template <uint32_t Variant> constexpr auto vertex_shader_center()
+{
+    using namespace shader_fragments;
+    if constexpr ((Variant & kVariantClosedForm) != 0)
+    {
+        return glsl(vs_closed_form_center);
+    }
+    else
+    {
+        return glsl(vs_static_center);
+    }
+}
+
+template <uint32_t Variant> constexpr auto vertex_shader_source()
+{
+    using namespace shader_fragments;
+    return vertex_shader_header<Variant>() + vertex_shader_fetch<Variant>() +
+           vertex_shader_center<Variant>() + glsl(vs_main);
+}
+
+template <uint32_t Variant> constexpr auto fragment_shader_coverage()
+{
+    using namespace shader_fragments;
+    if constexpr ((Variant & kVariantAntialias) != 0)
+    {
+        return glsl(fs_coverage_aa);
+    }
+    else
+    {
+        return glsl(fs_coverage_aliased);
+    }
+}
+
+template <uint32_t Variant> constexpr auto fragment_shader_precision()
+{
+    using namespace shader_fragments;
+    if constexpr ((Variant & kVariantHighpFragment) != 0)
+    {
+        return glsl(fs_highp);
+    }
+    else
+    {
+        return glsl(fs_mediump);
+    }
+}
+
+template <uint32_t Variant> constexpr auto fragment_shader_output()
+{
+    using namespace shader_fragments;
+    if constexpr (shader_variant_blend_mode(Variant) == BlendMode::Overwrite)
+    {
+        return glsl(fs_write_image);
+    }
+    else
+    {
+        return glsl(fs_write_output);
+    }
+}
+
+template <uint32_t Variant> constexpr auto fragment_shader_source()
+{
+    using namespace shader_fragments;
+    return glsl(version) + fragment_shader_precision<Variant>() + glsl(fs_interface) +
+           fragment_shader_coverage<Variant>() + fragment_shader_output<Variant>() + glsl(fs_main);
+}
+
+template <uint32_t Variant> struct ShaderVariantSources
+{
+    constexpr static auto vs = vertex_shader_source<Variant>();
+    constexpr static auto fs = fragment_shader_source<Variant>();
+};
+
+struct ShaderSourcePair
+{
+    const char* vs;
+    const char* fs;
+};
+
+template <size_t... Variants>
+constexpr std::array<ShaderSourcePair, sizeof...(Variants)>
+make_shader_variant_table(std::index_sequence<Variants...>)
+{
+    return {{{ShaderVariantSources<Variants>::vs.str, ShaderVariantSources<Variants>::fs.str}...}};
+}
+
+// The vertex and fragment source of every variant, indexed by feature bits.
+constexpr static std::array<ShaderSourcePair, kNumShaderVariants> kShaderVariantSources =
+    make_shader_variant_table(std::make_index_sequence<kNumShaderVariants>());
+
+// Builds variants of the draw program on first request and keeps the linked programs for the rest
+// of the run, so switching back to a variant is free. Builds go through the driver's compiler
+// threads with GL_KHR_parallel_shader_compile, and otherwise through 'worker', so requesting a
+// variant never blocks; only get() does, if the variant isn't ready yet.
+class ShaderVariantCache
+{
+public:
+    explicit ShaderVariantCache(GLWorker* worker) : m_worker(worker) {}
+
+    ~ShaderVariantCache()
+    {
+        for (Entry& entry : m_entries)
+        {
+            if (entry.job)
+            {
+                entry.job->wait();
+            }
+            glDeleteProgram(entry.program);
+        }
+    }
+
+    ShaderVariantCache(const ShaderVariantCache&) = delete;
+    ShaderVariantCache& operator=(const ShaderVariantCache&) = delete;
+
+    // Starts building 'variant', unless it already has been.
+    void request(uint32_t variant)
+    {
+        Entry& entry = m_entries[variant];
+        if (entry.requested)
+        {
+            return;
+        }
+        entry.requested = true;
+        const ShaderSourcePair& sources = kShaderVariantSources[variant];
+        if (g_parallelShaderCompile || !m_worker)
+        {
+            entry.pending = PendingProgram({{GL_VERTEX_SHADER, sources.vs},
+                                            {GL_FRAGMENT_SHADER, sources.fs}});
+        }
+        else
+        {
+            entry.job = compile_program_async(*m_worker, sources.vs, sources.fs, &entry.program);
+        }
+    }
+
+    // Requests 'variant' and returns whether get() would return without blocking.
+    bool isReady(uint32_t variant)
+    {
+        request(variant);
+        Entry& entry = m_entries[variant];
+        return entry.job ? entry.job->ready() : entry.pending.isReady();
+    }
+
+    // Returns the linked program for 'variant', or 0 if it failed to build, blocking until it is
+    // built.
+    GLuint get(uint32_t variant)
+    {
+        request(variant);
+        Entry& entry = m_entries[variant];
+        if (entry.job)
+        {
+            entry.job->wait();
+            entry.job = nullptr;
+        }
+        else if (entry.pending.isPending())
+        {
+            entry.program = entry.pending.finish();
+        }
+        return entry.program;
+    }
+
+private:
+    struct Entry
+    {
+        bool requested = false;
+        PendingProgram pending;
+        std::shared_ptr<GLWorker::Job> job;
+        GLuint program = 0;
+    };
+
+    GLWorker* const m_worker;
+    std::array<Entry, kNumShaderVariants> m_entries;
+};
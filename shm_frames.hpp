@@ -0,0 +1,275 @@
+/*
+ * Copyright 2022 Rive
+ */
+
+#pragma once
+
+// A ring of frames in POSIX shared memory, which other local processes map and read in place: no
+// pipe, file or compositor in between. One writer publishes frames; any number of readers poll for
+// the newest one. Each slot has a seqlock, so a reader can tell if the writer lapped it and
+// overwrote the slot while it was reading.
+//
+// Layout: a ShmFrameRingHeader, numSlots ShmFrameSlots, then (page aligned) numSlots pixel
+// buffers of slotBytes each. Pixels are RGBA8, top row first.
+
+#ifndef _WIN32
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <memory>
+#include <string>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+static_assert(std::atomic<uint64_t>::is_always_lock_free,
+              "shared memory rings need address-free atomics");
+
+constexpr static char kShmFrameMagic[8] = {'B', 'U', 'B', 'F', 'R', 'A', 'M', 'E'};
+constexpr static uint32_t kShmFrameVersion = 1;
+
+struct ShmFrameRingHeader
+{
+    char magic[8];
+    uint32_t version;
+    uint32_t numSlots;
+    uint64_t slotBytes;    // Room for pixels in each slot.
+    uint64_t pixelsOffset; // From the start of the mapping to slot 0's pixels.
+    // Frames published so far. The newest is in slot (published - 1) % numSlots.
+    std::atomic<uint64_t> published;
+    uint8_t reserved[24];
+};
+static_assert(sizeof(ShmFrameRingHeader) == 64, "");
+
+struct ShmFrameSlot
+{
+    // Odd while the writer is in the slot; bumped twice per frame written.
+    std::atomic<uint64_t> sequence;
+    std::atomic<uint64_t> frameIndex;
+    std::atomic<uint32_t> width;
+    std::atomic<uint32_t> height;
+    uint8_t reserved[40];
+};
+static_assert(sizeof(ShmFrameSlot) == 64, "");
+
+// Shared memory names are "/name"; the slash is optional here.
+static inline std::string shm_frame_ring_name(const char* name)
+{
+    return name[0] == '/' ? name : std::string("/") + name;
+}
+
+// Owns the shared memory object, which it creates, and unlinks again when destroyed.
+class ShmFrameWriter
+{
+public:
+    constexpr static uint32_t kDefaultSlots = 4;
+
+    // Returns null, after printing why, if the object can't be created.
+    static std::unique_ptr<ShmFrameWriter> Create(const char* name,
+                                                  uint64_t slotBytes,
+                                                  uint32_t numSlots = kDefaultSlots)
+    {
+        std::string shmName = shm_frame_ring_name(name);
+        // Start from a fresh object, so readers of a previous ring never see this one's layout.
+        shm_unlink(shmName.c_str());
+        int fd = shm_open(shmName.c_str(), O_CREAT | O_EXCL | O_RDWR, 0600);
+        size_t pageSize = static_cast<size_t>(sysconf(_SC_PAGESIZE));
+        size_t headerBytes = sizeof(ShmFrameRingHeader) + numSlots * sizeof(ShmFrameSlot);
+        uint64_t pixelsOffset = (headerBytes + pageSize - 1) / pageSize * pageSize;
+        size_t size = static_cast<size_t>(pixelsOffset + numSlots * slotBytes);
+        void* data = MAP_FAILED;
+        if (fd >= 0 && ftruncate(fd, static_cast<off_t>(size)) == 0)
+        {
+            data = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+        }
+        if (fd >= 0)
+        {
+            close(fd);
+        }
+        if (data == MAP_FAILED)
+        {
+            fprintf(stderr, "Failed to create shared memory %s.\n", shmName.c_str());
+            shm_unlink(shmName.c_str());
+            return nullptr;
+        }
+        // ftruncate() zeroed everything, so the slots' sequences start out even.
+        auto* header = static_cast<ShmFrameRingHeader*>(data);
+        header->version = kShmFrameVersion;
+        header->numSlots = numSlots;
+        header->slotBytes = slotBytes;
+        header->pixelsOffset = pixelsOffset;
+        header->published.store(0, std::memory_order_relaxed);
+        // Readers check the magic last.
+        std::atomic_thread_fence(std::memory_order_release);
+        memcpy(header->magic, kShmFrameMagic, sizeof(header->magic));
+        return std::unique_ptr<ShmFrameWriter>(new ShmFrameWriter(shmName, data, size));
+    }
+
+    ~ShmFrameWriter()
+    {
+        munmap(m_data, m_size);
+        shm_unlink(m_name.c_str());
+    }
+
+    ShmFrameWriter(const ShmFrameWriter&) = delete;
+    ShmFrameWriter& operator=(const ShmFrameWriter&) = delete;
+
+    uint64_t slotBytes() const { return header()->slotBytes; }
+
+    // Publishes a frame of RGBA8 pixels, rowStride bytes apart, starting from 'firstRow' and
+    // stepping by rowStride (negative to flip). Returns false if it doesn't fit in a slot.
+    bool publish(const uint8_t* firstRow,
+                 ptrdiff_t rowStride,
+                 uint32_t width,
+                 uint32_t height,
+                 uint64_t frameIndex)
+    {
+        size_t rowBytes = static_cast<size_t>(width) * 4;
+        if (rowBytes * height > header()->slotBytes)
+        {
+            return false;
+        }
+        uint64_t published = header()->published.load(std::memory_order_relaxed);
+        uint32_t slotIndex = static_cast<uint32_t>(published % header()->numSlots);
+        ShmFrameSlot& slot = slots()[slotIndex];
+        uint64_t sequence = slot.sequence.load(std::memory_order_relaxed);
+        slot.sequence.store(sequence + 1, std::memory_order_relaxed);
+        // Nothing below may become visible before the odd sequence.
+        std::atomic_thread_fence(std::memory_order_release);
+        slot.frameIndex.store(frameIndex, std::memory_order_relaxed);
+        slot.width.store(width, std::memory_order_relaxed);
+        slot.height.store(height, std::memory_order_relaxed);
+        uint8_t* dst = pixels(slotIndex);
+        for (uint32_t y = 0; y < height; ++y)
+        {
+            memcpy(dst + y * rowBytes, firstRow + static_cast<ptrdiff_t>(y) * rowStride, rowBytes);
+        }
+        slot.sequence.store(sequence + 2, std::memory_order_release);
+        header()->published.store(published + 1, std::memory_order_release);
+        return true;
+    }
+
+private:
+    ShmFrameWriter(std::string name, void* data, size_t size) :
+        m_name(std::move(name)), m_data(data), m_size(size)
+    {}
+
+    ShmFrameRingHeader* header() const { return static_cast<ShmFrameRingHeader*>(m_data); }
+    ShmFrameSlot* slots() const { return reinterpret_cast<ShmFrameSlot*>(header() + 1); }
+    uint8_t* pixels(uint32_t slot) const
+    {
+        return static_cast<uint8_t*>(m_data) + header()->pixelsOffset + slot * header()->slotBytes;
+    }
+
+    const std::string m_name;
+    void* const m_data;
+    const size_t m_size;
+};
+
+// Maps a ring that a ShmFrameWriter (in any process) created, read-only.
+class ShmFrameReader
+{
+public:
+    // Returns null if there is no such ring yet, or it isn't one. Prints nothing, so callers can
+    // poll until the writer shows up.
+    static std::unique_ptr<ShmFrameReader> Open(const char* name)
+    {
+        std::string shmName = shm_frame_ring_name(name);
+        int fd = shm_open(shmName.c_str(), O_RDONLY, 0);
+        if (fd < 0)
+        {
+            return nullptr;
+        }
+        struct stat info;
+        void* data = MAP_FAILED;
+        size_t size = 0;
+        if (fstat(fd, &info) == 0 && info.st_size >= static_cast<off_t>(sizeof(ShmFrameRingHeader)))
+        {
+            size = static_cast<size_t>(info.st_size);
+            data = mmap(nullptr, size, PROT_READ, MAP_SHARED, fd, 0);
+        }
+        close(fd);
+        if (data == MAP_FAILED)
+        {
+            return nullptr;
+        }
+        std::unique_ptr<ShmFrameReader> reader(new ShmFrameReader(data, size));
+        const ShmFrameRingHeader* header = reader->header();
+        if (memcmp(header->magic, kShmFrameMagic, sizeof(header->magic)))
+        {
+            return nullptr;
+        }
+        std::atomic_thread_fence(std::memory_order_acquire);
+        if (header->version != kShmFrameVersion || header->numSlots == 0 ||
+            header->pixelsOffset + header->numSlots * header->slotBytes > size)
+        {
+            return nullptr;
+        }
+        return reader;
+    }
+
+    ~ShmFrameReader() { munmap(m_data, m_size); }
+
+    ShmFrameReader(const ShmFrameReader&) = delete;
+    ShmFrameReader& operator=(const ShmFrameReader&) = delete;
+
+    // Frames the writer has published so far.
+    uint64_t published() const { return header()->published.load(std::memory_order_acquire); }
+
+    // Calls fn(pixels, width, height, frameIndex) on the newest frame, in place in shared memory.
+    // Returns false if there is no frame yet, the writer is in the slot, or the writer came back
+    // to the slot while fn() was reading it; then whatever fn() made of the pixels is garbage and
+    // should be thrown away.
+    template <typename Fn> bool readLatest(Fn&& fn) const
+    {
+        uint64_t published = this->published();
+        if (published == 0)
+        {
+            return false;
+        }
+        uint32_t slotIndex = static_cast<uint32_t>((published - 1) % header()->numSlots);
+        const ShmFrameSlot& slot = slots()[slotIndex];
+        uint64_t sequence = slot.sequence.load(std::memory_order_acquire);
+        if (sequence & 1)
+        {
+            return false;
+        }
+        uint32_t width = slot.width.load(std::memory_order_relaxed);
+        uint32_t height = slot.height.load(std::memory_order_relaxed);
+        uint64_t frameIndex = slot.frameIndex.load(std::memory_order_relaxed);
+        if (static_cast<uint64_t>(width) * height * 4 > header()->slotBytes)
+        {
+            return false;
+        }
+        fn(pixels(slotIndex), width, height, frameIndex);
+        // The reads above must complete before the sequence is checked again.
+        std::atomic_thread_fence(std::memory_order_acquire);
+        return slot.sequence.load(std::memory_order_relaxed) == sequence;
+    }
+
+private:
+    ShmFrameReader(void* data, size_t size) : m_data(data), m_size(size) {}
+
+    const ShmFrameRingHeader* header() const
+    {
+        return static_cast<const ShmFrameRingHeader*>(m_data);
+    }
+    const ShmFrameSlot* slots() const
+    {
+        return reinterpret_cast<const ShmFrameSlot*>(header() + 1);
+    }
+    const uint8_t* pixels(uint32_t slot) const
+    {
+        return static_cast<const uint8_t*>(m_data) + header()->pixelsOffset +
+               slot * header()->slotBytes;
+    }
+
+    void* const m_data;
+    const size_t m_size;
+};
+
+#endif
@@ -0,0 +1,84 @@
+/*
+ * Copyright 2022 Rive
+ */
+
+#pragma once
+
+#include <chrono>
+#include <cstdint>
+
+// Fixed-timestep simulation time, decoupled from the frame rate. One step is a reference frame
+// at 60 Hz, the unit bubble speeds are expressed in. Wall-clock time accumulates in double
+// precision and is consumed in whole steps; T() adds the leftover fraction so closed-form motion
+// can render between steps.
+//
+// In deterministic mode every advance() is exactly one step, regardless of the wall clock, so
+// frame N always shows the same scene.
+class SimClock
+{
+public:
+    constexpr static double kStepSeconds = 1 / 60.0;
+    // A frame that takes longer than this many steps drops the excess instead of trying to catch
+    // up, which would only make the next frame slower still.
+    constexpr static int kMaxStepsPerFrame = 8;
+    // How far T may get from the motion's base time before rebasing, so "vs" only ever sees a
+    // float T in [0, kRebaseInterval + kMaxStepsPerFrame).
+    constexpr static int64_t kRebaseInterval = 1024;
+
+    explicit SimClock(bool deterministic = false) : m_deterministic(deterministic) {}
+
+    bool deterministic() const { return m_deterministic; }
+
+    // Advances to wall-clock time 'seconds' and returns the number of whole steps taken. The
+    // first call only starts the clock.
+    int advance(double seconds)
+    {
+        if (m_deterministic)
+        {
+            ++m_steps;
+            return 1;
+        }
+        if (!m_started)
+        {
+            m_started = true;
+            m_lastSeconds = seconds;
+            return 0;
+        }
+        m_accumulator += seconds - m_lastSeconds;
+        m_lastSeconds = seconds;
+        int steps = static_cast<int>(m_accumulator / kStepSeconds);
+        m_accumulator -= steps * kStepSeconds;
+        if (steps > kMaxStepsPerFrame)
+        {
+            steps = kMaxStepsPerFrame;
+        }
+        m_steps += steps;
+        return steps;
+    }
+
+    // Advances to the current time on the steady clock.
+    int advance()
+    {
+        auto now = std::chrono::steady_clock::now().time_since_epoch();
+        return advance(std::chrono::duration<double>(now).count());
+    }
+
+    int64_t steps() const { return m_steps; }
+
+    // Simulation time in steps, including the fraction since the last whole step.
+    double T() const { return static_cast<double>(m_steps) + m_accumulator / kStepSeconds; }
+
+    // Returns the new base time when T() has drifted kRebaseInterval steps past 'baseT', else
+    // 'baseT' itself. Base times are whole steps, so they stay exact in double.
+    int64_t rebaseTime(int64_t baseT) const
+    {
+        return m_steps - baseT >= kRebaseInterval ? m_steps : baseT;
+    }
+
+private:
+    const bool m_deterministic;
+    bool m_started = false;
+    double m_lastSeconds = 0;
+    double m_accumulator = 0;
+    int64_t m_steps = 0;
+};
@@ -0,0 +1,448 @@
+/*
+ * Copyright 2022 Rive
+ */
+
+#pragma once
+
+#include "frame_capture.hpp"
+#include <algorithm>
+#include <cerrno>
+#include <condition_variable>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#ifdef _WIN32
+#include <fcntl.h>
+#include <io.h>
+#else
+#include <climits>
+#include <fcntl.h>
+#include <sys/uio.h>
+#include <unistd.h>
+#endif
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#define BUBBLES_SSE2
+#include <emmintrin.h>
+#endif
+
+// Full-range BT.601 (Y4M's "C420jpeg"), in 8.8 fixed point.
+constexpr static int16_t kLumaCoeffs[3] = {77, 150, 29};
+constexpr static int16_t kCbCoeffs[3] = {-43, -85, 128};
+constexpr static int16_t kCrCoeffs[3] = {128, -107, -21};
+
+static inline uint8_t yuv_luma(const uint8_t* p)
+{
+    int y = kLumaCoeffs[0] * p[0] + kLumaCoeffs[1] * p[1] + kLumaCoeffs[2] * p[2];
+    return static_cast<uint8_t>((y + 128) >> 8);
+}
+
+// 'sum' holds the R, G and B of 4 pixels added together.
+static inline uint8_t yuv_chroma(const int* sum, const int16_t* coeffs)
+{
+    int c = coeffs[0] * sum[0] + coeffs[1] * sum[1] + coeffs[2] * sum[2];
+    return static_cast<uint8_t>(std::min((c + (128 << 10) + 512) >> 10, 255));
+}
+
+#ifdef BUBBLES_SSE2
+// Adds the two 32-bit halves of each 64-bit lane of a and of b, and returns the four sums.
+static inline __m128i sum_lane_pairs(__m128i a, __m128i b)
+{
+    a = _mm_add_epi32(a, _mm_srli_epi64(a, 32));
+    b = _mm_add_epi32(b, _mm_srli_epi64(b, 32));
+    return _mm_castps_si128(
+        _mm_shuffle_ps(_mm_castsi128_ps(a), _mm_castsi128_ps(b), _MM_SHUFFLE(2, 0, 2, 0)));
+}
+
+static inline void luma4_sse2(const uint8_t* src, uint8_t* dst)
+{
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i coeffs = _mm_setr_epi16(kLumaCoeffs[0],
+                                          kLumaCoeffs[1],
+                                          kLumaCoeffs[2],
+                                          0,
+                                          kLumaCoeffs[0],
+                                          kLumaCoeffs[1],
+                                          kLumaCoeffs[2],
+                                          0);
+    __m128i px = _mm_loadu_si128(reinterpret_cast<const __m128i*>(src));
+    __m128i y = sum_lane_pairs(_mm_madd_epi16(_mm_unpacklo_epi8(px, zero), coeffs),
+                               _mm_madd_epi16(_mm_unpackhi_epi8(px, zero), coeffs));
+    y = _mm_srli_epi32(_mm_add_epi32(y, _mm_set1_epi32(128)), 8);
+    y = _mm_packus_epi16(_mm_packs_epi32(y, y), y);
+    uint32_t packed = static_cast<uint32_t>(_mm_cvtsi128_si32(y));
+    memcpy(dst, &packed, 4);
+}
+
+// Subsamples a 4x2 block of pixels to two Cb and two Cr samples.
+static inline void chroma4_sse2(const uint8_t* row0, const uint8_t* row1, uint8_t* cb, uint8_t* cr)
+{
+    const __m128i zero = _mm_setzero_si128();
+    __m128i a = _mm_loadu_si128(reinterpret_cast<const __m128i*>(row0));
+    __m128i b = _mm_loadu_si128(reinterpret_cast<const __m128i*>(row1));
+    // Vertical sums of pixels 0 and 1, then 2 and 3, as 16-bit RGBA.
+    __m128i lo = _mm_add_epi16(_mm_unpacklo_epi8(a, zero), _mm_unpacklo_epi8(b, zero));
+    __m128i hi = _mm_add_epi16(_mm_unpackhi_epi8(a, zero), _mm_unpackhi_epi8(b, zero));
+    // Horizontal sums: one 2x2 block per 64-bit lane.
+    lo = _mm_add_epi16(lo, _mm_srli_si128(lo, 8));
+    hi = _mm_add_epi16(hi, _mm_srli_si128(hi, 8));
+    __m128i blocks = _mm_unpacklo_epi64(lo, hi);
+    const __m128i cbCoeffs =
+        _mm_setr_epi16(kCbCoeffs[0], kCbCoeffs[1], kCbCoeffs[2], 0, kCbCoeffs[0], kCbCoeffs[1],
+                       kCbCoeffs[2], 0);
+    const __m128i crCoeffs =
+        _mm_setr_epi16(kCrCoeffs[0], kCrCoeffs[1], kCrCoeffs[2], 0, kCrCoeffs[0], kCrCoeffs[1],
+                       kCrCoeffs[2], 0);
+    __m128i cbcr = sum_lane_pairs(_mm_madd_epi16(blocks, cbCoeffs),
+                                  _mm_madd_epi16(blocks, crCoeffs));
+    cbcr = _mm_srai_epi32(_mm_add_epi32(cbcr, _mm_set1_epi32((128 << 10) + 512)), 10);
+    cbcr = _mm_packus_epi16(_mm_packs_epi32(cbcr, cbcr), cbcr);
+    uint32_t packed = static_cast<uint32_t>(_mm_cvtsi128_si32(cbcr));
+    cb[0] = static_cast<uint8_t>(packed);
+    cb[1] = static_cast<uint8_t>(packed >> 8);
+    cr[0] = static_cast<uint8_t>(packed >> 16);
+    cr[1] = static_cast<uint8_t>(packed >> 24);
+}
+#endif
+
+// Converts RGBA8 pixels, bottom row first (as GL reads them), to planar 4:2:0 YCbCr, top row
+// first. The chroma planes are (width + 1) / 2 x (height + 1) / 2. With SSE2, 4x2 blocks of
+// pixels convert at once.
+static inline void rgba_to_yuv420(const uint8_t* rgba,
+                                  int width,
+                                  int height,
+                                  uint8_t* yPlane,
+                                  uint8_t* cbPlane,
+                                  uint8_t* crPlane)
+{
+    size_t rowBytes = static_cast<size_t>(width) * 4;
+    int chromaWidth = (width + 1) / 2;
+    for (int y = 0; y < height; y += 2)
+    {
+        int yNext = std::min(y + 1, height - 1);
+        const uint8_t* row0 = rgba + (height - 1 - y) * rowBytes;
+        const uint8_t* row1 = rgba + (height - 1 - yNext) * rowBytes;
+        uint8_t* luma0 = yPlane + static_cast<size_t>(y) * width;
+        uint8_t* luma1 = yPlane + static_cast<size_t>(yNext) * width;
+        uint8_t* cb = cbPlane + static_cast<size_t>(y / 2) * chromaWidth;
+        uint8_t* cr = crPlane + static_cast<size_t>(y / 2) * chromaWidth;
+        int x = 0;
+#ifdef BUBBLES_SSE2
+        for (; x + 4 <= width; x += 4)
+        {
+            luma4_sse2(row0 + x * 4, luma0 + x);
+            luma4_sse2(row1 + x * 4, luma1 + x);
+            chroma4_sse2(row0 + x * 4, row1 + x * 4, cb + x / 2, cr + x / 2);
+        }
+#endif
+        for (; x < width; x += 2)
+        {
+            int xNext = std::min(x + 1, width - 1);
+            const uint8_t* block[4] = {row0 + x * 4,
+                                       row0 + xNext * 4,
+                                       row1 + x * 4,
+                                       row1 + xNext * 4};
+            luma0[x] = yuv_luma(block[0]);
+            luma0[xNext] = yuv_luma(block[1]);
+            luma1[x] = yuv_luma(block[2]);
+            luma1[xNext] = yuv_luma(block[3]);
+            int sum[3] = {};
+            for (const uint8_t* p : block)
+            {
+                sum[0] += p[0];
+                sum[1] += p[1];
+                sum[2] += p[2];
+            }
+            cb[x / 2] = yuv_chroma(sum, kCbCoeffs);
+            cr[x / 2] = yuv_chroma(sum, kCrCoeffs);
+        }
+    }
+}
+
+enum class VideoFormat
+{
+    Y4M,  // YUV4MPEG2, 4:2:0.
+    RGBA, // Raw RGBA8 frames, top row first, no header.
+};
+
+// What to do with a frame when the encoder hasn't drained the queue.
+enum class QueuePolicy
+{
+    Drop,  // Skip the frame; rendering never waits on the encoder.
+    Block, // Wait for room, which holds up capture and, through the capture ring, rendering.
+};
+
+// Streams every frame it gets to a file or stdout as uncompressed video. The capture thread
+// converts each frame into one of a few preallocated buffers; a writer thread sends whole batches
+// of queued frames with one writev() per batch.
+class VideoSink : public FrameSink
+{
+public:
+    constexpr static int kQueueDepth = 4;
+
+    // 'path' is a file name or "-" for stdout. Writing video to stdout moves everything else the
+    // process prints to stdout over to stderr.
+    static std::unique_ptr<VideoSink> Open(const char* path,
+                                           VideoFormat format,
+                                           QueuePolicy policy,
+                                           int fps)
+    {
+        int fd;
+        if (!strcmp(path, "-"))
+        {
+            fflush(stdout);
+#ifdef _WIN32
+            fd = _dup(1);
+            _dup2(2, 1);
+            _setmode(fd, _O_BINARY);
+#else
+            fd = dup(1);
+            dup2(2, 1);
+#endif
+        }
+        else
+        {
+#ifdef _WIN32
+            fd = _open(path, _O_WRONLY | _O_CREAT | _O_TRUNC | _O_BINARY, 0644);
+#else
+            fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+#endif
+        }
+        if (fd < 0)
+        {
+            fprintf(stderr, "Failed to open %s for video output.\n", path);
+            return nullptr;
+        }
+        return std::unique_ptr<VideoSink>(new VideoSink(fd, format, policy, fps));
+    }
+
+    ~VideoSink() override
+    {
+        {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            m_quit = true;
+        }
+        m_cv.notify_all();
+        m_writer.join();
+#ifdef _WIN32
+        _close(m_fd);
+#else
+        close(m_fd);
+#endif
+    }
+
+    FrameWrite writeFrame(const uint8_t* pixels, int width, int height, uint64_t) override
+    {
+        if (m_width == 0)
+        {
+            m_width = width;
+            m_height = height;
+            size_t bytes = m_format == VideoFormat::Y4M
+                               ? static_cast<size_t>(width) * height +
+                                     2 * static_cast<size_t>((width + 1) / 2) * ((height + 1) / 2)
+                               : static_cast<size_t>(width) * height * 4;
+            std::lock_guard<std::mutex> lock(m_mutex);
+            for (auto& buffer : m_buffers)
+            {
+                buffer.resize(bytes);
+                m_free.push_back(&buffer);
+            }
+        }
+        else if (width != m_width || height != m_height)
+        {
+            // A stream has one frame size; frames after a resize are dropped.
+            return FrameWrite::Dropped;
+        }
+
+        std::vector<uint8_t>* buffer;
+        {
+            std::unique_lock<std::mutex> lock(m_mutex);
+            if (m_failed)
+            {
+                return FrameWrite::Failed;
+            }
+            if (m_free.empty() && m_policy == QueuePolicy::Drop)
+            {
+                return FrameWrite::Dropped;
+            }
+            m_cv.wait(lock, [this]() { return !m_free.empty() || m_failed; });
+            if (m_failed)
+            {
+                return FrameWrite::Failed;
+            }
+            buffer = m_free.front();
+            m_free.pop_front();
+        }
+
+        uint8_t* dst = buffer->data();
+        if (m_format == VideoFormat::Y4M)
+        {
+            size_t lumaBytes = static_cast<size_t>(width) * height;
+            size_t chromaBytes = static_cast<size_t>((width + 1) / 2) * ((height + 1) / 2);
+            rgba_to_yuv420(pixels,
+                           width,
+                           height,
+                           dst,
+                           dst + lumaBytes,
+                           dst + lumaBytes + chromaBytes);
+        }
+        else
+        {
+            size_t rowBytes = static_cast<size_t>(width) * 4;
+            for (int y = 0; y < height; ++y)
+            {
+                memcpy(dst + y * rowBytes, pixels + (height - 1 - y) * rowBytes, rowBytes);
+            }
+        }
+
+        {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            m_ready.push_back(buffer);
+        }
+        m_cv.notify_all();
+        return FrameWrite::Kept;
+    }
+
+private:
+    VideoSink(int fd, VideoFormat format, QueuePolicy policy, int fps) :
+        m_fd(fd), m_format(format), m_policy(policy), m_fps(fps)
+    {
+        m_writer = std::thread([this]() { writerMain(); });
+    }
+
+    void writerMain()
+    {
+        static const char frameHeader[] = "FRAME\n";
+        std::string streamHeader;
+        std::vector<std::vector<uint8_t>*> batch;
+        batch.reserve(kQueueDepth);
+        for (;;)
+        {
+            {
+                std::unique_lock<std::mutex> lock(m_mutex);
+                m_cv.wait(lock, [this]() { return m_quit || !m_ready.empty(); });
+                if (m_ready.empty())
+                {
+                    break;
+                }
+                batch.assign(m_ready.begin(), m_ready.end());
+                m_ready.clear();
+            }
+
+            std::vector<Chunk> chunks;
+            if (m_format == VideoFormat::Y4M && streamHeader.empty())
+            {
+                streamHeader = "YUV4MPEG2 W" + std::to_string(m_width) + " H" +
+                               std::to_string(m_height) + " F" + std::to_string(m_fps) +
+                               ":1 Ip A1:1 C420jpeg\n";
+                chunks.push_back({streamHeader.data(), streamHeader.size()});
+            }
+            for (std::vector<uint8_t>* buffer : batch)
+            {
+                if (m_format == VideoFormat::Y4M)
+                {
+                    chunks.push_back({frameHeader, sizeof(frameHeader) - 1});
+                }
+                chunks.push_back({buffer->data(), buffer->size()});
+            }
+            bool written = write_chunks(chunks);
+
+            {
+                std::lock_guard<std::mutex> lock(m_mutex);
+                m_free.insert(m_free.end(), batch.begin(), batch.end());
+                if (!written && !m_failed)
+                {
+                    fprintf(stderr, "Video output failed; no longer writing frames.\n");
+                    m_failed = true;
+                }
+            }
+            m_cv.notify_all();
+        }
+    }
+
+    struct Chunk
+    {
+        const void* data;
+        size_t size;
+    };
+
+    // Writes every chunk in order, with as few system calls as the platform allows.
+    bool write_chunks(std::vector<Chunk>& chunks)
+    {
+#ifdef _WIN32
+        for (const Chunk& chunk : chunks)
+        {
+            const char* data = static_cast<const char*>(chunk.data);
+            size_t remaining = chunk.size;
+            while (remaining > 0)
+            {
+                int written = _write(m_fd, data, static_cast<unsigned>(std::min<size_t>(
+                                                     remaining, 1 << 30)));
+                if (written <= 0)
+                {
+                    return false;
+                }
+                data += written;
+                remaining -= written;
+            }
+        }
+        return true;
+#else
+        std::vector<iovec> iov;
+        for (const Chunk& chunk : chunks)
+        {
+            iov.push_back({const_cast<void*>(chunk.data), chunk.size});
+        }
+        size_t first = 0;
+        while (first < iov.size())
+        {
+            int count = static_cast<int>(std::min<size_t>(iov.size() - first, IOV_MAX));
+            ssize_t written = writev(m_fd, iov.data() + first, count);
+            if (written < 0)
+            {
+                if (errno == EINTR)
+                {
+                    continue;
+                }
+                return false;
+            }
+            // Skip what was written, which can end partway through a chunk.
+            size_t remaining = static_cast<size_t>(written);
+            while (first < iov.size() && remaining >= iov[first].iov_len)
+            {
+                remaining -= iov[first].iov_len;
+                ++first;
+            }
+            if (remaining > 0)
+            {
+                iov[first].iov_base = static_cast<char*>(iov[first].iov_base) + remaining;
+                iov[first].iov_len -= remaining;
+            }
+        }
+        return true;
+#endif
+    }
+
+    const int m_fd;
+    const VideoFormat m_format;
+    const QueuePolicy m_policy;
+    const int m_fps;
+    // Set by the first frame, on the capture thread, before any frame reaches the writer.
+    int m_width = 0;
+    int m_height = 0;
+    std::vector<uint8_t> m_buffers[kQueueDepth];
+    std::mutex m_mutex;
+    std::condition_variable m_cv;
+    std::deque<std::vector<uint8_t>*> m_free;
+    std::deque<std::vector<uint8_t>*> m_ready;
+    bool m_failed = false;
+    bool m_quit = false;
+    std::thread m_writer;
+};